@@ -0,0 +1,223 @@
+/* analysisPipeline.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __ANALYSIS_PIPELINE_H__
+#define __ANALYSIS_PIPELINE_H__
+
+#include <limits.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <epicsGuard.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <workerRunnable.h>
+
+namespace epics { namespace neutronServer {
+
+/** Hands received updates from a monitor callback to a pool of analysis threads
+ *
+ *  The callback thread only push()es each update into a ring of slots,
+ *  so heavier analysis doesn't delay the client library.
+ *  Analysis threads claim slots via an atomic sequence number, without locks,
+ *  and call analyze() in parallel.
+ *  complete() is then called for each update in the order they were pushed,
+ *  one at a time, for example to check pulse IDs.
+ *  Finally, release() is called outside of that serialization,
+ *  so it may hand the update back to the client library
+ *  even if that calls push() from within.
+ *
+ *  push() blocks while 'capacity' updates are pushed but not completed,
+ *  which leaves the updates in the client library's queue.
+ *
+ *  Derived class must call start() and shutdown().
+ */
+template <class Item>
+class AnalysisPipeline
+{
+public:
+    /** @param threads Number of analysis threads
+     *  @param capacity Maximum number of updates in the pipeline, rounded up to a power of 2
+     */
+    AnalysisPipeline(size_t threads, size_t capacity)
+    : threads(threads), capacity(1), do_run(true),
+      pushed(0), popped(0), completed(0),
+      queued_high(0), pending_high(0), full_waits(0)
+    {
+        while (this->capacity < capacity)
+            this->capacity <<= 1;
+        slots.reset(new Slot[this->capacity]);
+    }
+
+    virtual ~AnalysisPipeline() {}
+
+    size_t getThreadCount() const
+    {
+        return threads;
+    }
+
+    /** Start the analysis threads */
+    void start()
+    {
+        for (size_t i=0; i<threads; ++i)
+        {
+            runners.push_back(std::shared_ptr<Runner>(new Runner(*this)));
+            std::shared_ptr<epicsThread> thread(new epicsThread(*runners.back(), "Analysis",
+                                                                epicsThreadGetStackSize(epicsThreadStackMedium)));
+            thread->start();
+            running.push_back(thread);
+        }
+    }
+
+    /** Add update
+     *
+     *  Usually called by the one callback thread,
+     *  but the client library may also call back from within release().
+     */
+    void push(const Item &item)
+    {
+        epicsGuard<epicsMutex> guard(pushing);
+        uint32_t n = pushed.load(), done;
+        while (n - (done = completed.load()) >= capacity)
+        {
+            ++full_waits;
+            WorkerRunnable::waitWhileEquals(completed, done);
+        }
+        slots[n & (capacity-1)].item = item;
+        pushed = n + 1;
+        WorkerRunnable::wake(pushed);
+
+        uint32_t queued = n + 1 - popped.load(), pending = n + 1 - completed.load();
+        if (queued > queued_high)
+            queued_high = queued;
+        if (pending > pending_high)
+            pending_high = pending;
+    }
+
+    /** Get and reset high-water marks
+     *  @param queued Most updates waiting for an analysis thread
+     *  @param pending Most updates pushed but not completed
+     *  @param full Number of times that push() had to wait
+     */
+    void takeHighWater(uint32_t &queued, uint32_t &pending, uint64_t &full)
+    {
+        queued = queued_high.exchange(0);
+        pending = pending_high.exchange(0);
+        full = full_waits.exchange(0);
+    }
+
+    /** Complete the pushed updates, then stop the analysis threads */
+    void shutdown()
+    {
+        uint32_t done;
+        while ((done = completed.load()) != pushed.load())
+            WorkerRunnable::waitWhileEquals(completed, done);
+        do_run = false;
+        for (size_t i=0; i<running.size(); ++i)
+            while (! running[i]->exitWait(0.01))
+                WorkerRunnable::wake(pushed, INT_MAX);
+        running.clear();
+        runners.clear();
+    }
+
+protected:
+    /** Analyze an update, called by several threads in parallel */
+    virtual void analyze(Item &item) = 0;
+
+    /** Complete an update, called in the order of push(), one update at a time */
+    virtual void complete(Item &item) = 0;
+
+    /** Release a completed update, called by several threads in parallel */
+    virtual void release(Item &item)
+    {}
+
+private:
+    struct Slot
+    {
+        Slot() : analyzed(false) {}
+        Item item;
+        std::atomic<bool> analyzed;
+    };
+
+    class Runner : public epicsThreadRunable
+    {
+        AnalysisPipeline &pipeline;
+        /** Updates that this thread completed, to be released */
+        std::vector<Item> finished;
+    public:
+        Runner(AnalysisPipeline &pipeline) : pipeline(pipeline) {}
+        void run()
+        {
+            pipeline.analyzeUpdates(finished);
+        }
+    };
+
+    void analyzeUpdates(std::vector<Item> &finished)
+    {
+        while (do_run)
+        {
+            uint32_t n = popped.load();
+            if (n == pushed.load())
+            {
+                WorkerRunnable::waitWhileEquals(pushed, n, &do_run);
+                continue;
+            }
+            if (! popped.compare_exchange_weak(n, n + 1))
+                continue;
+            Slot &slot = slots[n & (capacity-1)];
+            analyze(slot.item);
+            slot.analyzed = true;
+            completeInOrder(finished);
+            for (size_t i=0; i<finished.size(); ++i)
+                release(finished[i]);
+            finished.clear();
+        }
+    }
+
+    /** Complete all analyzed updates up to the first one that's still being analyzed
+     *  @param finished Completed updates are moved there
+     */
+    void completeInOrder(std::vector<Item> &finished)
+    {
+        epicsGuard<epicsMutex> guard(completion);
+        while (true)
+        {
+            uint32_t n = completed.load();
+            Slot &slot = slots[n & (capacity-1)];
+            if (n == pushed.load()  ||  ! slot.analyzed)
+                return;
+            complete(slot.item);
+            // Take the update out of the slot
+            finished.push_back(std::move(slot.item));
+            slot.item = Item();
+            slot.analyzed = false;
+            completed = n + 1;
+            WorkerRunnable::wake(completed);
+        }
+    }
+
+    size_t threads;
+    uint32_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    std::vector<std::shared_ptr<Runner> > runners;
+    std::vector<std::shared_ptr<epicsThread> > running;
+    std::atomic<bool> do_run;
+
+    /** Sequence numbers of the last pushed, claimed and completed updates */
+    std::atomic<uint32_t> pushed, popped, completed;
+
+    /** Serializes push() */
+    epicsMutex pushing;
+
+    /** Serializes complete() */
+    epicsMutex completion;
+
+    std::atomic<uint32_t> queued_high, pending_high;
+    std::atomic<uint64_t> full_waits;
+};
+
+}} // namespace neutronServer, epics
+#endif // __ANALYSIS_PIPELINE_H__
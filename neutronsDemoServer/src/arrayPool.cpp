@@ -0,0 +1,153 @@
+/* arrayPool.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdexcept>
+#include <arrayPool.h>
+#include <numaPlacement.h>
+
+namespace epics { namespace neutronServer {
+
+typedef epicsGuard<epicsMutex> Guard;
+
+std::shared_ptr<ArrayPool> ArrayPool::create(size_t max_free)
+{
+    return std::shared_ptr<ArrayPool>(new ArrayPool(max_free));
+}
+
+ArrayPool::ArrayPool(size_t max_free)
+: max_free(max_free), numa_node(-1), hits(0), misses(0)
+{
+}
+
+ArrayPool::~ArrayPool()
+{   // Deleters hold a reference to the pool,
+    // so all buffers handed out have been released
+    for (unsigned c=0; c<CLASSES; ++c)
+        for (size_t i=0; i<free_buffers[c].size(); ++i)
+            delete [] free_buffers[c][i];
+}
+
+unsigned ArrayPool::getSizeClass(size_t count)
+{
+    unsigned size_class = MIN_CLASS;
+    while ((size_t(1) << size_class) < count)
+        ++size_class;
+    if (size_class >= CLASSES)
+        throw std::length_error("ArrayPool: Array too large");
+    return size_class;
+}
+
+uint32_t *ArrayPool::newBuffer(unsigned size_class)
+{
+    size_t count = size_t(1) << size_class;
+    uint32_t *buffer = new uint32_t[count];
+    if (numa_node >= 0)
+        bindToNumaNode(buffer, count * sizeof(uint32_t), numa_node);
+    // Touch each page so that page faults happen now,
+    // not while filling the array for a pulse
+    for (size_t i=0; i<count; i += 1024)
+        buffer[i] = 0;
+    return buffer;
+}
+
+uint32_t *ArrayPool::get(unsigned size_class)
+{
+    {
+        Guard guard(mutex);
+        std::vector<uint32_t *> &buffers = free_buffers[size_class];
+        if (! buffers.empty())
+        {
+            uint32_t *buffer = buffers.back();
+            buffers.pop_back();
+            ++hits;
+            return buffer;
+        }
+        ++misses;
+    }
+    // Allocate outside of lock
+    return newBuffer(size_class);
+}
+
+void ArrayPool::release(uint32_t *buffer, unsigned size_class)
+{
+    {
+        Guard guard(mutex);
+        std::vector<uint32_t *> &buffers = free_buffers[size_class];
+        if (buffers.size() < max_free)
+        {
+            buffers.push_back(buffer);
+            return;
+        }
+    }
+    // Pool is full
+    delete [] buffer;
+}
+
+#ifdef USE_PVXS
+pvxs::shared_array<uint32_t> ArrayPool::allocate(size_t count)
+{
+    unsigned size_class = getSizeClass(count);
+    Release release = { shared_from_this(), size_class };
+    return pvxs::shared_array<uint32_t>(get(size_class), release, count);
+}
+#else
+epics::pvData::shared_vector<epics::pvData::uint32> ArrayPool::allocate(size_t count)
+{
+    unsigned size_class = getSizeClass(count);
+    Release release = { shared_from_this(), size_class };
+    return epics::pvData::shared_vector<epics::pvData::uint32>(get(size_class), release, 0, count);
+}
+#endif
+
+// Buffers come from new uint32_t[], which is aligned for any fundamental type,
+// so they can also hold uint64 elements
+#ifdef USE_PVXS
+pvxs::shared_array<uint64_t> ArrayPool::allocatePacked(size_t count)
+{
+    unsigned size_class = getSizeClass(2*count);
+    Release release = { shared_from_this(), size_class };
+    return pvxs::shared_array<uint64_t>(reinterpret_cast<uint64_t *>(get(size_class)), release, count);
+}
+#else
+epics::pvData::shared_vector<epics::pvData::uint64> ArrayPool::allocatePacked(size_t count)
+{
+    unsigned size_class = getSizeClass(2*count);
+    Release release = { shared_from_this(), size_class };
+    return epics::pvData::shared_vector<epics::pvData::uint64>(reinterpret_cast<epics::pvData::uint64 *>(get(size_class)),
+                                                               release, 0, count);
+}
+#endif
+
+void ArrayPool::reserve(size_t count, size_t buffers)
+{
+    unsigned size_class = getSizeClass(count);
+    for (size_t i=0; i<buffers; ++i)
+    {
+        uint32_t *buffer = newBuffer(size_class);
+        Guard guard(mutex);
+        free_buffers[size_class].push_back(buffer);
+        // Keep all reserved buffers when they're released again
+        if (free_buffers[size_class].size() > max_free)
+            max_free = free_buffers[size_class].size();
+    }
+}
+
+void ArrayPool::setNumaNode(int node)
+{
+    numa_node = node;
+}
+
+uint64_t ArrayPool::getHits()
+{
+    Guard guard(mutex);
+    return hits;
+}
+
+uint64_t ArrayPool::getMisses()
+{
+    Guard guard(mutex);
+    return misses;
+}
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,121 @@
+/* arrayPool.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __ARRAY_POOL_H__
+#define __ARRAY_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include <epicsMutex.h>
+
+#ifdef USE_PVXS
+#    include <pvxs/sharedArray.h>
+#else
+#    include <pv/sharedVector.h>
+#endif
+
+namespace epics { namespace neutronServer {
+
+/** Pool of recycled uint32 arrays for the per-pulse event data
+ *
+ *  Allocating and freeing new multi-megabyte arrays for each pulse
+ *  results in malloc/free churn and page faults.
+ *  This pool keeps buffers in power-of-two size classes.
+ *  Buffers are pre-faulted when first allocated.
+ *  When the last reference to an array handed out by allocate()
+ *  is dropped, for example after pvDatabase or the PVXS monitor
+ *  queues sent the data to all clients, the custom deleter returns
+ *  the buffer to the pool.
+ *
+ *  Must be created via ArrayPool::create() because the deleters keep
+ *  a reference to the pool, so it can outlive its creator.
+ */
+class ArrayPool : public std::enable_shared_from_this<ArrayPool>
+{
+public:
+    /** @param max_free Maximum number of unused buffers to keep per size class */
+    static std::shared_ptr<ArrayPool> create(size_t max_free = 16);
+
+    ~ArrayPool();
+
+    /** Get array for 'count' elements, from pool or newly allocated.
+     *  Content of the array is undefined.
+     */
+#ifdef USE_PVXS
+    pvxs::shared_array<uint32_t> allocate(size_t count);
+#else
+    epics::pvData::shared_vector<epics::pvData::uint32> allocate(size_t count);
+#endif
+
+    /** Get uint64 array for 'count' elements of the packed event layout.
+     *  Uses the same buffers as allocate(2*count).
+     */
+#ifdef USE_PVXS
+    pvxs::shared_array<uint64_t> allocatePacked(size_t count);
+#else
+    epics::pvData::shared_vector<epics::pvData::uint64> allocatePacked(size_t count);
+#endif
+
+    /** Pre-allocate buffers
+     *
+     *  Raises the maximum number of unused buffers kept per size class
+     *  so that the pool can hold all of them.
+     *  @param count Number of elements per buffer
+     *  @param buffers Number of buffers to add to the pool
+     */
+    void reserve(size_t count, size_t buffers);
+
+    /** Place newly allocated buffers on a NUMA node, see numaPlacement.h.
+     *  Call before reserve().
+     *  @param node NUMA node, -1 for default placement
+     */
+    void setNumaNode(int node);
+
+    /** @return Number of allocate() calls served from the pool */
+    uint64_t getHits();
+
+    /** @return Number of allocate() calls that required a new buffer */
+    uint64_t getMisses();
+
+private:
+    /** Custom deleter that returns buffer to pool */
+    struct Release
+    {
+        std::shared_ptr<ArrayPool> pool;
+        unsigned size_class;
+        void operator()(uint32_t *buffer)
+        {
+            pool->release(buffer, size_class);
+        }
+        void operator()(uint64_t *buffer)
+        {
+            pool->release(reinterpret_cast<uint32_t *>(buffer), size_class);
+        }
+    };
+
+    /** Smallest size class, 2^MIN_CLASS elements */
+    static const unsigned MIN_CLASS = 10;
+    /** Number of size classes */
+    static const unsigned CLASSES = 48;
+
+    ArrayPool(size_t max_free);
+
+    static unsigned getSizeClass(size_t count);
+    uint32_t *newBuffer(unsigned size_class);
+    uint32_t *get(unsigned size_class);
+    void release(uint32_t *buffer, unsigned size_class);
+
+    size_t max_free;
+    int numa_node;
+
+    epicsMutex mutex;
+    std::vector<uint32_t *> free_buffers[CLASSES];
+    uint64_t hits, misses;
+};
+
+}} // namespace neutronServer, epics
+#endif // __ARRAY_POOL_H__
@@ -0,0 +1,653 @@
+/* backendBenchmark.cpp
+ *
+ * A/B comparison of the two server backends,
+ * pvDatabase NeutronPVRecord and PVXS DecimatingSource,
+ * in one executable that links both.
+ * Built with USE_PVXS, see Makefile.
+ * Each backend serves identical generator output
+ * to a monitor client in the same process.
+ *
+ * With -m or -x, measures the server CPU per PVXS subscriber
+ * for a range of decimation settings instead.
+ * The subscribers then run in a separate process,
+ * so the CPU time of this process is all server-side.
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include "neutronPVRecord.h"
+#include "pvxsNeutrons.h"
+#include "eventGenerator.h"
+#include "nanoTimer.h"
+#include "pulseScheduler.h"
+#include "monitorDecimation.h"
+
+#include <pv/pvData.h>
+#include <pv/pvAccess.h>
+#include <pv/clientFactory.h>
+#include <pv/createRequest.h>
+#include <pv/event.h>
+#include <pv/monitor.h>
+#include <pv/channelProviderLocal.h>
+#include <pv/serverContext.h>
+
+#include <pvxs/client.h>
+#include <pvxs/server.h>
+
+#ifndef USE_PVXS
+#   error "Needs the PVXS build for DecimatingSource, see Makefile"
+#endif
+
+using namespace std;
+using namespace epics::neutronServer;
+using namespace epics::pvData;
+using namespace epics::pvAccess;
+using namespace epics::pvDatabase;
+
+/** Allocations via operator new, by all threads and by the current thread.
+ *  Memory that libraries get via malloc() is not counted.
+ */
+static atomic<uint64_t> allocations(0);
+static thread_local uint64_t thread_allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    ++thread_allocations;
+    void *p = malloc(size > 0 ? size : 1);
+    if (! p)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+/** One way of serving the events, with a monitor client that counts what it receives */
+class Backend
+{
+public:
+    Backend() : received(0) {}
+    virtual ~Backend() {}
+
+    virtual const char *getName() const = 0;
+
+    /** Copy the events into the backend's own arrays and post them */
+    virtual void post(uint32_t id, double charge, const vector<uint32_t> &tof, const vector<uint32_t> &pixel) = 0;
+
+    /** @return Pulses received by the client so far */
+    uint64_t getReceived() const
+    {
+        return received.load();
+    }
+
+protected:
+    atomic<uint64_t> received;
+};
+
+class BackendChannelRequester : public ChannelRequester
+{
+    Event connect_event;
+public:
+    string getRequesterName()
+    {   return "BackendChannelRequester"; }
+
+    void channelCreated(const Status& status, Channel::shared_pointer const & channel)
+    {}
+
+    void channelStateChange(Channel::shared_pointer const & channel, Channel::ConnectionState connectionState)
+    {
+        if (connectionState == Channel::CONNECTED)
+            connect_event.signal();
+    }
+
+    bool waitUntilConnected(double timeout)
+    {
+        return connect_event.wait(timeout);
+    }
+};
+
+class BackendMonitorRequester : public MonitorRequester
+{
+    atomic<uint64_t> &received;
+    Event connect_event;
+public:
+    BackendMonitorRequester(atomic<uint64_t> &received) : received(received)
+    {}
+
+    string getRequesterName()
+    {   return "BackendMonitorRequester"; }
+
+    void monitorConnect(Status const & status, MonitorPtr const & monitor, StructureConstPtr const & structure)
+    {
+        if (! status.isSuccess())
+            return;
+        monitor->start();
+        connect_event.signal();
+    }
+
+    void monitorEvent(MonitorPtr const & monitor)
+    {
+        shared_ptr<MonitorElement> update;
+        while ((update = monitor->poll()))
+        {
+            ++received;
+            monitor->release(update);
+        }
+    }
+
+    void unlisten(MonitorPtr const & monitor)
+    {}
+
+    bool waitUntilConnected(double timeout)
+    {
+        return connect_event.wait(timeout);
+    }
+};
+
+/** NeutronPVRecord served by the pvAccess server */
+class PVDatabaseBackend : public Backend
+{
+public:
+    PVDatabaseBackend(const string &request)
+    {
+        record = NeutronPVRecord::create("backend:pvdatabase");
+        if (! record  ||  ! PVDatabase::getMaster()->addRecord(record))
+            throw runtime_error("Cannot add record 'backend:pvdatabase'");
+        server = startPVAServer(PVACCESS_ALL_PROVIDERS,0,true,true);
+        ClientFactory::start();
+        ChannelProvider::shared_pointer provider = ChannelProviderRegistry::clients()->getProvider("pva");
+        shared_ptr<BackendChannelRequester> channel_requester(new BackendChannelRequester());
+        channel = provider->createChannel("backend:pvdatabase", channel_requester);
+        if (! channel_requester->waitUntilConnected(5.0))
+            throw runtime_error("Cannot connect to 'backend:pvdatabase'");
+        shared_ptr<BackendMonitorRequester> monitor_requester(new BackendMonitorRequester(received));
+        monitor = channel->createMonitor(monitor_requester, CreateRequest::create()->createRequest(request));
+        monitor_requester->waitUntilConnected(5.0);
+    }
+
+    ~PVDatabaseBackend()
+    {
+        monitor->stop();
+        monitor->destroy();
+        channel->destroy();
+        ClientFactory::stop();
+        server->shutdown();
+        PVDatabase::getMaster()->removeRecord(record);
+    }
+
+    const char *getName() const
+    {
+        return "pvDatabase";
+    }
+
+    void post(uint32_t id, double charge, const vector<uint32_t> &tof, const vector<uint32_t> &pixel)
+    {
+        shared_vector<uint32> tof_data(tof.size()), pixel_data(pixel.size());
+        copy(tof.begin(), tof.end(), tof_data.begin());
+        copy(pixel.begin(), pixel.end(), pixel_data.begin());
+        record->update(id, charge, freeze(tof_data), freeze(pixel_data));
+    }
+
+private:
+    NeutronPVRecord::shared_pointer record;
+    ServerContext::shared_pointer server;
+    Channel::shared_pointer channel;
+    Monitor::shared_pointer monitor;
+};
+
+/** Monitor a PVXS channel
+ *  @param received Incremented for each update
+ */
+static shared_ptr<pvxs::client::Subscription> subscribe(pvxs::client::Context &client, const string &name,
+                                                        const string &request, atomic<uint64_t> &received)
+{
+    atomic<uint64_t> *count = &received;
+    return client.monitor(name)
+                 .pvRequest(request)
+                 .event([count](pvxs::client::Subscription &sub)
+    {
+        while (true)
+        {
+            try
+            {
+                while (sub.pop())
+                    ++*count;
+                return;
+            }
+            catch (pvxs::client::Connected &)
+            {   // Continue with the updates that follow
+            }
+            catch (std::exception &ex)
+            {
+                cerr << "Monitor error: " << ex.what() << endl;
+                return;
+            }
+        }
+    }).exec();
+}
+
+/** DecimatingSource served by an isolated PVXS server, like the PVXS build of the demo server */
+class PVXSBackend : public Backend
+{
+public:
+    /** @param request Request of the in-process client, empty to only serve */
+    PVXSBackend(const string &request)
+    : update(Neutrons().create()),
+      source(new DecimatingSource(vector<string>(1, "backend:pvxs"), Neutrons().create()))
+    {
+        server = pvxs::server::Config::isolated().build().addSource("backend", source);
+        server.start();
+        if (request.empty())
+            return;
+        client = server.clientConfig().build();
+        monitor = subscribe(client, "backend:pvxs", request, received);
+    }
+
+    ~PVXSBackend()
+    {
+        monitor.reset();
+        server.stop();
+    }
+
+    const char *getName() const
+    {
+        return "pvxs";
+    }
+
+    /** @return Client configuration for reaching the isolated server */
+    pvxs::client::Config getClientConfig() const
+    {
+        return server.clientConfig();
+    }
+
+    /** Same steps as NeutronEventRunnable::publish() in a PVXS build, plus copying the arrays */
+    void post(uint32_t id, double charge, const vector<uint32_t> &tof, const vector<uint32_t> &pixel)
+    {
+        pvxs::shared_array<uint32_t> tof_data(tof.size()), pixel_data(pixel.size());
+        copy(tof.begin(), tof.end(), tof_data.begin());
+        copy(pixel.begin(), pixel.end(), pixel_data.begin());
+        update.setPulse(id, charge);
+        update.time_of_flight = tof_data.freeze();
+        update.pixel = pixel_data.freeze();
+        source->post(0, update.clone());
+    }
+
+private:
+    NeutronsValue update;
+    shared_ptr<DecimatingSource> source;
+    pvxs::server::Server server;
+    pvxs::client::Context client;
+    shared_ptr<pvxs::client::Subscription> monitor;
+};
+
+/** Pre-generated pulses, so every backend posts the same data
+ *  and generating it is not part of the measurement
+ */
+struct Pulses
+{
+    vector<vector<uint32_t> > tof, pixel;
+
+    Pulses(size_t count, size_t pulses)
+    : tof(pulses, vector<uint32_t>(count)), pixel(pulses, vector<uint32_t>(count))
+    {
+        EventGenerator generator(42);
+        for (size_t i=0; i<pulses; ++i)
+        {
+            generator.setPulse(i, true, 1, 0);
+            generator.fillTimeOfFlight(&tof[i][0], count);
+            generator.fillPixel(&pixel[i][0], 0, count, 0);
+        }
+    }
+};
+
+static void benchmark(Backend &backend, size_t count, const Pulses &pulses, double delay, double seconds)
+{
+    const size_t N = pulses.tof.size();
+    uint32_t id = 0;
+
+    // Cost per pulse at the given rate
+    uint64_t received = backend.getReceived();
+    uint64_t thread_cpu = NanoTimer::getNanosecs(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t process_cpu = NanoTimer::getNanosecs(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t thread_allocs = thread_allocations, process_allocs = allocations.load();
+    PulseScheduler scheduler(delay);
+    uint64_t end = NanoTimer::getCurrentNanosecs() + uint64_t(seconds * 1e9);
+    uint64_t posted = 0;
+    while (NanoTimer::getCurrentNanosecs() < end)
+    {
+        scheduler.waitForNext();
+        backend.post(++id, 1e8, pulses.tof[posted % N], pulses.pixel[posted % N]);
+        ++posted;
+    }
+    // Allow last updates to arrive
+    epicsThreadSleep(0.5);
+    thread_cpu = NanoTimer::getNanosecs(CLOCK_THREAD_CPUTIME_ID) - thread_cpu;
+    process_cpu = NanoTimer::getNanosecs(CLOCK_PROCESS_CPUTIME_ID) - process_cpu;
+    thread_allocs = thread_allocations - thread_allocs;
+    process_allocs = allocations.load() - process_allocs;
+    received = backend.getReceived() - received;
+    double lost = posted > 0 ? 100.0 * (1.0 - double(received) / posted) : 0.0;
+
+    // Maximum sustainable rate: Post back-to-back,
+    // count only what the client kept up with
+    received = backend.getReceived();
+    uint64_t start = NanoTimer::getCurrentNanosecs();
+    end = start + uint64_t(seconds * 1e9);
+    uint64_t flat_out = 0;
+    while (NanoTimer::getCurrentNanosecs() < end)
+    {
+        backend.post(++id, 1e8, pulses.tof[flat_out % N], pulses.pixel[flat_out % N]);
+        ++flat_out;
+    }
+    double elapsed = (NanoTimer::getCurrentNanosecs() - start) * 1e-9;
+    epicsThreadSleep(0.5);
+    double rate = (backend.getReceived() - received) / elapsed;
+
+    cout << setw(11) << backend.getName() << setw(9) << count
+         << setw(10) << (posted > 0 ? thread_cpu / 1000.0 / posted : 0.0)
+         << setw(10) << (posted > 0 ? process_cpu / 1000.0 / posted : 0.0)
+         << setw(10) << (posted > 0 ? double(thread_allocs) / posted : 0.0)
+         << setw(10) << (posted > 0 ? double(process_allocs) / posted : 0.0)
+         << setw(8) << max(lost, 0.0)
+         << setw(11) << rate
+         << setw(11) << flat_out / elapsed
+         << setw(10) << rate * count * 2 * sizeof(uint32_t) / 1e6 << endl;
+}
+
+/** Post pulses at the given rate
+ *  @param id Last pulse ID, updated
+ *  @param posted Set to the number of posted pulses
+ *  @return CPU time of the process per pulse in nanoseconds
+ */
+static double postPulses(Backend &backend, const Pulses &pulses, double delay, double seconds,
+                         uint32_t &id, uint64_t &posted)
+{
+    const size_t N = pulses.tof.size();
+    uint64_t cpu = NanoTimer::getNanosecs(CLOCK_PROCESS_CPUTIME_ID);
+    PulseScheduler scheduler(delay);
+    uint64_t end = NanoTimer::getCurrentNanosecs() + uint64_t(seconds * 1e9);
+    posted = 0;
+    while (NanoTimer::getCurrentNanosecs() < end)
+    {
+        scheduler.waitForNext();
+        backend.post(++id, 1e8, pulses.tof[posted % N], pulses.pixel[posted % N]);
+        ++posted;
+    }
+    cpu = NanoTimer::getNanosecs(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    return posted > 0 ? double(cpu) / posted : 0.0;
+}
+
+/** Subscriber process of the decimation sweep
+ *
+ *  Finds the server via the EPICS_PVA_* environment.
+ *  Prints "ready" once all subscribers received the initial value,
+ *  then, after 'seconds', the number of updates received by all of them.
+ */
+static int runSubscribers(size_t subscribers, const string &request, double seconds)
+{
+    pvxs::client::Context client = pvxs::client::Config::from_env().build();
+    atomic<uint64_t> received(0);
+    vector<shared_ptr<pvxs::client::Subscription> > monitors;
+    for (size_t i=0; i<subscribers; ++i)
+        monitors.push_back(subscribe(client, "backend:pvxs", request, received));
+    for (int i=0; i<500  &&  received.load() < subscribers; ++i)
+        epicsThreadSleep(0.01);
+    if (received.load() < subscribers)
+    {
+        cerr << "Subscribers did not connect" << endl;
+        return -1;
+    }
+    uint64_t initial = received.load();
+    cout << "ready" << endl;
+    epicsThreadSleep(seconds);
+    cout << received.load() - initial << endl;
+    monitors.clear();
+    return 0;
+}
+
+/** Server CPU per subscriber for each decimation option
+ *
+ *  Compares the CPU time of this process per pulse while serving
+ *  'subscribers' in another process with the time when serving nobody.
+ *
+ *  @param options Options for the timeStamp field like "decimate=10" or "maxRate=2"
+ */
+static void decimationSweep(size_t count, const Pulses &pulses, double delay, double seconds,
+                            size_t subscribers, const vector<string> &options)
+{
+    PVXSBackend backend("");
+    // Subscriber process finds the isolated server via the environment
+    pvxs::client::Config::defs_t defs;
+    backend.getClientConfig().updateDefs(defs);
+    for (map<string, string>::const_iterator def = defs.begin(); def != defs.end(); ++def)
+        setenv(def->first.c_str(), def->second.c_str(), 1);
+    // Path of this executable. Within the shell of popen(), /proc/self/exe would be the shell.
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if (len <= 0)
+        throw runtime_error("Cannot locate executable");
+    exe[len] = '\0';
+
+    uint32_t id = 0;
+    uint64_t posted;
+    double idle = postPulses(backend, pulses, delay, seconds, id, posted);
+    cout << setw(14) << "none" << setw(9) << count << setw(6) << 0
+         << setw(10) << idle / 1000.0 << setw(10) << "-" << setw(11) << "-" << endl;
+
+    for (size_t o=0; o<options.size(); ++o)
+    {
+        string request = "record[queueSize=100]field(timeStamp[" + options[o] + "],proton_charge,time_of_flight,pixel)";
+        ostringstream command;
+        command << "exec " << exe << " -c " << subscribers << " -s " << seconds + 1.0 << " -r '" << request << "'";
+        FILE *client = popen(command.str().c_str(), "r");
+        if (! client)
+            throw runtime_error("Cannot start subscribers");
+        char line[100];
+        if (! fgets(line, sizeof(line), client)  ||  string(line) != "ready\n")
+        {
+            pclose(client);
+            throw runtime_error("Subscribers did not connect");
+        }
+        double cpu = postPulses(backend, pulses, delay, seconds, id, posted);
+        uint64_t received = 0;
+        if (fgets(line, sizeof(line), client))
+            received = strtoull(line, 0, 10);
+        pclose(client);
+
+        cout << setw(14) << options[o] << setw(9) << count << setw(6) << subscribers
+             << setw(10) << cpu / 1000.0
+             << setw(10) << (cpu - idle) / 1000.0 / subscribers
+             << setw(11) << (posted > 0 ? 100.0 * received / (subscribers * posted) : 0.0) << endl;
+    }
+}
+
+/** Add "name=value" to options for each value in comma-separated list */
+static void addOptions(vector<string> &options, const string &name, const string &list)
+{
+    istringstream items(list);
+    string item;
+    while (getline(items, item, ','))
+        if (! item.empty())
+            options.push_back(name + "=" + item);
+}
+
+static vector<size_t> parseList(const string &list)
+{
+    vector<size_t> values;
+    istringstream items(list);
+    string item;
+    while (getline(items, item, ','))
+        if (! item.empty())
+            values.push_back((size_t)atol(item.c_str()));
+    return values;
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h         : Help" << endl;
+    cout << "  -b backend : pvdatabase, pvxs or both (default both)" << endl;
+    cout << "  -e counts  : Comma-separated event counts per pulse (default 1000,10000,100000,200000)" << endl;
+    cout << "  -d delay   : Seconds between pulses when measuring cost per pulse (default 0.01)" << endl;
+    cout << "  -s seconds : Duration of each measurement (default 5)" << endl;
+    cout << "  -r request : Client request (default 'record[queueSize=100]field()')" << endl;
+    cout << "  -m factors : Comma-separated decimate factors, measure server CPU per subscriber" << endl;
+    cout << "  -x rates   : Comma-separated maxRate values, measure server CPU per subscriber" << endl;
+    cout << "  -n count   : Number of subscribers for -m and -x (default 4)" << endl;
+    cout << "  -c count   : Run as subscriber process for -m and -x" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    string backends = "both";
+    vector<size_t> counts = parseList("1000,10000,100000,200000");
+    double delay = 0.01;
+    double seconds = 5.0;
+    string request = "record[queueSize=100]field()";
+    vector<string> options;
+    size_t subscribers = 4;
+    size_t run_subscribers = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:e:d:s:r:m:x:n:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            backends = optarg;
+            break;
+        case 'e':
+            counts = parseList(optarg);
+            break;
+        case 'd':
+            delay = atof(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'r':
+            request = optarg;
+            break;
+        case 'm':
+            addOptions(options, "decimate", optarg);
+            break;
+        case 'x':
+            addOptions(options, "maxRate", optarg);
+            break;
+        case 'n':
+            subscribers = (size_t)atol(optarg);
+            break;
+        case 'c':
+            run_subscribers = (size_t)atol(optarg);
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+    if (run_subscribers > 0)
+        return runSubscribers(run_subscribers, request, seconds);
+
+    if (! options.empty())
+    {
+        if (subscribers < 1)
+        {
+            help(argv[0]);
+            return -1;
+        }
+        cout << seconds << " seconds per measurement, " << delay << " s between pulses" << endl;
+        // CPU of this process per pulse and the part of it per subscriber,
+        // compared to serving no subscriber,
+        // and the percentage of pulses that each subscriber received
+        cout << setw(14) << "option" << setw(9) << "events" << setw(6) << "subs"
+             << setw(10) << "cpu us" << setw(10) << "sub us" << setw(11) << "received %" << endl;
+        try
+        {
+            for (size_t c=0; c<counts.size(); ++c)
+            {
+                if (counts[c] < 1)
+                    continue;
+                Pulses pulses(counts[c], 16);
+                decimationSweep(counts[c], pulses, delay, seconds, subscribers, options);
+            }
+        }
+        catch (std::exception &ex)
+        {
+            cerr << ex.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    bool use_pvdatabase = backends == "pvdatabase"  ||  backends == "both";
+    bool use_pvxs = backends == "pvxs"  ||  backends == "both";
+    if (! use_pvdatabase  &&  ! use_pvxs)
+    {
+        help(argv[0]);
+        return -1;
+    }
+
+    cout << seconds << " seconds per measurement, cost per pulse at " << delay
+         << " s between pulses, request '" << request << "'" << endl;
+    // CPU and allocations per pulse of the posting thread,
+    // and of the whole process including server and client threads.
+    // Pulses/s received by the client when posting back-to-back,
+    // pulses/s posted, and the MB/s received.
+    cout << setw(11) << "backend" << setw(9) << "events"
+         << setw(10) << "post us" << setw(10) << "cpu us"
+         << setw(10) << "post new" << setw(10) << "all new"
+         << setw(8) << "lost %"
+         << setw(11) << "max rate" << setw(11) << "posted/s" << setw(10) << "MB/s" << endl;
+
+    try
+    {
+        vector<shared_ptr<Backend> > servers;
+        if (use_pvdatabase)
+            servers.push_back(shared_ptr<Backend>(new PVDatabaseBackend(request)));
+        if (use_pvxs)
+            servers.push_back(shared_ptr<Backend>(new PVXSBackend(request)));
+        // Allow clients to connect
+        epicsThreadSleep(1.0);
+
+        for (size_t c=0; c<counts.size(); ++c)
+        {
+            if (counts[c] < 1)
+                continue;
+            Pulses pulses(counts[c], 16);
+            // One backend at a time, so they don't compete for CPU
+            for (size_t b=0; b<servers.size(); ++b)
+                benchmark(*servers[b], counts[c], pulses, delay, seconds);
+        }
+    }
+    catch (std::exception &ex)
+    {
+        cerr << ex.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
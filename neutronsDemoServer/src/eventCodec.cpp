@@ -0,0 +1,254 @@
+/* eventCodec.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <eventCodec.h>
+
+namespace epics { namespace neutronServer {
+
+enum { LANES = EventEncoder::LANES, BLOCK = EventEncoder::BLOCK, HEADER = EventEncoder::HEADER };
+
+/** @return Number of bits needed for value */
+static unsigned getBits(uint32_t value)
+{
+    return value ? 32 - __builtin_clz(value) : 0;
+}
+
+/** @return Number of words for 'rows' of LANES values with 'bits' each */
+static size_t getPackedWords(size_t rows, unsigned bits)
+{
+    return LANES * ((rows * bits + 31) / 32);
+}
+
+/** Pack rows of LANES values, each below 2^bits
+ *  @return End of packed data
+ */
+static uint32_t *pack(const uint32_t *in, size_t rows, unsigned bits, uint32_t *out)
+{
+    if (bits == 0)
+        return out;
+    uint64_t acc[LANES] = { 0 };
+    unsigned shift = 0;
+    for (size_t r=0; r<rows; ++r, in += LANES)
+    {
+        for (int l=0; l<LANES; ++l)
+            acc[l] |= uint64_t(in[l]) << shift;
+        shift += bits;
+        if (shift >= 32)
+        {
+            for (int l=0; l<LANES; ++l)
+            {
+                out[l] = uint32_t(acc[l]);
+                acc[l] >>= 32;
+            }
+            out += LANES;
+            shift -= 32;
+        }
+    }
+    if (shift > 0)
+    {
+        for (int l=0; l<LANES; ++l)
+            out[l] = uint32_t(acc[l]);
+        out += LANES;
+    }
+    return out;
+}
+
+/** Unpack rows of LANES values with 'bits' each
+ *  @return End of packed data
+ */
+static const uint32_t *unpack(const uint32_t *in, size_t rows, unsigned bits, uint32_t *out)
+{
+    if (bits == 0)
+    {
+        std::fill(out, out + rows*LANES, 0);
+        return in;
+    }
+    const uint32_t mask = bits < 32 ? (uint32_t(1) << bits) - 1 : 0xFFFFFFFF;
+    uint64_t acc[LANES] = { 0 };
+    unsigned avail = 0;
+    for (size_t r=0; r<rows; ++r, out += LANES)
+    {
+        if (avail < bits)
+        {
+            for (int l=0; l<LANES; ++l)
+                acc[l] |= uint64_t(in[l]) << avail;
+            in += LANES;
+            avail += 32;
+        }
+        for (int l=0; l<LANES; ++l)
+        {
+            out[l] = uint32_t(acc[l]) & mask;
+            acc[l] >>= bits;
+        }
+        avail -= bits;
+    }
+    return in;
+}
+
+size_t EventEncoder::getMaxWords(size_t n)
+{
+    size_t blocks = (n + BLOCK - 1) / BLOCK;
+    return blocks * (HEADER + 2*BLOCK);
+}
+
+size_t EventEncoder::encode(const uint32_t *tof, const uint32_t *pixel, size_t n, uint32_t *out)
+{
+    uint32_t *start = out;
+    for (size_t done = 0;  done < n;  done += BLOCK)
+    {
+        size_t count = std::min(n - done, size_t(BLOCK));
+        out = encodeBlock(tof + done, pixel + done, count, out);
+    }
+    return out - start;
+}
+
+uint32_t *EventEncoder::encodeBlock(const uint32_t *tof, const uint32_t *pixel, size_t n, uint32_t *out)
+{
+    // Sort by time-of-flight, unless already sorted
+    size_t unsorted = 0;
+    uint32_t min_tof = tof[0], max_tof = tof[0];
+    for (size_t i=1; i<n; ++i)
+    {
+        unsorted += tof[i] < tof[i-1];
+        min_tof = std::min(min_tof, tof[i]);
+        max_tof = std::max(max_tof, tof[i]);
+    }
+    memcpy(sorted_tof, tof, n * sizeof(uint32_t));
+    memcpy(sorted_pixel, pixel, n * sizeof(uint32_t));
+    if (unsorted)
+    {   // LSD radix sort, 8 bits per pass, only over the bits that differ
+        for (size_t i=0; i<n; ++i)
+            sorted_tof[i] -= min_tof;
+        unsigned bits = getBits(max_tof - min_tof);
+        for (unsigned shift = 0;  shift < bits;  shift += 8)
+        {
+            uint32_t offset[256] = { 0 };
+            for (size_t i=0; i<n; ++i)
+                ++offset[(sorted_tof[i] >> shift) & 0xFF];
+            uint32_t sum = 0;
+            for (int d=0; d<256; ++d)
+            {
+                uint32_t count = offset[d];
+                offset[d] = sum;
+                sum += count;
+            }
+            for (size_t i=0; i<n; ++i)
+            {
+                uint32_t pos = offset[(sorted_tof[i] >> shift) & 0xFF]++;
+                tmp_tof[pos] = sorted_tof[i];
+                tmp_pixel[pos] = sorted_pixel[i];
+            }
+            memcpy(sorted_tof, tmp_tof, n * sizeof(uint32_t));
+            memcpy(sorted_pixel, tmp_pixel, n * sizeof(uint32_t));
+        }
+        for (size_t i=0; i<n; ++i)
+            sorted_tof[i] += min_tof;
+    }
+
+    // Pad by repeating the last event, which results in zero deltas
+    size_t padded = (n + LANES - 1) / LANES * LANES;
+    for (size_t i=n; i<padded; ++i)
+    {
+        sorted_tof[i] = sorted_tof[n-1];
+        sorted_pixel[i] = sorted_pixel[n-1];
+    }
+    size_t rows = padded / LANES;
+
+    // Time-of-flight deltas to the event one row earlier
+    uint32_t tof_base = sorted_tof[0];
+    uint32_t max_delta = 0;
+    for (int l=0; l<LANES; ++l)
+        values[l] = sorted_tof[l] - tof_base;
+    for (size_t i=LANES; i<padded; ++i)
+        values[i] = sorted_tof[i] - sorted_tof[i-LANES];
+    for (size_t i=0; i<padded; ++i)
+        max_delta = std::max(max_delta, values[i]);
+    unsigned tof_bits = getBits(max_delta);
+
+    out[0] = n;
+    out[2] = tof_base;
+    uint32_t *data = pack(values, rows, tof_bits, out + HEADER);
+
+    // Pixel IDs relative to smallest one
+    uint32_t min_pixel = sorted_pixel[0], max_pixel = sorted_pixel[0];
+    for (size_t i=1; i<padded; ++i)
+    {
+        min_pixel = std::min(min_pixel, sorted_pixel[i]);
+        max_pixel = std::max(max_pixel, sorted_pixel[i]);
+    }
+    for (size_t i=0; i<padded; ++i)
+        values[i] = sorted_pixel[i] - min_pixel;
+    unsigned pixel_bits = getBits(max_pixel - min_pixel);
+
+    out[1] = tof_bits | (pixel_bits << 8);
+    out[3] = min_pixel;
+    return pack(values, rows, pixel_bits, data);
+}
+
+/** Check block header
+ *  @return Number of words in block
+ */
+static size_t checkBlock(const uint32_t *data, size_t words)
+{
+    if (words < HEADER)
+        throw std::runtime_error("EventDecoder: Truncated block header");
+    uint32_t n = data[0];
+    unsigned tof_bits = data[1] & 0xFF, pixel_bits = (data[1] >> 8) & 0xFF;
+    if (n < 1  ||  n > BLOCK  ||  tof_bits > 32  ||  pixel_bits > 32)
+        throw std::runtime_error("EventDecoder: Invalid block header");
+    size_t rows = (n + LANES - 1) / LANES;
+    size_t size = HEADER + getPackedWords(rows, tof_bits) + getPackedWords(rows, pixel_bits);
+    if (size > words)
+        throw std::runtime_error("EventDecoder: Truncated block");
+    return size;
+}
+
+size_t EventDecoder::getEventCount(const uint32_t *data, size_t words)
+{
+    size_t n = 0, offset = 0;
+    while (offset < words)
+    {
+        n += data[offset];
+        offset += checkBlock(data + offset, words - offset);
+    }
+    return n;
+}
+
+size_t EventDecoder::decode(const uint32_t *data, size_t words, uint32_t *tof, uint32_t *pixel)
+{
+    size_t n = 0, offset = 0;
+    while (offset < words)
+    {
+        const uint32_t *block = data + offset;
+        offset += checkBlock(block, words - offset);
+
+        size_t count = block[0];
+        size_t rows = (count + LANES - 1) / LANES;
+        unsigned tof_bits = block[1] & 0xFF, pixel_bits = (block[1] >> 8) & 0xFF;
+
+        const uint32_t *in = unpack(block + HEADER, rows, tof_bits, block_tof);
+        unpack(in, rows, pixel_bits, block_pixel);
+
+        // Undo deltas one row at a time, LANES values each
+        uint32_t tof_base = block[2];
+        for (int l=0; l<LANES; ++l)
+            block_tof[l] += tof_base;
+        for (size_t i=LANES; i<rows*LANES; ++i)
+            block_tof[i] += block_tof[i-LANES];
+
+        uint32_t min_pixel = block[3];
+        for (size_t i=0; i<count; ++i)
+        {
+            tof[n+i] = block_tof[i];
+            pixel[n+i] = block_pixel[i] + min_pixel;
+        }
+        n += count;
+    }
+    return n;
+}
+
+}} // namespace neutronServer, epics
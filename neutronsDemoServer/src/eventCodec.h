@@ -0,0 +1,91 @@
+/* eventCodec.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __EVENT_CODEC_H__
+#define __EVENT_CODEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace epics { namespace neutronServer {
+
+/** Compressed encoding of { time-of-flight, pixel } events
+ *
+ *  Events are encoded in independent blocks of up to BLOCK events,
+ *  so slices of a pulse can be encoded in parallel and then concatenated.
+ *  Within a block, events are sorted by time-of-flight.
+ *  Each block is a sequence of uint32 words:
+ *
+ *    0: Number of events n
+ *    1: tof_bits | pixel_bits << 8
+ *    2: Smallest time-of-flight
+ *    3: Smallest pixel ID
+ *    Time-of-flight deltas, tof_bits each
+ *    Pixel IDs minus the smallest one, pixel_bits each
+ *
+ *  Deltas are taken between event i and i-LANES, which are all >= 0
+ *  for sorted time-of-flight, and the first LANES events are relative
+ *  to the smallest time-of-flight.
+ *  Values are bit-packed in LANES interleaved streams:
+ *  Value i goes to stream i % LANES, and word w of stream l
+ *  is at index w*LANES + l.
+ *  That way, LANES values are packed, unpacked and delta-decoded
+ *  with the same shifts, in loops that the compiler turns into
+ *  SIMD instructions.
+ *  The number of events is padded to a multiple of LANES.
+ */
+class EventEncoder
+{
+public:
+    enum { LANES = 8, BLOCK = 256, HEADER = 4 };
+
+    /** @return Maximum number of words used to encode n events */
+    static size_t getMaxWords(size_t n);
+
+    /** Encode events
+     *  @param tof Time-of-flight values, not modified
+     *  @param pixel Pixel IDs, not modified
+     *  @param n Number of events
+     *  @param out Buffer for at least getMaxWords(n) words
+     *  @return Number of words written
+     */
+    size_t encode(const uint32_t *tof, const uint32_t *pixel, size_t n, uint32_t *out);
+
+private:
+    /** Events of the current block, sorted and padded */
+    uint32_t sorted_tof[BLOCK], sorted_pixel[BLOCK];
+    /** Buffers for sorting */
+    uint32_t tmp_tof[BLOCK], tmp_pixel[BLOCK];
+    /** Values to pack */
+    uint32_t values[BLOCK];
+
+    uint32_t *encodeBlock(const uint32_t *tof, const uint32_t *pixel, size_t n, uint32_t *out);
+};
+
+/** Decoder for EventEncoder data */
+class EventDecoder
+{
+public:
+    /** @return Number of events in encoded data
+     *  @throws std::runtime_error for invalid data
+     */
+    static size_t getEventCount(const uint32_t *data, size_t words);
+
+    /** Decode events
+     *  @param data Encoded data
+     *  @param words Number of words in data
+     *  @param tof Buffer for getEventCount() time-of-flight values
+     *  @param pixel Buffer for getEventCount() pixel IDs
+     *  @return Number of events
+     *  @throws std::runtime_error for invalid data
+     */
+    size_t decode(const uint32_t *data, size_t words, uint32_t *tof, uint32_t *pixel);
+
+private:
+    /** Block decoded before copying the un-padded part to the caller */
+    uint32_t block_tof[EventEncoder::BLOCK], block_pixel[EventEncoder::BLOCK];
+};
+
+}} // namespace neutronServer, epics
+#endif // __EVENT_CODEC_H__
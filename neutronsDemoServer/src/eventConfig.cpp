@@ -0,0 +1,100 @@
+/* eventConfig.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <sched.h>
+#include <eventConfig.h>
+
+namespace epics { namespace neutronServer {
+
+EventConfig::EventConfig(const EventSettings &initial)
+  : sequence(0), delay(initial.delay), count(initial.count), random_count(initial.random_count),
+    realistic(initial.realistic), skip_packets(initial.skip_packets)
+{
+}
+
+void EventConfig::lock()
+{
+    uint64_t seq = sequence.load();
+    while (true)
+    {
+        if (seq & 1)
+        {   // Another writer is busy, which is rare and brief
+            sched_yield();
+            seq = sequence.load();
+        }
+        else if (sequence.compare_exchange_weak(seq, seq + 1))
+            break;
+    }
+}
+
+void EventConfig::unlock()
+{
+    sequence.fetch_add(1);
+}
+
+void EventConfig::setDelay(double seconds)
+{
+    lock();
+    delay.store(seconds);
+    unlock();
+}
+
+void EventConfig::setCount(size_t count)
+{
+    lock();
+    this->count.store(count);
+    unlock();
+}
+
+void EventConfig::setRandomCount(bool random_count)
+{
+    lock();
+    this->random_count.store(random_count);
+    unlock();
+}
+
+void EventConfig::setRealistic(bool realistic)
+{
+    lock();
+    this->realistic.store(realistic);
+    unlock();
+}
+
+void EventConfig::setSkipPackets(size_t skip_packets)
+{
+    lock();
+    this->skip_packets.store(skip_packets);
+    unlock();
+}
+
+bool EventConfig::read(EventSettings &settings, uint64_t &version) const
+{
+    while (true)
+    {
+        uint64_t seq = sequence.load();
+        // While sequence is odd, seq / 2 is the version before the change
+        if (seq / 2 == version)
+            return false;
+        // Writer is busy with a newer version.
+        // Don't wait for it: With SCHED_FIFO, the reader could keep
+        // a preempted writer from ever finishing.
+        // Caller keeps the previous settings and gets the new ones next time.
+        if (seq & 1)
+            return false;
+        EventSettings copy;
+        copy.delay = delay.load();
+        copy.count = count.load();
+        copy.random_count = random_count.load();
+        copy.realistic = realistic.load();
+        copy.skip_packets = skip_packets.load();
+        if (sequence.load() == seq)
+        {
+            settings = copy;
+            version = seq / 2;
+            return true;
+        }
+    }
+}
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,91 @@
+/* eventConfig.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __EVENT_CONFIG_H__
+#define __EVENT_CONFIG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace epics { namespace neutronServer {
+
+/** Settings for generating the events of a pulse */
+struct EventSettings
+{
+    /** Seconds between pulses */
+    double delay;
+    /** (Maximum) number of events per pulse */
+    size_t count;
+    /** Use random number of events up to count? */
+    bool random_count;
+    /** Generate semi-real looking data? */
+    bool realistic;
+    /** Skip every N'th pulse, 0 to skip none */
+    size_t skip_packets;
+};
+
+/** Versioned snapshot of the EventSettings
+ *
+ *  Settings may be changed from any thread, for example
+ *  the scan threads of IOC records, while the thread that
+ *  generates the pulses reads all of them at the start of each pulse.
+ *
+ *  Uses a sequence lock: Writers make the sequence odd while
+ *  they update a setting. Readers retry until they got a consistent
+ *  copy from an even sequence that didn't change while reading,
+ *  but return without new settings while the sequence is odd.
+ *  Writers don't block the reader, and all settings are atomic,
+ *  so there are no torn reads or data races.
+ *  Sequentially consistent atomics rather than fences keep this
+ *  understandable for the thread sanitizer. On x86, loads are still
+ *  plain reads, and the rare writes pay for the ordering.
+ */
+class EventConfig
+{
+public:
+    EventConfig(const EventSettings &initial);
+
+    void setDelay(double seconds);
+    void setCount(size_t count);
+    void setRandomCount(bool random_count);
+    void setRealistic(bool realistic);
+    void setSkipPackets(size_t skip_packets);
+
+    /** @return Version of the settings, incremented by each change */
+    uint64_t getVersion() const
+    {
+        return sequence.load() / 2;
+    }
+
+    /** Get settings if they changed
+     *  @param settings Updated with consistent copy of all settings when changed
+     *  @param version Version of the settings that caller already has, updated when changed.
+     *                Use (uint64_t)-1 to get the settings unless a change is in progress.
+     *  @return true if settings were updated,
+     *          false if they didn't change or are being changed right now.
+     *          In the latter case, keep the previous settings and try again later.
+     */
+    bool read(EventSettings &settings, uint64_t &version) const;
+
+private:
+    EventConfig(const EventConfig &);
+    EventConfig &operator=(const EventConfig &);
+
+    /** Begin a change, waiting for concurrent writers */
+    void lock();
+    /** Publish a change */
+    void unlock();
+
+    /** Even when settings are stable, odd while being changed */
+    std::atomic<uint64_t> sequence;
+    std::atomic<double> delay;
+    std::atomic<size_t> count;
+    std::atomic<bool> random_count;
+    std::atomic<bool> realistic;
+    std::atomic<size_t> skip_packets;
+};
+
+}} // namespace neutronServer, epics
+#endif // __EVENT_CONFIG_H__
@@ -0,0 +1,107 @@
+/* eventConfigStress.cpp
+ *
+ * Change EventConfig settings from several threads while reading them,
+ * checking that each read returns a consistent snapshot.
+ * Meant to run under the thread sanitizer, see Makefile.
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <eventConfig.h>
+
+using namespace std;
+using namespace epics::neutronServer;
+
+static atomic<bool> run(true);
+
+/** Set delay, then count to the same value.
+ *  A consistent snapshot thus has count <= delay <= count + 1
+ */
+static void changeDelayAndCount(EventConfig &config)
+{
+    for (size_t i=1; run; ++i)
+    {
+        config.setDelay(double(i));
+        config.setCount(i);
+        this_thread::yield();
+    }
+}
+
+/** Increment skip_packets, which is thus never smaller than in a previous snapshot */
+static void changeSkip(EventConfig &config)
+{
+    for (size_t i=1; run; ++i)
+    {
+        config.setSkipPackets(i);
+        this_thread::yield();
+    }
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h             : Help" << endl;
+    cout << "  -s seconds     : Run time (default: 2)" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = 2.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+
+    EventSettings initial = { 0.0, 0, false, false, 0 };
+    EventConfig config(initial);
+
+    vector<thread> writers;
+    writers.push_back(thread(changeDelayAndCount, ref(config)));
+    writers.push_back(thread(changeSkip, ref(config)));
+
+    // Reader like FakeNeutronEventRunnable, polling for changes
+    EventSettings settings = initial;
+    uint64_t version = 0;
+    size_t reads = 0, updates = 0, errors = 0;
+    thread timer([seconds]() { usleep(useconds_t(seconds * 1e6)); run = false; });
+    while (run)
+    {
+        ++reads;
+        size_t last_skip = settings.skip_packets;
+        uint64_t last_version = version;
+        if (! config.read(settings, version))
+            continue;
+        ++updates;
+        double count = double(settings.count);
+        if (settings.delay < count  ||  settings.delay > count + 1  ||
+            settings.skip_packets < last_skip  ||  version <= last_version)
+        {
+            if (++errors <= 10)
+                cout << "Inconsistent version " << version << ": delay " << settings.delay
+                     << ", count " << settings.count << ", skip " << settings.skip_packets << endl;
+        }
+    }
+    timer.join();
+    for (size_t i=0; i<writers.size(); ++i)
+        writers[i].join();
+
+    cout << reads << " reads, " << updates << " updates, " << errors << " inconsistent" << endl;
+    return errors > 0 ? 1 : 0;
+}
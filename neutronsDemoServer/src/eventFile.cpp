@@ -0,0 +1,284 @@
+/* eventFile.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <stdexcept>
+#include <epicsGuard.h>
+#include <eventFile.h>
+
+namespace epics { namespace neutronServer {
+
+std::shared_ptr<EventFile> EventFile::open(const std::string &filename)
+{
+    return std::shared_ptr<EventFile>(new EventFile(filename));
+}
+
+EventFile::EventFile(const std::string &filename)
+: fd(-1), data(MAP_FAILED), size(0)
+{
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open " + filename + ": " + strerror(errno));
+
+    struct stat info;
+    if (fstat(fd, &info) != 0  ||  info.st_size < (off_t) sizeof(EventFileHeader))
+    {
+        ::close(fd);
+        throw std::runtime_error("Cannot read header of " + filename);
+    }
+    size = info.st_size;
+
+    data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        ::close(fd);
+        throw std::runtime_error("Cannot map " + filename + ": " + strerror(errno));
+    }
+    // Replay reads front to back
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    const char *start = static_cast<const char *>(data);
+    const EventFileHeader *header = reinterpret_cast<const EventFileHeader *>(start);
+    if (memcmp(header->magic, EVENT_FILE_MAGIC, sizeof(header->magic)) != 0  ||
+        header->version != EVENT_FILE_VERSION)
+    {
+        munmap(data, size);
+        ::close(fd);
+        throw std::runtime_error(filename + " is not a neutron event file of a supported version");
+    }
+
+    // Index the pulses
+    static const EventFilePulse zero = EventFilePulse();
+    size_t offset = sizeof(EventFileHeader);
+    while (offset + sizeof(EventFilePulse) <= size)
+    {
+        const EventFilePulse *pulse = reinterpret_cast<const EventFilePulse *>(start + offset);
+        // A writer that didn't close the file leaves a pre-allocated tail of zeros
+        if (memcmp(pulse, &zero, sizeof(zero)) == 0  ||  pulse->nanoseconds >= 1000000000u)
+        {
+            std::cout << filename << ": Ignoring " << (size - offset) << " bytes after last valid pulse" << std::endl;
+            break;
+        }
+        size_t pulse_size = getEventFilePulseSize(pulse->count);
+        if (offset + pulse_size > size)
+        {
+            std::cout << filename << ": Ignoring truncated pulse " << pulse->pulse_id << std::endl;
+            break;
+        }
+        pulses.push_back(pulse);
+        offset += pulse_size;
+    }
+}
+
+EventFile::~EventFile()
+{
+    munmap(data, size);
+    ::close(fd);
+}
+
+EventFileWriter::EventFileWriter(const std::string &filename, size_t max_queued, size_t segment_size)
+: filename(filename), max_queued(max_queued), segment_size(segment_size),
+  fd(-1), segment(0), segment_offset(0), written(0),
+  queued_bytes(0), do_run(true), pulses(0), bytes(0), dropped(0), max_queued_bytes(0),
+  thread(*this, "EventFileWriter", epicsThreadGetStackSize(epicsThreadStackMedium))
+{
+    // Mappings must start on a page boundary
+    long page = sysconf(_SC_PAGESIZE);
+    if (this->segment_size < (size_t)page)
+        this->segment_size = page;
+    this->segment_size -= this->segment_size % page;
+
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Cannot create " + filename + ": " + strerror(errno));
+    try
+    {
+        mapSegment();
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    EventFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVENT_FILE_MAGIC, sizeof(header.magic));
+    header.version = EVENT_FILE_VERSION;
+    append(&header, sizeof(header));
+
+    thread.start();
+}
+
+EventFileWriter::~EventFileWriter()
+{
+    {
+        epicsGuard<epicsMutex> guard(mutex);
+        do_run = false;
+    }
+    added.signal();
+    thread_exited.wait();
+
+    // Drop the pre-allocated but unused part of the file
+    unmapSegment();
+    if (ftruncate(fd, written) != 0)
+        std::cout << filename << ": Cannot truncate, " << strerror(errno) << std::endl;
+    ::close(fd);
+}
+
+bool EventFileWriter::write(const EventFilePulse &pulse,
+                            std::shared_ptr<const uint32_t> tof,
+                            std::shared_ptr<const uint32_t> pixel)
+{
+    Pulse item = { pulse, tof, pixel };
+    size_t size = getEventFilePulseSize(pulse.count);
+    {
+        epicsGuard<epicsMutex> guard(mutex);
+        if (queued_bytes + size > max_queued)
+        {
+            ++dropped;
+            return false;
+        }
+        queue.push_back(item);
+        queued_bytes += size;
+        if (queued_bytes > max_queued_bytes)
+            max_queued_bytes = queued_bytes;
+    }
+    added.signal();
+    return true;
+}
+
+void EventFileWriter::run()
+{
+    std::deque<Pulse> batch;
+    while (true)
+    {
+        bool running;
+        {   // Take all queued pulses
+            epicsGuard<epicsMutex> guard(mutex);
+            batch.swap(queue);
+            queued_bytes = 0;
+            running = do_run;
+        }
+        if (batch.empty())
+        {
+            if (! running)
+                break;
+            added.wait();
+            continue;
+        }
+
+        static const char padding[8] = { 0 };
+        size_t batch_pulses = batch.size(), done = 0;
+        uint64_t pulse_start = written;
+        if (segment)
+        {
+            try
+            {
+                for (/**/; done<batch_pulses; ++done)
+                {
+                    const Pulse &pulse = batch[done];
+                    pulse_start = written;
+                    size_t array_bytes = pulse.header.count * sizeof(uint32_t);
+                    append(&pulse.header, sizeof(EventFilePulse));
+                    append(pulse.tof.get(), array_bytes);
+                    append(pulse.pixel.get(), array_bytes);
+                    append(padding, getEventFilePulseSize(pulse.header.count) - sizeof(EventFilePulse) - 2*array_bytes);
+                }
+            }
+            catch (std::exception &ex)
+            {   // Keep the complete pulses, drop the rest
+                std::cout << "EventFileWriter: " << ex.what() << std::endl;
+                written = pulse_start;
+                segment = 0;
+            }
+        }
+        // Release the arrays
+        batch.clear();
+
+        epicsGuard<epicsMutex> guard(mutex);
+        pulses += done;
+        dropped += batch_pulses - done;
+        bytes = written;
+    }
+    thread_exited.signal();
+}
+
+void EventFileWriter::append(const void *data, size_t size)
+{
+    const char *src = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        size_t used = written - segment_offset;
+        if (used >= segment_size)
+        {   // Segment is full, continue in next one
+            unmapSegment();
+            segment_offset += segment_size;
+            mapSegment();
+            used = 0;
+        }
+        size_t chunk = segment_size - used;
+        if (chunk > size)
+            chunk = size;
+        memcpy(segment + used, src, chunk);
+        src += chunk;
+        size -= chunk;
+        written += chunk;
+    }
+}
+
+void EventFileWriter::mapSegment()
+{
+    // Allocate disk space for the segment up front
+    // so that writing to the mapping won't fail with SIGBUS
+    // when the disk fills up
+    int error = posix_fallocate(fd, segment_offset, segment_size);
+    if (error != 0)
+        throw std::runtime_error("Cannot allocate space in " + filename + ": " + strerror(error));
+    void *mapped = mmap(0, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, segment_offset);
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error("Cannot map " + filename + ": " + strerror(errno));
+    // Data is only written, not read back
+    madvise(mapped, segment_size, MADV_SEQUENTIAL);
+    segment = static_cast<char *>(mapped);
+}
+
+void EventFileWriter::unmapSegment()
+{
+    if (segment)
+        munmap(segment, segment_size);
+    segment = 0;
+}
+
+uint64_t EventFileWriter::getPulses()
+{
+    epicsGuard<epicsMutex> guard(mutex);
+    return pulses;
+}
+
+uint64_t EventFileWriter::getBytes()
+{
+    epicsGuard<epicsMutex> guard(mutex);
+    return bytes;
+}
+
+uint64_t EventFileWriter::getDropped()
+{
+    epicsGuard<epicsMutex> guard(mutex);
+    return dropped;
+}
+
+uint64_t EventFileWriter::getMaxQueued()
+{
+    epicsGuard<epicsMutex> guard(mutex);
+    return max_queued_bytes;
+}
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,186 @@
+/* eventFile.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __EVENT_FILE_H__
+#define __EVENT_FILE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+namespace epics { namespace neutronServer {
+
+/** Binary file of recorded neutron pulses
+ *
+ *  File starts with an EventFileHeader,
+ *  followed by pulses.
+ *  Each pulse is an EventFilePulse header,
+ *  followed by uint32 tof[count] and uint32 pixel[count],
+ *  padded to a multiple of 8 bytes.
+ *  All values use the byte order of the host.
+ */
+struct EventFileHeader
+{
+    /** "NEUTRONS" */
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+/** Header for one pulse in the EventFile */
+struct EventFilePulse
+{
+    uint64_t pulse_id;
+    /** Time stamp, seconds since 1970 (POSIX epoch) */
+    uint64_t seconds;
+    uint32_t nanoseconds;
+    /** Number of tof and pixel values */
+    uint32_t count;
+    double proton_charge;
+};
+
+#define EVENT_FILE_MAGIC   "NEUTRONS"
+#define EVENT_FILE_VERSION 1
+
+/** @return Bytes used by a pulse in the file, including header and padding */
+inline size_t getEventFilePulseSize(uint32_t count)
+{
+    size_t size = sizeof(EventFilePulse) + 2*sizeof(uint32_t)*count;
+    return (size + 7) & ~size_t(7);
+}
+
+/** Memory-mapped EventFile for reading
+ *
+ *  Must be opened via EventFile::open().
+ *  Arrays handed out by the replay keep a reference to the EventFile,
+ *  so the mapping stays valid until the last one is released.
+ */
+class EventFile
+{
+public:
+    /** @param filename File to map
+     *  @throws std::runtime_error on error
+     */
+    static std::shared_ptr<EventFile> open(const std::string &filename);
+
+    ~EventFile();
+
+    size_t getPulseCount() const
+    {
+        return pulses.size();
+    }
+
+    const EventFilePulse &getPulse(size_t index) const
+    {
+        return *pulses[index];
+    }
+
+    const uint32_t *getTimeOfFlight(size_t index) const
+    {
+        return reinterpret_cast<const uint32_t *>(pulses[index] + 1);
+    }
+
+    const uint32_t *getPixel(size_t index) const
+    {
+        return getTimeOfFlight(index) + pulses[index]->count;
+    }
+
+private:
+    EventFile(const std::string &filename);
+
+    int fd;
+    void *data;
+    size_t size;
+    std::vector<const EventFilePulse *> pulses;
+};
+
+/** Writer for EventFile
+ *
+ *  write() only queues the pulse, keeping a reference to its arrays,
+ *  so it never blocks on I/O.
+ *  A separate thread then appends all queued pulses in batches
+ *  to the file, which is pre-allocated and memory-mapped
+ *  one segment at a time.
+ */
+class EventFileWriter : public epicsThreadRunable
+{
+public:
+    /** @param filename File to create
+     *  @param max_queued Maximum number of bytes waiting to be written.
+     *                    When exceeded, write() drops pulses
+     *  @param segment_size File grows and is mapped in segments of this size
+     *  @throws std::runtime_error on error
+     */
+    EventFileWriter(const std::string &filename,
+                    size_t max_queued = 1024*1024*1024,
+                    size_t segment_size = 256*1024*1024);
+
+    /** Write remaining pulses, close file */
+    ~EventFileWriter();
+
+    /** Queue pulse to be written
+     *  @param pulse Pulse ID, time stamp, .. and number of tof and pixel elements
+     *  @param tof Time-of-flight data, kept until written
+     *  @param pixel Pixel data, kept until written
+     *  @return false when queue was full, pulse has been dropped
+     */
+    bool write(const EventFilePulse &pulse,
+               std::shared_ptr<const uint32_t> tof,
+               std::shared_ptr<const uint32_t> pixel);
+
+    void run();
+
+    /** @return Number of pulses written */
+    uint64_t getPulses();
+
+    /** @return Number of bytes written */
+    uint64_t getBytes();
+
+    /** @return Number of pulses dropped because the queue was full or they could not be written */
+    uint64_t getDropped();
+
+    /** @return Maximum number of bytes that were waiting to be written */
+    uint64_t getMaxQueued();
+
+private:
+    struct Pulse
+    {
+        EventFilePulse header;
+        std::shared_ptr<const uint32_t> tof, pixel;
+    };
+
+    /** Append to file, mapping new segments as needed */
+    void append(const void *data, size_t bytes);
+    void mapSegment();
+    void unmapSegment();
+
+    std::string filename;
+    size_t max_queued, segment_size;
+    int fd;
+
+    /** Current segment: Start of mapping, its offset in file */
+    char *segment;
+    uint64_t segment_offset;
+    /** Bytes written to the file, i.e. end of data. Only used by writer thread */
+    uint64_t written;
+
+    epicsMutex mutex;
+    std::deque<Pulse> queue;
+    size_t queued_bytes;
+    bool do_run;
+    uint64_t pulses, bytes, dropped, max_queued_bytes;
+    epicsEvent added;
+    epicsEvent thread_exited;
+    epicsThread thread;
+};
+
+}} // namespace neutronServer, epics
+#endif // __EVENT_FILE_H__
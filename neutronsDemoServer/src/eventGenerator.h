@@ -0,0 +1,60 @@
+/* eventGenerator.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __EVENT_GENERATOR_H__
+#define __EVENT_GENERATOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <randomEngine.h>
+#include <pixelSampler.h>
+
+namespace epics { namespace neutronServer {
+
+/** Fills time-of-flight and pixel arrays with demo events
+ *
+ *  Used by the worker threads of the FakeNeutronEventRunnable,
+ *  and by generatorBenchmark.
+ *  Not thread-safe: Each thread needs its own generator.
+ */
+class EventGenerator
+{
+public:
+    /** @param seed Seed for the random numbers of realistic data */
+    EventGenerator(uint64_t seed)
+    : id(0), realistic(false), banks(1), sampler(0), random(seed)
+    {}
+
+    /** @param id Pulse ID, used for the values of non-realistic data
+     *  @param realistic Generate semi-real looking data?
+     *  @param banks Total number of banks
+     *  @param sampler Pixel weights for realistic data, may be NULL for uniform pixels
+     */
+    void setPulse(uint64_t id, bool realistic, size_t banks, const PixelSampler *sampler)
+    {
+        this->id = id;
+        this->realistic = realistic;
+        this->banks = banks;
+        this->sampler = sampler;
+    }
+
+    void fillTimeOfFlight(uint32_t *p, size_t count);
+
+    void fillPixel(uint32_t *p, size_t start, size_t count, size_t bank);
+
+protected:
+    /** Used to create dummy events */
+    uint32_t id;
+    /** Flag to generate semi-real looking data.**/
+    bool realistic;
+    /** Number of banks. With just one, pixels are spread over two detectors */
+    size_t banks;
+    /** Pixel weights, or NULL */
+    const PixelSampler *sampler;
+    /** Random numbers for 'realistic' data, owned by this generator's thread */
+    RandomEngine random;
+};
+
+}} // namespace neutronServer, epics
+#endif // __EVENT_GENERATOR_H__
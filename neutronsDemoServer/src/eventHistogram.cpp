@@ -0,0 +1,61 @@
+/* eventHistogram.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <algorithm>
+#include <eventHistogram.h>
+
+namespace epics { namespace neutronServer {
+
+EventHistogram::EventHistogram(size_t bins, uint32_t width)
+: bins(bins > 0 ? bins : 1), width(width > 0 ? width : 1),
+  // For values below 2^32, 1/width rounded up by 2^-40 still truncates
+  // exact multiples of width to the correct bin, without reaching the next one
+  scale((1.0 + 1.0/(1ULL << 40)) / this->width),
+  counters(COPIES * (this->bins + 1), 0)
+{
+}
+
+void EventHistogram::add(const uint32_t *values, size_t n)
+{
+    enum { BLOCK = 256 };
+    uint32_t index[BLOCK];
+    const double limit = bins;
+    const size_t stride = bins + 1;
+    uint32_t *c = &counters[0];
+
+    for (size_t start = 0;  start < n;  start += BLOCK)
+    {
+        size_t count = std::min(n - start, size_t(BLOCK));
+        const uint32_t *v = values + start;
+
+        // Bin index, or 'bins' for values outside. Vectorizes.
+        for (size_t i=0; i<count; ++i)
+            index[i] = uint32_t(std::min(double(v[i]) * scale, limit));
+
+        // Increment, rotating through the sub-histograms
+        size_t i = 0;
+        for (/**/; i + COPIES <= count; i += COPIES)
+            for (size_t k=0; k<COPIES; ++k)
+                ++c[k*stride + index[i+k]];
+        for (/**/; i < count; ++i)
+            ++c[index[i]];
+    }
+}
+
+uint64_t EventHistogram::collect(uint32_t *counts)
+{
+    const size_t stride = bins + 1;
+    uint64_t outside = 0;
+    for (size_t k=0; k<COPIES; ++k)
+    {
+        const uint32_t *c = &counters[k*stride];
+        for (size_t b=0; b<bins; ++b)
+            counts[b] += c[b];
+        outside += c[bins];
+    }
+    std::fill(counters.begin(), counters.end(), 0);
+    return outside;
+}
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,67 @@
+/* eventHistogram.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __EVENT_HISTOGRAM_H__
+#define __EVENT_HISTOGRAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace epics { namespace neutronServer {
+
+/** Histogram of event values, i.e. time-of-flight or pixel IDs
+ *
+ *  Bin i counts values from i*width up to (i+1)*width - 1.
+ *  Values beyond the last bin are only counted as 'outside'.
+ *
+ *  add() first computes the bin index for a block of values
+ *  in a loop that the compiler can vectorize, using a multiplication
+ *  by the reciprocal of the bin width instead of a division.
+ *  It then increments counters in COPIES interleaved sub-histograms,
+ *  so that consecutive events in the same bin don't have to wait
+ *  for each other's increment.
+ *
+ *  Not thread-safe: Each worker thread uses its own histogram.
+ */
+class EventHistogram
+{
+public:
+    enum { COPIES = 4 };
+
+    /** @param bins Number of bins
+     *  @param width Width of each bin
+     */
+    EventHistogram(size_t bins, uint32_t width = 1);
+
+    size_t getBins() const
+    {
+        return bins;
+    }
+
+    uint32_t getWidth() const
+    {
+        return width;
+    }
+
+    /** Add values to histogram */
+    void add(const uint32_t *values, size_t n);
+
+    /** Add counts of this histogram to 'counts' array, then reset
+     *  @param counts Array with getBins() elements
+     *  @return Number of values that were outside of the bins
+     */
+    uint64_t collect(uint32_t *counts);
+
+private:
+    size_t bins;
+    uint32_t width;
+    /** Slightly larger than 1/width, so that rounding never moves a value into the lower bin */
+    double scale;
+    /** COPIES sub-histograms, each with bins + 1 counters, the last one for 'outside' */
+    std::vector<uint32_t> counters;
+};
+
+}} // namespace neutronServer, epics
+#endif // __EVENT_HISTOGRAM_H__
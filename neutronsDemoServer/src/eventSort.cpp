@@ -0,0 +1,110 @@
+/* eventSort.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <string.h>
+#include <algorithm>
+#include <eventSort.h>
+
+namespace epics { namespace neutronServer {
+
+static inline uint32_t getDigit(uint32_t tof, unsigned pass)
+{
+    return (tof >> (pass * SORT_DIGIT_BITS)) & (SORT_RADIX - 1);
+}
+
+unsigned getSortPasses(uint32_t max_tof)
+{
+    unsigned passes = 0;
+    while (passes * SORT_DIGIT_BITS < 32  &&  (max_tof >> (passes * SORT_DIGIT_BITS)) != 0)
+        ++passes;
+    return passes;
+}
+
+uint32_t countDigits(const uint32_t *tof, size_t n, unsigned pass, uint32_t *counts)
+{
+    uint32_t max_tof = 0;
+    for (size_t i=0; i<n; ++i)
+    {
+        ++counts[getDigit(tof[i], pass)];
+        max_tof = std::max(max_tof, tof[i]);
+    }
+    return max_tof;
+}
+
+uint32_t countDigits(const uint64_t *events, size_t n, unsigned pass, uint32_t *counts)
+{
+    uint32_t max_tof = 0;
+    for (size_t i=0; i<n; ++i)
+    {
+        uint32_t tof = uint32_t(events[i]);
+        ++counts[getDigit(tof, pass)];
+        max_tof = std::max(max_tof, tof);
+    }
+    return max_tof;
+}
+
+bool getDigitOffsets(uint32_t * const *counts, size_t chunks)
+{
+    uint32_t offset = 0;
+    bool needed = false;
+    for (size_t d=0; d<SORT_RADIX; ++d)
+    {
+        uint32_t start = offset;
+        for (size_t c=0; c<chunks; ++c)
+        {
+            uint32_t count = counts[c][d];
+            counts[c][d] = offset;
+            offset += count;
+        }
+        // Pass is needed unless one digit value has all events
+        if (offset > start  &&  start > 0)
+            needed = true;
+    }
+    return needed;
+}
+
+void scatterDigits(const uint32_t *tof, const uint32_t *pixel, size_t n, unsigned pass,
+                   uint32_t *offsets, uint32_t *tof_out, uint32_t *pixel_out)
+{
+    for (size_t i=0; i<n; ++i)
+    {
+        uint32_t pos = offsets[getDigit(tof[i], pass)]++;
+        tof_out[pos] = tof[i];
+        pixel_out[pos] = pixel[i];
+    }
+}
+
+void scatterDigits(const uint64_t *events, size_t n, unsigned pass,
+                   uint32_t *offsets, uint64_t *out)
+{
+    for (size_t i=0; i<n; ++i)
+        out[offsets[getDigit(uint32_t(events[i]), pass)]++] = events[i];
+}
+
+void sortEvents(uint32_t *tof, uint32_t *pixel, size_t n, uint32_t *tof_tmp, uint32_t *pixel_tmp)
+{
+    uint32_t counts[SORT_RADIX];
+    uint32_t *chunk = counts;
+    uint32_t *src_tof = tof, *src_pixel = pixel, *dst_tof = tof_tmp, *dst_pixel = pixel_tmp;
+    unsigned passes = 1;
+    for (unsigned pass=0; pass<passes; ++pass)
+    {
+        memset(counts, 0, sizeof(counts));
+        uint32_t max_tof = countDigits(src_tof, n, pass, counts);
+        if (pass == 0)
+            passes = getSortPasses(max_tof);
+        if (! getDigitOffsets(&chunk, 1))
+            continue;
+        scatterDigits(src_tof, src_pixel, n, pass, counts, dst_tof, dst_pixel);
+        std::swap(src_tof, dst_tof);
+        std::swap(src_pixel, dst_pixel);
+    }
+    if (src_tof != tof)
+    {
+        memcpy(tof, src_tof, n * sizeof(uint32_t));
+        memcpy(pixel, src_pixel, n * sizeof(uint32_t));
+    }
+}
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,90 @@
+/* eventSort.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __EVENT_SORT_H__
+#define __EVENT_SORT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace epics { namespace neutronServer {
+
+/** LSD radix sort of events by time-of-flight
+ *
+ *  Each pass moves the events by one SORT_DIGIT_BITS wide digit
+ *  of the time-of-flight, starting with the least significant digit,
+ *  and keeps the order of events with the same digit.
+ *  Pixel IDs are moved along with their time-of-flight.
+ *  Only as many passes as needed for the largest time-of-flight are performed,
+ *  for example two passes for the 18 bits of realistic data.
+ *
+ *  To sort in parallel, the events are split into chunks.
+ *  Each pass then has three steps:
+ *  1) countDigits() for each chunk,
+ *  2) getDigitOffsets() to turn the counts of all chunks into offsets,
+ *  3) scatterDigits() for each chunk.
+ *  Steps 1 and 3 can handle the chunks in separate threads.
+ *
+ *  Packed events (see packedEvents.h) are sorted by their lower 32 bits.
+ */
+
+/** Bits per pass */
+#define SORT_DIGIT_BITS 11
+/** Number of digit values */
+#define SORT_RADIX (1 << SORT_DIGIT_BITS)
+
+/** @return Number of passes needed to sort time-of-flight values up to max_tof */
+unsigned getSortPasses(uint32_t max_tof);
+
+/** Count digit values of a chunk
+ *  @param tof Time-of-flight values of chunk
+ *  @param n Number of values
+ *  @param pass Sort pass, 0 for least significant digit
+ *  @param counts SORT_RADIX counters, incremented for each digit value
+ *  @return Largest time-of-flight in chunk
+ */
+uint32_t countDigits(const uint32_t *tof, size_t n, unsigned pass, uint32_t *counts);
+
+/** Count digit values of a chunk of packed events */
+uint32_t countDigits(const uint64_t *events, size_t n, unsigned pass, uint32_t *counts);
+
+/** Turn digit counts of all chunks of an array into offsets
+ *
+ *  Events of chunk c with digit value d will be placed
+ *  after those with smaller digit values, and after those
+ *  with the same digit value in chunks before c.
+ *
+ *  @param counts counts[c] are the SORT_RADIX counts of chunk c, replaced with offsets
+ *  @param chunks Number of chunks, in their order within the array
+ *  @return false if all events have the same digit value, so the pass can be skipped
+ */
+bool getDigitOffsets(uint32_t * const *counts, size_t chunks);
+
+/** Move events of a chunk to their position for this pass
+ *  @param tof Time-of-flight values of chunk
+ *  @param pixel Pixel IDs of chunk
+ *  @param n Number of events
+ *  @param pass Sort pass
+ *  @param offsets SORT_RADIX offsets from getDigitOffsets(), updated
+ *  @param tof_out Time-of-flight array of all chunks for the result of this pass
+ *  @param pixel_out Pixel array of all chunks for the result of this pass
+ */
+void scatterDigits(const uint32_t *tof, const uint32_t *pixel, size_t n, unsigned pass,
+                   uint32_t *offsets, uint32_t *tof_out, uint32_t *pixel_out);
+
+/** Move packed events of a chunk to their position for this pass */
+void scatterDigits(const uint64_t *events, size_t n, unsigned pass,
+                   uint32_t *offsets, uint64_t *out);
+
+/** Sort events in the calling thread
+ *  @param tof Time-of-flight values, sorted on return
+ *  @param pixel Pixel IDs, moved along with their time-of-flight
+ *  @param n Number of events
+ *  @param tof_tmp Buffer for n values
+ *  @param pixel_tmp Buffer for n values
+ */
+void sortEvents(uint32_t *tof, uint32_t *pixel, size_t n, uint32_t *tof_tmp, uint32_t *pixel_tmp);
+
+}} // namespace neutronServer, epics
+#endif // __EVENT_SORT_H__
@@ -0,0 +1,190 @@
+/* generatorBenchmark.cpp
+ *
+ * Time to generate and post the demo events
+ * for a range of pulse sizes, as JSON to track
+ * changes between releases.
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <eventGenerator.h>
+#include <latencyHistogram.h>
+#include <pulseScheduler.h>
+#include "neutronServer.h"
+
+using namespace std;
+using namespace epics::neutronServer;
+
+/** Runnable that's only used to post to its records, never started */
+class PostRunnable : public NeutronEventRunnable
+{
+public:
+    PostRunnable() : NeutronEventRunnable("benchmark") {}
+    void run() {}
+};
+
+/** Write one result as JSON object */
+static void report(ostream &out, bool first, const char *name, const char *mode,
+                   size_t events, const LatencyHistogram &timer, double rate = 0.0)
+{
+    // Median rather than average, so that a few preempted runs
+    // don't look like a regression
+    uint64_t p50 = timer.getPercentileNanosecs(50.0);
+    out << (first ? "" : ",\n")
+        << "    { \"name\": \"" << name << "\", \"mode\": \"" << mode << "\""
+        << ", \"events\": " << events;
+    if (rate > 0)
+        out << ", \"rate_hz\": " << rate;
+    out << ", \"runs\": " << timer.getCount()
+        << ", \"p50_ns\": " << p50
+        << ", \"p99_ns\": " << timer.getPercentileNanosecs(99.0)
+        << ", \"max_ns\": " << timer.getMaxNanosecs()
+        << ", \"ns_per_event\": " << (events > 0 ? double(p50) / events : 0.0)
+        << " }";
+}
+
+static void benchmark(ostream &out, bool &first, size_t events, size_t runs, double rate)
+{
+    vector<uint32_t> tof(events), pixel(events);
+    EventGenerator generator(42);
+    PostRunnable runnable;
+
+    for (int realistic=0; realistic<2; ++realistic)
+    {
+        const char *mode = realistic ? "realistic" : "fake";
+        LatencyHistogram tof_timer, pixel_timer;
+        for (size_t run=0; run<runs; ++run)
+        {
+            generator.setPulse(run, realistic, 1, 0);
+            tof_timer.start();
+            generator.fillTimeOfFlight(&tof[0], events);
+            tof_timer.stop();
+
+            pixel_timer.start();
+            generator.fillPixel(&pixel[0], 0, events, 0);
+            pixel_timer.stop();
+        }
+        report(out, first, "tof_fill", mode, events, tof_timer);
+        first = false;
+        report(out, first, "pixel_fill", mode, events, pixel_timer);
+    }
+
+    // Post frozen arrays to the record as the server does
+    // for each pulse, but without clients,
+    // back-to-back and then at a steady rate
+    for (int paced=0; paced<2; ++paced)
+    {
+        LatencyHistogram post_timer;
+        PulseScheduler scheduler(1.0/rate);
+        for (size_t run=0; run<runs; ++run)
+        {
+#ifdef USE_PVXS
+            pvxs::shared_array<uint32_t> tof_data(events), pixel_data(events);
+#else
+            epics::pvData::shared_vector<epics::pvData::uint32> tof_data(events), pixel_data(events);
+#endif
+            copy(tof.begin(), tof.end(), tof_data.begin());
+            copy(pixel.begin(), pixel.end(), pixel_data.begin());
+#ifdef USE_PVXS
+            EventArray tof_events(tof_data.freeze()), pixel_events(pixel_data.freeze());
+#else
+            EventArray tof_events(freeze(tof_data)), pixel_events(freeze(pixel_data));
+#endif
+            if (paced)
+                scheduler.waitForNext();
+            post_timer.start();
+            runnable.post(run, 1e8, tof_events, pixel_events);
+            post_timer.stop();
+        }
+        if (paced)
+            report(out, first, "post_paced", "split", events, post_timer, rate);
+        else
+            report(out, first, "post", "split", events, post_timer);
+    }
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h        : Help" << endl;
+    cout << "  -e counts : Comma-separated event counts per pulse (default 1000,10000,100000,200000,1000000)" << endl;
+    cout << "  -r runs   : Runs for each count (default 100)" << endl;
+    cout << "  -p rate   : Pulses per second for the paced post (default 10000)" << endl;
+    cout << "  -o file   : Write JSON to file instead of stdout" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    string counts = "1000,10000,100000,200000,1000000";
+    size_t runs = 100;
+    double rate = 10000.0;
+    string filename;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:r:p:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            counts = optarg;
+            break;
+        case 'r':
+            runs = (size_t)atol(optarg);
+            break;
+        case 'p':
+            rate = atof(optarg);
+            break;
+        case 'o':
+            filename = optarg;
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+    if (runs < 1)
+        runs = 1;
+    if (rate <= 0)
+        rate = 10000.0;
+
+    ofstream file;
+    if (! filename.empty())
+    {
+        file.open(filename.c_str());
+        if (! file)
+        {
+            cerr << "Cannot write " << filename << endl;
+            return -1;
+        }
+    }
+    ostream &out = filename.empty() ? cout : file;
+
+    out << "{\n  \"benchmark\": \"generatorBenchmark\",\n";
+#ifdef USE_PVXS
+    out << "  \"server\": \"pvxs\",\n";
+#else
+    out << "  \"server\": \"pvDatabase\",\n";
+#endif
+    out << "  \"results\": [\n";
+    bool first = true;
+    istringstream items(counts);
+    string item;
+    while (getline(items, item, ','))
+    {
+        size_t events = (size_t)atol(item.c_str());
+        if (events > 0)
+            benchmark(out, first, events, runs, rate);
+    }
+    out << "\n  ]\n}" << endl;
+
+    return 0;
+}
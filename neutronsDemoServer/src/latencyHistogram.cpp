@@ -0,0 +1,79 @@
+/* latencyHistogram.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <string.h>
+#include <latencyHistogram.h>
+
+namespace epics { namespace neutronServer {
+
+void LatencyHistogram::reset()
+{
+    count = max_ns = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    count += other.count;
+    if (other.max_ns > max_ns)
+        max_ns = other.max_ns;
+    for (int i=0; i<BUCKETS; ++i)
+        buckets[i] += other.buckets[i];
+}
+
+uint64_t LatencyHistogram::getBucketLimit(int bucket)
+{
+    if (bucket < 2*SUB_BUCKETS)
+        return uint64_t(bucket);
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t first = uint64_t(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    return first + ((uint64_t(1) << shift) - 1);
+}
+
+uint64_t LatencyHistogram::getPercentileNanosecs(double percent) const
+{
+    if (count <= 0)
+        return 0;
+    // Number of values at or below the percentile, at least 1
+    uint64_t needed = uint64_t(count * percent / 100.0 + 0.5);
+    if (needed < 1)
+        needed = 1;
+    uint64_t seen = 0;
+    for (int i=0; i<BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= needed)
+        {
+            uint64_t limit = getBucketLimit(i);
+            return limit < max_ns ? limit : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+/** Show nanoseconds in microseconds */
+static void showMicrosecs(std::ostream& out, uint64_t ns)
+{
+    out << ns / 1000.0 << " us";
+}
+
+std::ostream& operator<<(std::ostream& out, const LatencyHistogram& histogram)
+{
+    if (histogram.count <= 0)
+    {
+        out << "-";
+        return out;
+    }
+    out << "p50 ";
+    showMicrosecs(out, histogram.getPercentileNanosecs(50.0));
+    out << ", p99 ";
+    showMicrosecs(out, histogram.getPercentileNanosecs(99.0));
+    out << ", p99.9 ";
+    showMicrosecs(out, histogram.getPercentileNanosecs(99.9));
+    out << ", max ";
+    showMicrosecs(out, histogram.max_ns);
+    return out;
+}
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,111 @@
+/* latencyHistogram.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __LATENCY_HISTOGRAM_H__
+#define __LATENCY_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <iostream>
+#include <nanoTimer.h>
+
+namespace epics { namespace neutronServer {
+
+/** Timer that keeps a histogram of the measured durations
+ *
+ *  Averages hide the occasional slow pulse.
+ *  Like an HDR histogram, values are counted in buckets
+ *  that cover each power of two with SUB_BUCKETS linear steps,
+ *  so any percentile is within about 3% of the actual value
+ *  from nanoseconds up to hours, using a fixed amount of memory.
+ *
+ *  Not thread-safe: Measure, report and reset from one thread.
+ */
+class LatencyHistogram
+{
+public:
+    enum
+    {
+        SUB_BITS = 5,
+        SUB_BUCKETS = 1 << SUB_BITS,
+        /** Values below 2*SUB_BUCKETS use one bucket per nanosecond,
+         *  then SUB_BUCKETS for each further power of two up to 2^64
+         */
+        BUCKETS = (65 - SUB_BITS) * SUB_BUCKETS
+    };
+
+    LatencyHistogram()
+    {
+        reset();
+        start();
+    }
+
+    void start()
+    {
+        start_ns = NanoTimer::getCurrentNanosecs();
+    }
+
+    /** Start from an earlier time, for example a deadline
+     *  @param ns Start time as NanoTimer::getCurrentNanosecs()
+     */
+    void start(uint64_t ns)
+    {
+        start_ns = ns;
+    }
+
+    void stop()
+    {
+        add(NanoTimer::getCurrentNanosecs() - start_ns);
+    }
+
+    /** Add a duration that was measured elsewhere */
+    void add(uint64_t ns)
+    {
+        ++count;
+        if (ns > max_ns)
+            max_ns = ns;
+        ++buckets[getBucket(ns)];
+    }
+
+    /** Add all values of another histogram */
+    void add(const LatencyHistogram &other);
+
+    uint64_t getCount() const
+    {
+        return count;
+    }
+
+    uint64_t getMaxNanosecs() const
+    {
+        return max_ns;
+    }
+
+    /** @param percent Percentile 0..100, for example 99.9
+     *  @return Nanoseconds that 'percent' of the values did not exceed, 0 when empty
+     */
+    uint64_t getPercentileNanosecs(double percent) const;
+
+    void reset();
+
+    /** Show percentiles p50, p99, p99.9 and max */
+    friend std::ostream& operator<<(std::ostream& out, const LatencyHistogram& histogram);
+
+private:
+    static int getBucket(uint64_t ns)
+    {
+        if (ns < 2*SUB_BUCKETS)
+            return int(ns);
+        // Highest bit is at least SUB_BITS+1
+        int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + int((ns >> shift) - SUB_BUCKETS);
+    }
+
+    /** @return Largest value that's counted in bucket */
+    static uint64_t getBucketLimit(int bucket);
+
+    uint64_t count, max_ns, start_ns;
+    uint64_t buckets[BUCKETS];
+};
+
+}} // namespace neutronServer, epics
+#endif // __LATENCY_HISTOGRAM_H__
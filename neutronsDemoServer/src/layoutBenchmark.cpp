@@ -0,0 +1,186 @@
+/* layoutBenchmark.cpp
+ *
+ * Compare the split time_of_flight/pixel layout
+ * with the packed 64-bit events layout.
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <nanoTimer.h>
+#include <randomEngine.h>
+#include <packedEvents.h>
+
+using namespace std;
+using namespace epics::neutronServer;
+
+/** Events per generator block, same as FakeNeutronEventRunnable */
+#define BLOCK 1024
+
+/** Keep the compiler from dropping results */
+static volatile uint64_t sink;
+
+static void generateSplit(RandomEngine &random, uint32_t *tof, uint32_t *pixel, size_t n)
+{
+    random.fillAverage(tof, n, 100000, 4);
+    random.fillRange(pixel, n, 0, 1024*1024);
+}
+
+static void generatePacked(RandomEngine &random, uint64_t *events, size_t n)
+{
+    uint32_t tof[BLOCK], pixel[BLOCK];
+    for (size_t start = 0;  start < n;  start += BLOCK)
+    {
+        size_t count = min(n - start, size_t(BLOCK));
+        generateSplit(random, tof, pixel, count);
+        packEvents(tof, pixel, count, events + start);
+    }
+}
+
+/** Client that looks at each event, i.e. both values */
+static uint64_t consumeSplit(const uint32_t *tof, const uint32_t *pixel, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i=0; i<n; ++i)
+        sum += tof[i] ^ pixel[i];
+    return sum;
+}
+
+static uint64_t consumePacked(const uint64_t *events, size_t n)
+{
+    uint64_t sum = 0;
+    for (size_t i=0; i<n; ++i)
+        sum += getPackedTimeOfFlight(events[i]) ^ getPackedPixel(events[i]);
+    return sum;
+}
+
+static void report(const char *what, const NanoTimer &timer, size_t n, size_t bytes)
+{
+    double ns = timer.getAverageNanosecs();
+    cout << "  " << what << ": " << timer
+         << ", " << ns / n << " ns/event"
+         << ", " << bytes / ns << " GB/s" << endl;
+}
+
+static void benchmark(size_t n, size_t runs)
+{
+    size_t bytes = n * 2 * sizeof(uint32_t);
+    cout << n << " events, " << bytes << " bytes on the wire in either layout" << endl;
+
+    vector<uint32_t> tof(n), pixel(n), tof_out(n), pixel_out(n);
+    vector<uint64_t> events(n);
+    // Network send/receive buffer
+    vector<char> buffer(bytes);
+    RandomEngine random(42);
+
+    NanoTimer gen_split, gen_packed, copy_out_split, copy_out_packed, copy_in_split, copy_in_packed,
+              use_split, use_packed, unpack;
+    for (size_t run=0; run<runs; ++run)
+    {
+        gen_split.start();
+        generateSplit(random, &tof[0], &pixel[0], n);
+        gen_split.stop();
+
+        gen_packed.start();
+        generatePacked(random, &events[0], n);
+        gen_packed.stop();
+
+        // Copy to and from a network buffer, the bulk of what serialization
+        // of the arrays does, without the pvAccess encoding itself.
+        // Split layout copies two arrays, packed layout one
+        copy_out_split.start();
+        memcpy(&buffer[0], &tof[0], n * sizeof(uint32_t));
+        memcpy(&buffer[n * sizeof(uint32_t)], &pixel[0], n * sizeof(uint32_t));
+        copy_out_split.stop();
+
+        copy_in_split.start();
+        memcpy(&tof_out[0], &buffer[0], n * sizeof(uint32_t));
+        memcpy(&pixel_out[0], &buffer[n * sizeof(uint32_t)], n * sizeof(uint32_t));
+        copy_in_split.stop();
+
+        copy_out_packed.start();
+        memcpy(&buffer[0], &events[0], bytes);
+        copy_out_packed.stop();
+
+        copy_in_packed.start();
+        memcpy(&events[0], &buffer[0], bytes);
+        copy_in_packed.stop();
+
+        // Client reading each event
+        use_split.start();
+        sink += consumeSplit(&tof_out[0], &pixel_out[0], n);
+        use_split.stop();
+
+        use_packed.start();
+        sink += consumePacked(&events[0], n);
+        use_packed.stop();
+
+        // Client that needs the split arrays, for example to write them to a file
+        unpack.start();
+        unpackEvents(&events[0], n, &tof_out[0], &pixel_out[0]);
+        unpack.stop();
+        sink += tof_out[n/2];
+    }
+
+    report("Generate split     ", gen_split, n, bytes);
+    report("Generate packed    ", gen_packed, n, bytes);
+    report("Copy out split     ", copy_out_split, n, bytes);
+    report("Copy out packed    ", copy_out_packed, n, bytes);
+    report("Copy in split      ", copy_in_split, n, bytes);
+    report("Copy in packed     ", copy_in_packed, n, bytes);
+    report("Consume split      ", use_split, n, bytes);
+    report("Consume packed     ", use_packed, n, bytes);
+    report("Unpack packed      ", unpack, n, bytes);
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h             : Help" << endl;
+    cout << "  -e count       : Events per pulse, may be repeated (default: 1000, 200000, 4000000)" << endl;
+    cout << "  -r runs        : Runs per event count (default: 100)" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    vector<size_t> counts;
+    size_t runs = 100;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            counts.push_back(strtoul(optarg, 0, 0));
+            break;
+        case 'r':
+            runs = strtoul(optarg, 0, 0);
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+    if (counts.empty())
+    {
+        counts.push_back(1000);
+        counts.push_back(200000);
+        counts.push_back(4000000);
+    }
+    if (runs < 1)
+        runs = 1;
+
+    for (size_t i=0; i<counts.size(); ++i)
+        if (counts[i] > 0)
+            benchmark(counts[i], runs);
+
+    return 0;
+}
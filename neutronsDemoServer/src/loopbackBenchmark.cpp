@@ -0,0 +1,398 @@
+/* loopbackBenchmark.cpp
+ *
+ * Server and monitor clients in one process,
+ * connected via localhost, to measure the throughput
+ * and the latency from post() to the client's monitor event
+ * for a range of event counts and update rates.
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <epicsGuard.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "neutronServer.h"
+#include "eventGenerator.h"
+#include "latencyHistogram.h"
+#include "pulseScheduler.h"
+
+#ifdef USE_PVXS
+#   include <pvxs/client.h>
+#   include <pvxs/server.h>
+#else
+#   include <pv/pvData.h>
+#   include <pv/pvAccess.h>
+#   include <pv/clientFactory.h>
+#   include <pv/createRequest.h>
+#   include <pv/event.h>
+#   include <pv/monitor.h>
+#   include <pv/channelProviderLocal.h>
+#   include <pv/serverContext.h>
+#endif
+
+using namespace std;
+using namespace epics::neutronServer;
+#ifndef USE_PVXS
+using namespace epics::pvData;
+using namespace epics::pvAccess;
+using namespace epics::pvDatabase;
+#endif
+
+/** Time when each pulse was posted, by pulse ID.
+ *  Written by the posting thread, read by the client threads.
+ */
+enum { POSTED = 1 << 16 };
+static atomic<uint64_t> posted_ns[POSTED];
+
+/** Runnable that's only used to post to its record, never started */
+class LoopbackRunnable : public NeutronEventRunnable
+{
+public:
+    LoopbackRunnable() : NeutronEventRunnable("loopback") {}
+    void run() {}
+};
+
+/** What one client received */
+class ClientStats
+{
+public:
+    ClientStats() : pulses(0), events(0) {}
+
+    /** Called by client thread for each received pulse */
+    void add(uint32_t pulse_id, size_t event_count)
+    {
+        uint64_t now = NanoTimer::getCurrentNanosecs();
+        uint64_t posted = posted_ns[pulse_id % POSTED].load();
+        epicsGuard<epicsMutex> guard(mutex);
+        ++pulses;
+        events += event_count;
+        if (posted > 0  &&  now >= posted)
+            latency.add(now - posted);
+    }
+
+    /** Get and reset what was received */
+    void take(uint64_t &pulses, uint64_t &events, LatencyHistogram &latency)
+    {
+        epicsGuard<epicsMutex> guard(mutex);
+        pulses = this->pulses;
+        events = this->events;
+        latency = this->latency;
+        this->pulses = this->events = 0;
+        this->latency.reset();
+    }
+
+private:
+    epicsMutex mutex;
+    uint64_t pulses, events;
+    LatencyHistogram latency;
+};
+
+#ifndef USE_PVXS
+class LoopbackChannelRequester : public ChannelRequester
+{
+    Event connect_event;
+public:
+    string getRequesterName()
+    {   return "LoopbackChannelRequester"; }
+
+    void channelCreated(const Status& status, Channel::shared_pointer const & channel)
+    {}
+
+    void channelStateChange(Channel::shared_pointer const & channel, Channel::ConnectionState connectionState)
+    {
+        if (connectionState == Channel::CONNECTED)
+            connect_event.signal();
+    }
+
+    bool waitUntilConnected(double timeout)
+    {
+        return connect_event.wait(timeout);
+    }
+};
+
+class LoopbackMonitorRequester : public MonitorRequester
+{
+    ClientStats &stats;
+    size_t user_tag_offset, tof_offset;
+    Event connect_event;
+public:
+    LoopbackMonitorRequester(ClientStats &stats)
+    : stats(stats), user_tag_offset(-1), tof_offset(-1)
+    {}
+
+    string getRequesterName()
+    {   return "LoopbackMonitorRequester"; }
+
+    void monitorConnect(Status const & status, MonitorPtr const & monitor, StructureConstPtr const & structure)
+    {
+        if (! status.isSuccess())
+            return;
+        PVStructurePtr pvStructure = getPVDataCreate()->createPVStructure(structure);
+        shared_ptr<PVInt> user_tag = pvStructure->getSubField<PVInt>("timeStamp.userTag");
+        shared_ptr<PVUIntArray> tof = pvStructure->getSubField<PVUIntArray>("time_of_flight.value");
+        if (! user_tag  ||  ! tof)
+        {
+            cerr << "Missing 'timeStamp.userTag' or 'time_of_flight'" << endl;
+            return;
+        }
+        user_tag_offset = user_tag->getFieldOffset();
+        tof_offset = tof->getFieldOffset();
+        monitor->start();
+        connect_event.signal();
+    }
+
+    void monitorEvent(MonitorPtr const & monitor)
+    {
+        shared_ptr<MonitorElement> update;
+        while ((update = monitor->poll()))
+        {
+            PVStructurePtr pvStructure = update->pvStructurePtr;
+            shared_ptr<PVInt> user_tag = dynamic_pointer_cast<PVInt>(pvStructure->getSubField(user_tag_offset));
+            shared_ptr<PVUIntArray> tof = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(tof_offset));
+            if (user_tag  &&  tof)
+                stats.add(user_tag->get(), tof->getLength());
+            monitor->release(update);
+        }
+    }
+
+    void unlisten(MonitorPtr const & monitor)
+    {}
+
+    bool waitUntilConnected(double timeout)
+    {
+        return connect_event.wait(timeout);
+    }
+};
+#endif
+
+static vector<double> parseList(const string &list)
+{
+    vector<double> values;
+    istringstream items(list);
+    string item;
+    while (getline(items, item, ','))
+        if (! item.empty())
+            values.push_back(atof(item.c_str()));
+    return values;
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h         : Help" << endl;
+    cout << "  -e counts  : Comma-separated event counts per pulse (default 1000,10000,100000,200000)" << endl;
+    cout << "  -d delays  : Comma-separated seconds between pulses (default 0.1,0.01,0.001)" << endl;
+    cout << "  -n clients : Number of monitor clients (default 1)" << endl;
+    cout << "  -s seconds : Duration of each configuration (default 5)" << endl;
+    cout << "  -r request : Client request (default 'record[queueSize=100]field()')" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    vector<double> counts = parseList("1000,10000,100000,200000");
+    vector<double> delays = parseList("0.1,0.01,0.001");
+    size_t client_count = 1;
+    double seconds = 5.0;
+    string request = "record[queueSize=100]field()";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:d:n:s:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            counts = parseList(optarg);
+            break;
+        case 'd':
+            delays = parseList(optarg);
+            break;
+        case 'n':
+            client_count = (size_t)atol(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'r':
+            request = optarg;
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+    if (client_count < 1)
+        client_count = 1;
+
+    LoopbackRunnable runnable;
+    vector<shared_ptr<ClientStats> > stats;
+    for (size_t i=0; i<client_count; ++i)
+        stats.push_back(shared_ptr<ClientStats>(new ClientStats()));
+
+#ifdef USE_PVXS
+    // Isolated server only reachable by clients from its own configuration
+    pvxs::server::Server serv = pvxs::server::Config::isolated().build();
+    serv.addSource("loopback", runnable.getSource());
+    serv.start();
+    pvxs::client::Context ctxt = serv.clientConfig().build();
+    vector<shared_ptr<pvxs::client::Subscription> > monitors;
+    for (size_t i=0; i<client_count; ++i)
+    {
+        ClientStats *client = stats[i].get();
+        monitors.push_back(ctxt.monitor("loopback")
+                               .pvRequest(request)
+                               .event([client](pvxs::client::Subscription &sub)
+        {
+            while (true)
+            {
+                try
+                {
+                    while (pvxs::Value update = sub.pop())
+                    {
+                        pvxs::shared_array<const uint32_t> tof = update["time_of_flight.value"].as<pvxs::shared_array<const uint32_t> >();
+                        client->add(update["timeStamp.userTag"].as<uint32_t>(), tof.size());
+                    }
+                    return;
+                }
+                catch (pvxs::client::Connected &)
+                {   // Continue with the updates that follow
+                }
+                catch (std::exception &ex)
+                {
+                    cerr << "Monitor error: " << ex.what() << endl;
+                    return;
+                }
+            }
+        }).exec());
+    }
+#else
+    if (! PVDatabase::getMaster()->addRecord(runnable.getRecord()))
+    {
+        cerr << "Cannot add record 'loopback'" << endl;
+        return -1;
+    }
+    ServerContext::shared_pointer pvaServer = startPVAServer(PVACCESS_ALL_PROVIDERS,0,true,true);
+    ClientFactory::start();
+    ChannelProvider::shared_pointer provider = ChannelProviderRegistry::clients()->getProvider("pva");
+    shared_ptr<PVStructure> pvRequest = CreateRequest::create()->createRequest(request);
+    vector<shared_ptr<Channel> > channels;
+    vector<shared_ptr<Monitor> > monitors;
+    for (size_t i=0; i<client_count; ++i)
+    {
+        shared_ptr<LoopbackChannelRequester> channel_requester(new LoopbackChannelRequester());
+        shared_ptr<Channel> channel = provider->createChannel("loopback", channel_requester);
+        if (! channel_requester->waitUntilConnected(5.0))
+        {
+            cerr << "Cannot connect to 'loopback'" << endl;
+            return -1;
+        }
+        shared_ptr<LoopbackMonitorRequester> monitor_requester(new LoopbackMonitorRequester(*stats[i]));
+        // Keep the monitor, otherwise it's deleted right away
+        monitors.push_back(channel->createMonitor(monitor_requester, pvRequest));
+        monitor_requester->waitUntilConnected(5.0);
+        channels.push_back(channel);
+    }
+#endif
+    // Allow clients to connect
+    epicsThreadSleep(1.0);
+
+    cout << client_count << " client(s), " << seconds << " seconds per configuration, request '" << request << "'" << endl;
+    // Events per second posted, and received by each client.
+    // MB/s received by all clients, pulses lost by all clients,
+    // latency from post() to the client's monitor event.
+    cout << setw(8) << "events" << setw(8) << "delay"
+         << setw(12) << "posted/s" << setw(12) << "received/s" << setw(10) << "MB/s"
+         << setw(9) << "lost %" << setw(11) << "p50 us" << setw(11) << "p99 us" << endl;
+
+    EventGenerator generator(42);
+    uint32_t id = 0;
+    for (size_t c=0; c<counts.size(); ++c)
+    {
+        size_t count = size_t(counts[c]);
+        for (size_t d=0; d<delays.size(); ++d)
+        {
+            double delay = delays[d];
+            // Reset what clients received so far
+            uint64_t pulses, events;
+            LatencyHistogram latency;
+            for (size_t i=0; i<client_count; ++i)
+                stats[i]->take(pulses, events, latency);
+
+            PulseScheduler scheduler(delay);
+            uint64_t start = NanoTimer::getCurrentNanosecs(), end = start + uint64_t(seconds * 1e9);
+            uint64_t posted = 0;
+            while (NanoTimer::getCurrentNanosecs() < end)
+            {
+                scheduler.waitForNext();
+                ++id;
+#ifdef USE_PVXS
+                pvxs::shared_array<uint32_t> tof(count), pixel(count);
+#else
+                shared_vector<uint32> tof(count), pixel(count);
+#endif
+                generator.setPulse(id, false, 1, 0);
+                generator.fillTimeOfFlight(tof.data(), count);
+                generator.fillPixel(pixel.data(), 0, count, 0);
+#ifdef USE_PVXS
+                EventArray tof_events(tof.freeze()), pixel_events(pixel.freeze());
+#else
+                EventArray tof_events(freeze(tof)), pixel_events(freeze(pixel));
+#endif
+                posted_ns[id % POSTED] = NanoTimer::getCurrentNanosecs();
+                runnable.post(id, 1e8, tof_events, pixel_events);
+                ++posted;
+            }
+            double elapsed = (NanoTimer::getCurrentNanosecs() - start) * 1e-9;
+            // Allow last updates to arrive
+            epicsThreadSleep(0.5);
+
+            // Combine all clients
+            uint64_t received = 0, received_events = 0;
+            LatencyHistogram all;
+            for (size_t i=0; i<client_count; ++i)
+            {
+                stats[i]->take(pulses, events, latency);
+                received += pulses;
+                received_events += events;
+                all.add(latency);
+            }
+            double lost = posted > 0 ? 100.0 * (1.0 - double(received) / (posted * client_count)) : 0.0;
+            cout << setw(8) << count << setw(8) << delay
+                 << setw(12) << posted * count / elapsed
+                 << setw(12) << received_events / elapsed / client_count
+                 << setw(10) << received_events * 2 * sizeof(uint32_t) / elapsed / 1e6
+                 << setw(9) << max(lost, 0.0)
+                 << setw(11) << all.getPercentileNanosecs(50.0) / 1000.0
+                 << setw(11) << all.getPercentileNanosecs(99.0) / 1000.0 << endl;
+        }
+    }
+
+#ifdef USE_PVXS
+    monitors.clear();
+    serv.stop();
+#else
+    for (size_t i=0; i<client_count; ++i)
+    {
+        monitors[i]->stop();
+        monitors[i]->destroy();
+        channels[i]->destroy();
+    }
+    ClientFactory::stop();
+    pvaServer->shutdown();
+#endif
+
+    return 0;
+}
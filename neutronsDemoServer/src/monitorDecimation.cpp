@@ -0,0 +1,248 @@
+/* monitorDecimation.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <epicsGuard.h>
+#include <nanoTimer.h>
+#include <monitorDecimation.h>
+
+#ifdef USE_PVXS
+#   include <pvxs/server.h>
+    using namespace pvxs;
+#else
+#   include <pv/pvData.h>
+#   include <pv/pvPlugin.h>
+    using namespace epics::pvData;
+    using namespace epics::pvCopy;
+#endif
+
+namespace epics { namespace neutronServer {
+
+std::atomic<uint64_t> MonitorDecimation::sent(0), MonitorDecimation::skipped(0);
+
+MonitorDecimation::MonitorDecimation(uint32_t decimate, double max_rate)
+  : decimate(decimate > 1 ? decimate : 1), count(0),
+    min_period_ns(max_rate > 0 ? uint64_t(1e9 / max_rate) : 0), last_ns(0)
+{
+}
+
+bool MonitorDecimation::accept()
+{
+    // Full-rate subscribers send everything and aren't counted
+    if (decimate <= 1  &&  min_period_ns == 0)
+        return true;
+    bool send;
+    if (min_period_ns > 0)
+    {
+        uint64_t now = NanoTimer::getCurrentNanosecs();
+        send = last_ns == 0  ||  now - last_ns >= min_period_ns;
+        if (send)
+            last_ns = now;
+    }
+    else
+    {   // Send the first update, then every N'th
+        send = count == 0;
+        if (++count >= decimate)
+            count = 0;
+    }
+    if (send)
+        ++sent;
+    else
+        ++skipped;
+    return send;
+}
+
+uint64_t MonitorDecimation::getSent()
+{
+    return sent;
+}
+
+uint64_t MonitorDecimation::getSkipped()
+{
+    return skipped;
+}
+
+#ifdef USE_PVXS
+
+// --------------------------------------------------------------------------------------------
+// DecimatingSource
+// --------------------------------------------------------------------------------------------
+
+/** @return Decimation requested via "field(timeStamp[decimate=N])" or "[maxRate=Hz]" */
+static MonitorDecimation getDecimation(const Value &request)
+{
+    uint32_t decimate = 1;
+    double max_rate = 0.0;
+    Value option = request["field.timeStamp._options.decimate"];
+    if (option.valid())
+        decimate = (uint32_t) atol(option.as<std::string>().c_str());
+    option = request["field.timeStamp._options.maxRate"];
+    if (option.valid())
+        max_rate = atof(option.as<std::string>().c_str());
+    return MonitorDecimation(decimate, max_rate);
+}
+
+DecimatingSource::DecimatingSource(const std::vector<std::string> &names, const Value &initial)
+  : records(names.size())
+{
+    for (size_t i=0; i<names.size(); ++i)
+    {
+        index[names[i]] = i;
+        records[i].current = initial.clone();
+    }
+}
+
+void DecimatingSource::post(size_t i, const Value &update)
+{
+    epicsGuard<epicsMutex> guard(mutex);
+    Record &record = records[i];
+    record.current = update;
+    for (auto sub : record.subscribers)
+        if (sub->control  &&  sub->decimation.accept())
+            sub->control->post(update);
+}
+
+void DecimatingSource::onSearch(Search &search)
+{
+    for (auto &op : search)
+        if (index.count(op.name()))
+            op.claim();
+}
+
+void DecimatingSource::onCreate(std::unique_ptr<server::ChannelControl> &&op)
+{
+    auto found = index.find(op->name());
+    if (found == index.end())
+        return;
+    size_t i = found->second;
+    std::shared_ptr<server::ChannelControl> channel(std::move(op));
+
+    // Get returns the last posted value
+    channel->onOp([this, i](std::unique_ptr<server::ConnectOp> &&op)
+    {
+        Value current;
+        {
+            epicsGuard<epicsMutex> guard(mutex);
+            current = records[i].current;
+        }
+        op->onGet([this, i](std::unique_ptr<server::ExecOp> &&get)
+        {
+            Value current;
+            {
+                epicsGuard<epicsMutex> guard(mutex);
+                current = records[i].current;
+            }
+            get->reply(current);
+        });
+        op->connect(current);
+    });
+
+    channel->onSubscribe([this, i](std::unique_ptr<server::MonitorSetupOp> &&setup)
+    {
+        subscribe(i, std::move(setup));
+    });
+
+    std::weak_ptr<server::ChannelControl> weak(channel);
+    channel->onClose([this, i, weak](const std::string &)
+    {
+        epicsGuard<epicsMutex> guard(mutex);
+        records[i].channels.erase(weak.lock());
+    });
+
+    epicsGuard<epicsMutex> guard(mutex);
+    records[i].channels.insert(channel);
+}
+
+void DecimatingSource::subscribe(size_t i, std::unique_ptr<server::MonitorSetupOp> &&setup)
+{
+    std::shared_ptr<Subscriber> sub(new Subscriber());
+    sub->decimation = getDecimation(setup->pvRequest());
+
+    std::weak_ptr<Subscriber> weak(sub);
+    setup->onClose([this, i, weak](const std::string &)
+    {
+        epicsGuard<epicsMutex> guard(mutex);
+        records[i].subscribers.erase(weak.lock());
+    });
+
+    epicsGuard<epicsMutex> guard(mutex);
+    Record &record = records[i];
+    sub->control = setup->connect(record.current);
+    sub->control->post(record.current);
+    record.subscribers.insert(sub);
+}
+
+#else
+
+// --------------------------------------------------------------------------------------------
+// pvCopy plugins for pvDatabase
+// --------------------------------------------------------------------------------------------
+
+/** Filter for the timeStamp field, which changes on every update.
+ *  For a skipped update, it clears all changed bits,
+ *  so the monitor doesn't copy the remaining fields nor queue the update.
+ */
+class DecimationFilter : public PVFilter
+{
+public:
+    DecimationFilter(const std::string &name, const MonitorDecimation &decimation, PVFieldPtr const &master)
+    : name(name), decimation(decimation), master(master)
+    {}
+
+    bool filter(PVFieldPtr const &pvCopy, BitSetPtr const &bitSet, bool toCopy)
+    {
+        if (! toCopy)
+            return false;
+        if (decimation.accept())
+        {
+            pvCopy->copyUnchecked(*master);
+            bitSet->set(pvCopy->getFieldOffset());
+        }
+        else
+            bitSet->clear();
+        return true;
+    }
+
+    std::string getName()
+    {
+        return name;
+    }
+
+private:
+    std::string name;
+    MonitorDecimation decimation;
+    PVFieldPtr master;
+};
+
+class DecimationPlugin : public PVPlugin
+{
+public:
+    /** @param rate Is requestValue a rate in Hz instead of a decimation factor? */
+    DecimationPlugin(const std::string &name, bool rate)
+    : name(name), rate(rate)
+    {}
+
+    PVFilterPtr create(const std::string &requestValue, PVCopyPtr const &pvCopy, PVFieldPtr const &master)
+    {
+        double value = atof(requestValue.c_str());
+        if (value <= 0)
+            return PVFilterPtr();
+        MonitorDecimation decimation = rate ? MonitorDecimation(1, value) : MonitorDecimation((uint32_t) value);
+        return PVFilterPtr(new DecimationFilter(name, decimation, master));
+    }
+
+private:
+    std::string name;
+    bool rate;
+};
+
+void registerDecimationPlugins()
+{
+    PVPluginRegistry::registerPlugin("decimate", PVPluginPtr(new DecimationPlugin("decimate", false)));
+    PVPluginRegistry::registerPlugin("maxRate", PVPluginPtr(new DecimationPlugin("maxRate", true)));
+}
+
+#endif // USE_PVXS
+
+}} // namespace neutronServer, epics
@@ -0,0 +1,119 @@
+/* monitorDecimation.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __MONITOR_DECIMATION_H__
+#define __MONITOR_DECIMATION_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <epicsMutex.h>
+
+#ifdef USE_PVXS
+#    include <pvxs/data.h>
+#    include <pvxs/source.h>
+#endif
+
+namespace epics { namespace neutronServer {
+
+/** Per-subscriber decimation of monitor updates
+ *
+ *  A slow client, for example an operator display, can request
+ *  fewer updates via options of the timeStamp field:
+ *
+ *      field(timeStamp[decimate=10],proton_charge,time_of_flight,pixel)
+ *      field(timeStamp[maxRate=2],proton_charge,time_of_flight,pixel)
+ *
+ *  'decimate=N' sends every N'th update, 'maxRate=Hz' sends at most
+ *  that many updates per second. Skipped updates are never copied
+ *  into that client's monitor queue, so they're not serialized,
+ *  while other subscribers still receive every update.
+ *
+ *  For pvDatabase, these are pvCopy plugins, see registerDecimationPlugins().
+ *  For PVXS, DecimatingSource serves the records.
+ */
+class MonitorDecimation
+{
+public:
+    /** @param decimate Send every N'th update, 0 or 1 to send all
+     *  @param max_rate Send at most this many updates per second, 0 for no limit
+     */
+    MonitorDecimation(uint32_t decimate = 1, double max_rate = 0.0);
+
+    /** @return Should the next update be sent? */
+    bool accept();
+
+    /** @return Total number of updates sent resp. skipped by all decimating subscribers,
+     *          not counting subscribers that receive every update
+     */
+    static uint64_t getSent();
+    static uint64_t getSkipped();
+
+private:
+    uint32_t decimate, count;
+    uint64_t min_period_ns, last_ns;
+
+    static std::atomic<uint64_t> sent, skipped;
+};
+
+#ifdef USE_PVXS
+
+/** PVXS source for records where each subscriber can request decimation
+ *
+ *  Like a SharedPV for each record, except that posted
+ *  updates are only sent to subscribers whose decimation accepts them.
+ *  Options are read from the pvRequest "field.timeStamp._options".
+ */
+class DecimatingSource : public pvxs::server::Source
+{
+public:
+    /** @param names Record names
+     *  @param initial Initial value of all records, defines their type
+     */
+    DecimatingSource(const std::vector<std::string> &names, const pvxs::Value &initial);
+
+    /** Post update to subscribers of a record */
+    void post(size_t index, const pvxs::Value &update);
+
+    // Source
+    void onSearch(Search &search) override;
+    void onCreate(std::unique_ptr<pvxs::server::ChannelControl> &&op) override;
+
+private:
+    struct Subscriber
+    {
+        std::unique_ptr<pvxs::server::MonitorControlOp> control;
+        MonitorDecimation decimation;
+    };
+
+    struct Record
+    {
+        pvxs::Value current;
+        std::set<std::shared_ptr<pvxs::server::ChannelControl> > channels;
+        std::set<std::shared_ptr<Subscriber> > subscribers;
+    };
+
+    void subscribe(size_t index, std::unique_ptr<pvxs::server::MonitorSetupOp> &&setup);
+
+    epicsMutex mutex;
+    std::map<std::string, size_t> index;
+    std::vector<Record> records;
+};
+
+#else
+
+/** Register the pvCopy plugins "decimate" and "maxRate" with pvDatabase.
+ *  Must be called before clients connect.
+ */
+void registerDecimationPlugins();
+
+#endif // USE_PVXS
+
+}} // namespace neutronServer, epics
+#endif // __MONITOR_DECIMATION_H__
@@ -9,6 +9,8 @@
 #ifndef __NANO_TIMER_H__
 #define __NANO_TIMER_H__
 
+#include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
 #include <iostream>
 
@@ -32,7 +34,12 @@ public:
 
     void stop()
     {
-        uint64_t ns = getCurrentNanosecs() - start_ns;
+        add(getCurrentNanosecs() - start_ns);
+    }
+
+    /** Add a duration that was measured elsewhere */
+    void add(uint64_t ns)
+    {
         total_ns += ns;
         ++total_runs;
     }
@@ -44,15 +51,24 @@ public:
         return total_ns / total_runs;
     }
 
+    /** @return Nanoseconds of CLOCK_MONOTONIC, which NTP adjustments don't step */
     static uint64_t getCurrentNanosecs()
     {   // Compare pvCommonCPP/mbSrc/mb.[h,cpp]
+        return getNanosecs(CLOCK_MONOTONIC);
+    }
+
+    /** @param clock For example CLOCK_THREAD_CPUTIME_ID
+     *  @return Nanoseconds of that clock
+     */
+    static uint64_t getNanosecs(clockid_t clock)
+    {
         struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
+        clock_gettime(clock, &ts);
         return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
     }
 };
 
-std::ostream& operator<<(std::ostream& out, const NanoTimer& timer)
+inline std::ostream& operator<<(std::ostream& out, const NanoTimer& timer)
 {
     double avg = timer.getAverageNanosecs();
     if (avg < 1000.0)
@@ -6,9 +6,14 @@
  *
  * @author Kay Kasemir
  */
+#include <signal.h>
+#include <stdlib.h>
 #include <iostream>
+#include <sstream>
 #include <getopt.h>
 
+#include <epicsGuard.h>
+#include <epicsMutex.h>
 #include <epicsThread.h>
 #include <epicsTime.h>
 #include <pv/epicsException.h>
@@ -19,15 +24,19 @@
 #include <pv/pvAccess.h>
 #include <pv/monitor.h>
 
-// #define TIME_IT
-#ifdef TIME_IT
+#include "eventFile.h"
+#include "packedEvents.h"
+#include "eventCodec.h"
 #include "nanoTimer.h"
-#endif
+#include "analysisPipeline.h"
+
+// #define TIME_IT
 
 using namespace std;
 using namespace std::tr1;
 using namespace epics::pvData;
 using namespace epics::pvAccess;
+using namespace epics::neutronServer;
 
 #ifdef USE_PVXS
 #   include <pvxs/client.h>
@@ -148,7 +157,235 @@ void MyChannelGetRequester::getDone(const Status& status,
     }
 }
 
-/** Requester for 'monitoring' value changes of a channel */
+/** Default queueSize of pvAccess resp. PVXS monitors */
+#define PVA_QUEUE_SIZE 2
+#define PVXS_QUEUE_SIZE 4
+
+/** @return queueSize requested via "record[queueSize=N]", or the default */
+static size_t getQueueSize(const string &request, size_t default_size)
+{
+    size_t pos = request.find("queueSize=");
+    if (pos == string::npos)
+        return default_size;
+    long size = atol(request.c_str() + pos + 10);
+    return size > 0 ? size_t(size) : default_size;
+}
+
+/** Result of decoding one update, same for pvData and PVXS */
+struct DecodedPulse
+{
+    DecodedPulse()
+    : has_id(false), has_events(false), size_difference(false),
+      count(0), encoded_bytes(0), decode_ns(0)
+    {
+        header.pulse_id = header.seconds = 0;
+        header.nanoseconds = header.count = 0;
+        header.proton_charge = 0.0;
+    }
+
+    /** Were the pulse ID(s) resp. the events decoded?
+     *  If not, the problem has already been shown.
+     */
+    bool has_id, has_events;
+    /** Did time_of_flight and pixel differ in length? */
+    bool size_difference;
+    /** Pulse ID, time stamp and charge of the update */
+    EventFilePulse header;
+    /** Per-pulse arrays of a batched update, empty if not batched */
+    vector<uint64_t> batch_ids;
+    vector<double> batch_charges;
+    vector<uint32_t> batch_offsets;
+    /** Received or decoded events, shared with the update */
+    shared_ptr<const uint32_t> tof_data, pixel_data;
+    size_t count;
+    /** Size and time to decode compressed events, 0 when not compressed */
+    uint64_t encoded_bytes, decode_ns;
+    /** Problem found while decoding, shown by the PulseChecker in the order received */
+    string message;
+};
+
+/** Checks pulse IDs and records pulses
+ *
+ *  Must be called for each update in the order they were received.
+ */
+class PulseChecker
+{
+public:
+    PulseChecker(EventFileWriter *writer)
+    : writer(writer), last_pulse_id(0)
+    {
+        reset();
+    }
+
+    void check(const DecodedPulse &pulse);
+
+    /** @return Were compressed events decoded since last show()? */
+    bool isDecoding() const
+    {
+        return decode_ns > 0;
+    }
+
+    /** Show statistics, then reset them */
+    void show(ostream &out);
+
+private:
+    void checkPulseID(uint64 pulse_id);
+    void reset();
+
+    EventFileWriter *writer;
+    uint64 last_pulse_id;
+    uint64 pulses;
+    uint64 missing_pulses;
+    uint64 array_size_differences;
+    uint64 encoded_bytes;
+    uint64 decoded_events;
+    uint64 decode_ns;
+};
+
+void PulseChecker::reset()
+{
+    pulses = missing_pulses = array_size_differences = 0;
+    encoded_bytes = decoded_events = decode_ns = 0;
+}
+
+void PulseChecker::checkPulseID(uint64 pulse_id)
+{
+    ++pulses;
+    if (last_pulse_id != 0)
+    {
+        int missing = pulse_id - 1 - last_pulse_id;
+        if (missing > 0)
+            missing_pulses += missing;
+    }
+    last_pulse_id = pulse_id;
+}
+
+void PulseChecker::check(const DecodedPulse &pulse)
+{
+    if (! pulse.message.empty())
+        cout << pulse.message << endl;
+    if (! pulse.has_id)
+        return;
+    // Check pulse ID for skipped updates.
+    // Batched updates list the ID of each pulse
+    if (pulse.batch_ids.empty())
+        checkPulseID(pulse.header.pulse_id);
+    else
+        for (size_t i=0; i<pulse.batch_ids.size(); ++i)
+            checkPulseID(pulse.batch_ids[i]);
+
+    if (pulse.size_difference)
+        ++array_size_differences;
+    if (! pulse.has_events)
+        return;
+
+    if (pulse.encoded_bytes > 0)
+    {
+        encoded_bytes += pulse.encoded_bytes;
+        decoded_events += pulse.count;
+        decode_ns += pulse.decode_ns;
+    }
+
+    if (! writer)
+        return;
+    EventFilePulse header = pulse.header;
+    if (pulse.batch_ids.empty())
+    {
+        header.count = pulse.count;
+        // Writer keeps a reference to the received arrays, no copy
+        writer->write(header, pulse.tof_data, pulse.pixel_data);
+    }
+    else
+        for (size_t i=0; i<pulse.batch_ids.size(); ++i)
+        {   // Record each pulse of the batch, sharing the received arrays
+            size_t end = i+1 < pulse.batch_ids.size() ? pulse.batch_offsets[i+1] : pulse.count;
+            if (pulse.batch_offsets[i] > end  ||  end > pulse.count)
+            {
+                cout << "Pulse " << pulse.batch_ids[i] << ": Invalid offset" << endl;
+                return;
+            }
+            header.pulse_id = pulse.batch_ids[i];
+            header.proton_charge = pulse.batch_charges[i];
+            header.count = end - pulse.batch_offsets[i];
+            writer->write(header,
+                          shared_ptr<const uint32_t>(pulse.tof_data, pulse.tof_data.get() + pulse.batch_offsets[i]),
+                          shared_ptr<const uint32_t>(pulse.pixel_data, pulse.pixel_data.get() + pulse.batch_offsets[i]));
+        }
+}
+
+void PulseChecker::show(ostream &out)
+{
+    double received_perc = 100.0 * pulses / (pulses + missing_pulses);
+    out << missing_pulses << " missing pulses, "
+        << array_size_differences << " array size differences, "
+        << "received " << fixed << setprecision(1) << received_perc << "%";
+    if (writer)
+        out << ", recorded " << writer->getPulses() << " pulses, "
+            << writer->getBytes() / 1e6 << " MB, "
+            << writer->getDropped() << " dropped";
+    if (decode_ns > 0)
+        out << ", encoded " << (encoded_bytes > 0 ? 8.0 * decoded_events / encoded_bytes : 0.0)
+            << ":1, decoded at " << 8.0 * decoded_events / decode_ns << " GB/s";
+    reset();
+}
+
+/** Show and reset high-water marks of an analysis pipeline */
+template <class Item>
+static void showHighWater(ostream &out, AnalysisPipeline<Item> &pipeline)
+{
+    uint32_t queued, pending;
+    uint64_t full;
+    pipeline.takeHighWater(queued, pending, full);
+    out << ", " << pipeline.getThreadCount() << " analysis threads, queued max " << queued
+        << ", pending max " << pending << ", " << full << " times full";
+}
+
+class MyMonitorRequester;
+
+/** pvData update handed to analysis threads */
+struct PVDataUpdate
+{
+    PVDataUpdate()
+    {}
+
+    PVDataUpdate(MonitorPtr const &monitor, shared_ptr<MonitorElement> const &element)
+    : monitor(monitor), element(element)
+    {}
+
+    MonitorPtr monitor;
+    shared_ptr<MonitorElement> element;
+    DecodedPulse pulse;
+};
+
+/** Pipeline for a pvAccess monitor
+ *
+ *  Sized to the monitor's queueSize, since the client can't hold
+ *  more updates than that. Updates are released by the analysis threads,
+ *  after they were handled and outside of that serialized step,
+ *  because pvAccess may call monitorEvent() from within release().
+ */
+class PVDataPipeline : public AnalysisPipeline<PVDataUpdate>
+{
+    MyMonitorRequester &requester;
+public:
+    PVDataPipeline(MyMonitorRequester &requester, size_t threads, size_t queue_size)
+    : AnalysisPipeline<PVDataUpdate>(threads, queue_size), requester(requester)
+    {}
+
+protected:
+    void analyze(PVDataUpdate &update);
+    void complete(PVDataUpdate &update);
+    void release(PVDataUpdate &update);
+};
+
+/** Requester for 'monitoring' value changes of a channel
+ *
+ *  With analysis threads, monitorEvent() only hands the updates
+ *  to the pipeline, which decodes them in parallel
+ *  and then handles them in the order received.
+ *  monitorEvent() may then be called by the client library's thread
+ *  and an analysis thread at the same time.
+ */
 class MyMonitorRequester : public virtual MyRequester, public virtual MonitorRequester
 {
 	int limit;
@@ -160,35 +397,96 @@ class MyMonitorRequester : public virtual MyRequester, public virtual MonitorReq
     NanoTimer value_timer;
 #   endif
     size_t user_tag_offset;
+    size_t seconds_offset;
+    size_t nanoseconds_offset;
+    size_t charge_offset;
     size_t tof_offset;
     size_t pixel_offset;
-    int monitors;
+    size_t events_offset;
+    size_t encoded_offset;
+    size_t batch_id_offset;
+    size_t batch_charge_offset;
+    size_t batch_offset_offset;
+    EventFileWriter *writer;
+    PulseChecker checker;
+    shared_ptr<PVDataPipeline> pipeline;
+    /** Keeps updates that are polled in several threads in order */
+    epicsMutex polling;
+    size_t queue_size;
+    std::atomic<int> monitors;
+    /** Elements polled from the monitor but not released */
+    std::atomic<int> held;
+    /** Number of times that all elements of the monitor's queue were held */
+    std::atomic<uint64_t> exhausted;
     uint64 updates;
     uint64 overruns;
-    uint64 last_pulse_id;
-    uint64 missing_pulses;
-    uint64 array_size_differences;
 
-    void checkUpdate(shared_ptr<PVStructure> const &structure);
 public:
-    MyMonitorRequester(int limit, bool quiet)
+    /** @param queue_size queueSize of the monitor */
+    MyMonitorRequester(int limit, bool quiet, EventFileWriter *writer, size_t threads, size_t queue_size)
     : MyRequester("MyMonitorRequester"),
       limit(limit), quiet(quiet),
       next_run(epicsTime::getCurrent()),
-      user_tag_offset(-1), tof_offset(-1), pixel_offset(-1),
-      monitors(0), updates(0), overruns(0), last_pulse_id(0), missing_pulses(0), array_size_differences(0)
-    {}
+      user_tag_offset(-1), seconds_offset(-1), nanoseconds_offset(-1), charge_offset(-1),
+      tof_offset(-1), pixel_offset(-1), events_offset(-1), encoded_offset(-1),
+      batch_id_offset(-1), batch_charge_offset(-1), batch_offset_offset(-1), writer(writer),
+      checker(writer), queue_size(queue_size), monitors(0), held(0), exhausted(0), updates(0), overruns(0)
+    {
+        if (threads > 0)
+        {
+            pipeline.reset(new PVDataPipeline(*this, threads, queue_size));
+            pipeline->start();
+        }
+    }
 
     void monitorConnect(Status const & status, MonitorPtr const & monitor, StructureConstPtr const & structure);
     void monitorEvent(MonitorPtr const & monitor);
     void unlisten(MonitorPtr const & monitor);
 
-    boolean waitUntilDone()
+    /** Decode an update, may be called by several threads in parallel.
+     *  Problems are noted in the pulse's message, shown when it is handled
+     */
+    void decodeUpdate(shared_ptr<PVStructure> const &structure, DecodedPulse &pulse);
+
+    /** Check and show an update, called in the order received */
+    void handleUpdate(shared_ptr<MonitorElement> const &update, const DecodedPulse &pulse);
+
+    /** Return a handled update to the monitor */
+    void release(MonitorPtr const & monitor, shared_ptr<MonitorElement> const &update)
+    {
+        // Count before release(), which may call monitorEvent()
+        --held;
+        monitor->release(update);
+    }
+
+    boolean waitUntilDone(double timeout)
     {
-        return done_event.wait();
+        return done_event.wait(timeout);
+    }
+
+    /** Handle remaining updates, stop analysis threads */
+    void shutdown()
+    {
+        if (pipeline)
+            pipeline->shutdown();
     }
 };
 
+void PVDataPipeline::analyze(PVDataUpdate &update)
+{
+    requester.decodeUpdate(update.element->pvStructurePtr, update.pulse);
+}
+
+void PVDataPipeline::complete(PVDataUpdate &update)
+{
+    requester.handleUpdate(update.element, update.pulse);
+}
+
+void PVDataPipeline::release(PVDataUpdate &update)
+{
+    requester.release(update.monitor, update.element);
+}
+
 void MyMonitorRequester::monitorConnect(Status const & status, MonitorPtr const & monitor, StructureConstPtr const & structure)
 {
     cout << "Monitor connects, " << status << endl;
@@ -206,21 +504,55 @@ void MyMonitorRequester::monitorConnect(Status const & status, MonitorPtr const
         }
         user_tag_offset = user_tag->getFieldOffset();
 
-        shared_ptr<PVUIntArray> tof = pvStructure->getSubField<PVUIntArray>("time_of_flight.value");
-        if (! tof)
+        shared_ptr<PVLong> seconds = pvStructure->getSubField<PVLong>("timeStamp.secondsPastEpoch");
+        shared_ptr<PVInt> nanoseconds = pvStructure->getSubField<PVInt>("timeStamp.nanoseconds");
+        if (seconds  &&  nanoseconds)
         {
-            cout << "No 'time_of_flight'" << endl;
-            return;
+            seconds_offset = seconds->getFieldOffset();
+            nanoseconds_offset = nanoseconds->getFieldOffset();
         }
-        tof_offset = tof->getFieldOffset();
 
-        shared_ptr<PVUIntArray> pixel = pvStructure->getSubField<PVUIntArray>("pixel.value");
-        if (! pixel)
+        // Optional, only used when recording
+        shared_ptr<PVDouble> charge = pvStructure->getSubField<PVDouble>("proton_charge.value");
+        if (charge)
+            charge_offset = charge->getFieldOffset();
+
+        // Several pulses batched into each update?
+        shared_ptr<PVULongArray> batch_ids = pvStructure->getSubField<PVULongArray>("pulse_id.value");
+        shared_ptr<PVDoubleArray> batch_charges = pvStructure->getSubField<PVDoubleArray>("pulse_charge.value");
+        shared_ptr<PVUIntArray> batch_offsets = pvStructure->getSubField<PVUIntArray>("pulse_offset.value");
+        if (batch_ids  &&  batch_charges  &&  batch_offsets)
         {
-            cout << "No 'pixel'" << endl;
-            return;
+            batch_id_offset = batch_ids->getFieldOffset();
+            batch_charge_offset = batch_charges->getFieldOffset();
+            batch_offset_offset = batch_offsets->getFieldOffset();
+        }
+
+        // Compressed events, packed layout, or separate tof and pixel?
+        shared_ptr<PVUIntArray> encoded = pvStructure->getSubField<PVUIntArray>("encoded_events.value");
+        shared_ptr<PVULongArray> events = pvStructure->getSubField<PVULongArray>("events.value");
+        if (encoded)
+            encoded_offset = encoded->getFieldOffset();
+        else if (events)
+            events_offset = events->getFieldOffset();
+        else
+        {
+            shared_ptr<PVUIntArray> tof = pvStructure->getSubField<PVUIntArray>("time_of_flight.value");
+            if (! tof)
+            {
+                cout << "No 'time_of_flight'" << endl;
+                return;
+            }
+            tof_offset = tof->getFieldOffset();
+
+            shared_ptr<PVUIntArray> pixel = pvStructure->getSubField<PVUIntArray>("pixel.value");
+            if (! pixel)
+            {
+                cout << "No 'pixel'" << endl;
+                return;
+            }
+            pixel_offset = pixel->getFieldOffset();
         }
-        pixel_offset = pixel->getFieldOffset();
 
         // pvStructure is disposed; keep value_offset to read data from monitor's pvStructure
 
@@ -230,64 +562,82 @@ void MyMonitorRequester::monitorConnect(Status const & status, MonitorPtr const
 
 void MyMonitorRequester::monitorEvent(MonitorPtr const & monitor)
 {
+    // With analysis threads, pvAccess may call this from release() on an analysis thread
+    // while its own thread is also in here. Poll and push under one lock to keep updates in order.
+    // Without analysis threads, release() may call this recursively on the same thread.
+    epicsGuard<epicsMutex> guard(polling);
     shared_ptr<MonitorElement> update;
     while ((update = monitor->poll()))
     {
         // TODO Simulate slow client -> overruns on client side
         // epicsThreadSleep(0.1);
 
-        ++updates;
-        checkUpdate(update->pvStructurePtr);
-        // update->changedBitSet indicates which elements have changed.
-        // update->overrunBitSet indicates which elements have changed more than once,
-        // i.e. we missed one (or more !) updates.
-        if (! update->overrunBitSet->isEmpty())
-            ++overruns;
-        if (quiet)
-        {
-            epicsTime now(epicsTime::getCurrent());
-            if (now >= next_run)
-            {
-                double received_perc = 100.0 * updates / (updates + missing_pulses);
-                cout << updates << " updates, "
-                     << overruns << " overruns, "
-                     << missing_pulses << " missing pulses, "
-                     << array_size_differences << " array size differences, "
-                     << "received " << fixed << setprecision(1) << received_perc << "%"
-                     << endl;
-                overruns = 0;
-                missing_pulses = 0;
-                updates = 0;
-                array_size_differences = 0;
-
-#               ifdef TIME_IT
-                cout << "Time for value lookup: " << value_timer << endl;
-#               endif
-
-                next_run = now + 10.0;
-            }
+        ++held;
+        if (pipeline)
+        {   // Analysis threads decode, call handleUpdate() in order, then release
+            pipeline->push(PVDataUpdate(monitor, update));
+            continue;
         }
-        else
+        DecodedPulse pulse;
+        decodeUpdate(update->pvStructurePtr, pulse);
+        handleUpdate(update, pulse);
+        release(monitor, update);
+    }
+    // Server can only mark overruns until updates are released
+    if (held.load() >= int(queue_size))
+        ++exhausted;
+    int received = ++monitors;
+    if (limit > 0  &&  received >= limit)
+    {
+    	cout << "Received " << received << " monitors" << endl;
+    	done_event.signal();
+    }
+}
+
+void MyMonitorRequester::handleUpdate(shared_ptr<MonitorElement> const &update, const DecodedPulse &pulse)
+{
+    ++updates;
+    checker.check(pulse);
+    // update->changedBitSet indicates which elements have changed.
+    // update->overrunBitSet indicates which elements have changed more than once,
+    // i.e. we missed one (or more !) updates.
+    if (! update->overrunBitSet->isEmpty())
+        ++overruns;
+    if (quiet)
+    {
+        epicsTime now(epicsTime::getCurrent());
+        if (now >= next_run)
         {
-            cout << "Monitor:\n";
+            cout << updates << " updates, "
+                 << overruns << " overruns, "
+                 << "queue of " << queue_size << " exhausted " << exhausted.exchange(0) << " times, ";
+            checker.show(cout);
+            if (pipeline)
+                showHighWater(cout, *pipeline);
+            cout << endl;
+            overruns = 0;
+            updates = 0;
 
-            cout << "Changed: " << *update->changedBitSet.get() << endl;
-            cout << "Overrun: " << *update->overrunBitSet.get() << endl;
+#           ifdef TIME_IT
+            cout << "Time for value lookup: " << value_timer << endl;
+#           endif
 
-            update->pvStructurePtr->dumpValue(cout);
-            cout << endl;
+            next_run = now + 10.0;
         }
-        monitor->release(update);
     }
-    ++ monitors;
-    if (limit > 0  &&  monitors >= limit)
+    else
     {
-    	cout << "Received " << monitors << " monitors" << endl;
-    	done_event.signal();
+        cout << "Monitor:\n";
+
+        cout << "Changed: " << *update->changedBitSet.get() << endl;
+        cout << "Overrun: " << *update->overrunBitSet.get() << endl;
+
+        update->pvStructurePtr->dumpValue(cout);
+        cout << endl;
     }
 }
 
-void MyMonitorRequester::checkUpdate(shared_ptr<PVStructure> const &pvStructure)
+void MyMonitorRequester::decodeUpdate(shared_ptr<PVStructure> const &pvStructure, DecodedPulse &pulse)
 {
 #   ifdef TIME_IT
     value_timer.start();
@@ -300,7 +650,7 @@ void MyMonitorRequester::checkUpdate(shared_ptr<PVStructure> const &pvStructure)
     // shared_ptr<PVInt> value = pvStructure->getIntField("timeStamp.userTag");
     if (! value)
     {
-        cout << "No 'timeStamp.userTag'" << endl;
+        pulse.message = "No 'timeStamp.userTag'";
         return;
     }
 
@@ -308,47 +658,142 @@ void MyMonitorRequester::checkUpdate(shared_ptr<PVStructure> const &pvStructure)
     value_timer.stop();
 #   endif
 
-    // Check pulse ID for skipped updates
+    // Pulse ID, checked for skipped updates by the PulseChecker.
+    // Batched updates list the ID of each pulse
     uint64 pulse_id = static_cast<uint64>(value->get());
-    if (last_pulse_id != 0)
+    pulse.header.pulse_id = pulse_id;
+    if (batch_id_offset != size_t(-1))
     {
-        int missing = pulse_id - 1 - last_pulse_id;
-        if (missing > 0)
-            missing_pulses += missing;
+        shared_ptr<PVULongArray> ids = dynamic_pointer_cast<PVULongArray>(pvStructure->getSubField(batch_id_offset));
+        shared_ptr<PVDoubleArray> charges = dynamic_pointer_cast<PVDoubleArray>(pvStructure->getSubField(batch_charge_offset));
+        shared_ptr<PVUIntArray> offsets = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(batch_offset_offset));
+        if (ids  &&  charges  &&  offsets)
+        {
+            shared_vector<const uint64> batch_ids = ids->view();
+            shared_vector<const double> batch_charges = charges->view();
+            shared_vector<const uint32> batch_offsets = offsets->view();
+            pulse.batch_ids.assign(batch_ids.begin(), batch_ids.end());
+            pulse.batch_charges.assign(batch_charges.begin(), batch_charges.end());
+            pulse.batch_offsets.assign(batch_offsets.begin(), batch_offsets.end());
+        }
+        if (pulse.batch_charges.size() != pulse.batch_ids.size()  ||  pulse.batch_offsets.size() != pulse.batch_ids.size())
+        {
+            pulse.message = "Pulse " + to_string(pulse_id) + ": Per-pulse arrays differ in size";
+            return;
+        }
     }
-    last_pulse_id = pulse_id;
+    pulse.has_id = true;
 
-    // Compare lengths of tof and pixel arrays
-    shared_ptr<PVUIntArray> tof = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(tof_offset));
-    if (!tof)
-    {
-        cout << "No 'time_of_flight' array" << endl;
-        return;
+    if (encoded_offset != size_t(-1))
+    {   // Decode compressed events
+        shared_ptr<PVUIntArray> encoded = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(encoded_offset));
+        if (!encoded)
+        {
+            pulse.message = "No 'encoded_events' array";
+            return;
+        }
+        shared_vector<const uint32> encoded_data = encoded->view();
+        uint64_t start = NanoTimer::getCurrentNanosecs();
+        try
+        {
+            EventDecoder decoder;
+            pulse.count = EventDecoder::getEventCount(encoded_data.data(), encoded_data.size());
+            shared_ptr<uint32_t> tof_decoded(new uint32_t[pulse.count], default_delete<uint32_t[]>());
+            shared_ptr<uint32_t> pixel_decoded(new uint32_t[pulse.count], default_delete<uint32_t[]>());
+            decoder.decode(encoded_data.data(), encoded_data.size(), tof_decoded.get(), pixel_decoded.get());
+            pulse.tof_data = tof_decoded;
+            pulse.pixel_data = pixel_decoded;
+        }
+        catch (std::exception &ex)
+        {
+            pulse.message = "Pulse " + to_string(pulse_id) + ": " + ex.what();
+            return;
+        }
+        pulse.decode_ns = NanoTimer::getCurrentNanosecs() - start;
+        pulse.encoded_bytes = encoded_data.size() * sizeof(uint32);
     }
-
-    shared_ptr<PVUIntArray> pixel = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(pixel_offset));
-    if (!pixel)
+    else if (events_offset != size_t(-1))
+    {   // Decode packed events into tof and pixel
+        shared_ptr<PVULongArray> events = dynamic_pointer_cast<PVULongArray>(pvStructure->getSubField(events_offset));
+        if (!events)
+        {
+            pulse.message = "No 'events' array";
+            return;
+        }
+        shared_vector<const uint64> event_data = events->view();
+        pulse.count = event_data.size();
+        shared_ptr<uint32_t> tof_decoded(new uint32_t[pulse.count], default_delete<uint32_t[]>());
+        shared_ptr<uint32_t> pixel_decoded(new uint32_t[pulse.count], default_delete<uint32_t[]>());
+        unpackEvents(event_data.data(), pulse.count, tof_decoded.get(), pixel_decoded.get());
+        pulse.tof_data = tof_decoded;
+        pulse.pixel_data = pixel_decoded;
+    }
+    else
     {
-        cout << "No 'pixel' array" << endl;
-        return;
+        // Compare lengths of tof and pixel arrays
+        shared_ptr<PVUIntArray> tof = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(tof_offset));
+        if (!tof)
+        {
+            pulse.message = "No 'time_of_flight' array";
+            return;
+        }
+
+        shared_ptr<PVUIntArray> pixel = dynamic_pointer_cast<PVUIntArray>(pvStructure->getSubField(pixel_offset));
+        if (!pixel)
+        {
+            pulse.message = "No 'pixel' array";
+            return;
+        }
+
+        if (tof->getLength() != pixel->getLength())
+        {
+            pulse.size_difference = true;
+            if (! quiet)
+            {
+                ostringstream out;
+                out << "time_of_flight: " << tof->getLength() << " elements" << endl;
+                shared_vector<const uint32> tof_values;
+                tof->getAs(tof_values);
+                out << tof_values << endl;
+
+                out << "pixel: " << pixel->getLength() << " elements" << endl;
+                shared_vector<const uint32> pixel_values;
+                pixel->getAs(pixel_values);
+                out << pixel_values;
+                pulse.message = out.str();
+            }
+            return;
+        }
+
+        // Writer keeps a reference to the received arrays, no copy
+        shared_vector<const uint32> tof_view = tof->view();
+        shared_vector<const uint32> pixel_view = pixel->view();
+        pulse.count = tof_view.size();
+        pulse.tof_data = shared_ptr<const uint32_t>(tof_view.dataPtr(), tof_view.data());
+        pulse.pixel_data = shared_ptr<const uint32_t>(pixel_view.dataPtr(), pixel_view.data());
     }
 
-    if (tof->getLength() != pixel->getLength())
+    // Optional, only used when recording
+    if (writer)
     {
-        ++array_size_differences;
-        if (! quiet)
+        if (seconds_offset != size_t(-1))
         {
-            cout << "time_of_flight: " << tof->getLength() << " elements" << endl;
-            shared_vector<const uint32> tof_data;
-            tof->getAs(tof_data);
-            cout << tof_data << endl;
-
-            cout << "pixel: " << pixel->getLength() << " elements" << endl;
-            shared_vector<const uint32> pixel_data;
-            pixel->getAs(pixel_data);
-            cout << pixel_data << endl;
+            shared_ptr<PVLong> seconds = dynamic_pointer_cast<PVLong>(pvStructure->getSubField(seconds_offset));
+            shared_ptr<PVInt> nanoseconds = dynamic_pointer_cast<PVInt>(pvStructure->getSubField(nanoseconds_offset));
+            if (seconds  &&  nanoseconds)
+            {
+                pulse.header.seconds = seconds->get();
+                pulse.header.nanoseconds = nanoseconds->get();
+            }
+        }
+        if (charge_offset != size_t(-1))
+        {
+            shared_ptr<PVDouble> charge = dynamic_pointer_cast<PVDouble>(pvStructure->getSubField(charge_offset));
+            if (charge)
+                pulse.header.proton_charge = charge->get();
         }
     }
+    pulse.has_events = true;
 }
 
 void MyMonitorRequester::unlisten(MonitorPtr const & monitor)
@@ -384,8 +829,17 @@ void getValue(string const &name, string const &request, double timeout)
     channelGetRequester->waitUntilDone(timeout);
 }
 
+/** Set by SIGINT, checked while monitoring */
+static volatile sig_atomic_t interrupted = 0;
+
+static void handleSigInt(int)
+{
+    interrupted = 1;
+}
+
 /** Monitor values */
-void doMonitor(string const &name, string const &request, double timeout, short priority, int limit, bool quiet)
+void doMonitor(string const &name, string const &request, double timeout, short priority, int limit, bool quiet,
+               EventFileWriter *writer, size_t threads)
 {
     ChannelProvider::shared_pointer channelProvider =
             ChannelProviderRegistry::clients()->getProvider("pva");
@@ -398,112 +852,273 @@ void doMonitor(string const &name, string const &request, double timeout, short
     channelRequester->waitUntilConnected(timeout);
 
     shared_ptr<PVStructure> pvRequest = CreateRequest::create()->createRequest(request);
-    shared_ptr<MyMonitorRequester> monitorRequester(new MyMonitorRequester(limit, quiet));
+    shared_ptr<MyMonitorRequester> monitorRequester(new MyMonitorRequester(limit, quiet, writer, threads,
+                                                                           getQueueSize(request, PVA_QUEUE_SIZE)));
 
     shared_ptr<Monitor> monitor = channel->createMonitor(monitorRequester, pvRequest);
 
-    // Wait until limit or forever..
-    monitorRequester->waitUntilDone();
+    // Wait until limit or forever, or Ctrl-C.
+    // On Ctrl-C, shut down so that the EventFileWriter closes the file
+    interrupted = 0;
+    void (*previous)(int) = signal(SIGINT, handleSigInt);
+    while (! interrupted  &&  ! monitorRequester->waitUntilDone(0.5))
+        ;
+    signal(SIGINT, previous);
 
     // What to do for graceful shutdown of monitor?
     Status stat = monitor->stop();
     if (! stat.isSuccess())
     	cout << "Cannot stop monitor, " << stat << endl;
+    monitorRequester->shutdown();
     monitor->destroy();
     channel->destroy();
 }
 
 #ifdef USE_PVXS
-void checkUpdate(pvxs::Value &update, bool quiet)
+/** Decode PVXS update, may be called by several threads in parallel.
+ *  Problems are noted in the pulse's message, shown when it is handled
+ */
+static void decodeUpdate(const pvxs::Value &update, bool quiet, bool recording, DecodedPulse &pulse)
 {
-    static uint64 last_pulse_id;
-    static uint64 missing_pulses;
-    static uint64 array_size_differences;
-
-#   ifdef TIME_IT
-    value_timer.start();
-#   endif
-
-    // Compare: Time for value lookup when using name: 12us
-    // shared_ptr<PVInt> value = pvStructure->getIntField("timeStamp.userTag");
     if (!update.valid())
     {
-        cout << "Not valid update" << endl;
+        pulse.message = "Not valid update";
         return;
     }
 
-#   ifdef TIME_IT
-    value_timer.stop();
-#   endif
-
-    // Check pulse ID for skipped updates
+    // Pulse ID, checked for skipped updates by the PulseChecker
     uint64 pulse_id;
     try {
         pulse_id = update["timeStamp.userTag"].as<uint32_t>();
     } catch (...) {
-        cout << "No 'timeStamp' field" << endl;
+        pulse.message = "No 'timeStamp' field";
         return;
     }
+    pulse.header.pulse_id = pulse_id;
 
-    if (last_pulse_id != 0)
+    // Batched updates list the ID of each pulse
+    pvxs::Value batch_id_value = update["pulse_id.value"];
+    if (batch_id_value.valid())
     {
-        int missing = pulse_id - 1 - last_pulse_id;
-        if (missing > 0)
-            missing_pulses += missing;
+        auto batch_ids = batch_id_value.as<pvxs::shared_array<const uint64_t>>();
+        auto batch_charges = update["pulse_charge.value"].as<pvxs::shared_array<const double>>();
+        auto batch_offsets = update["pulse_offset.value"].as<pvxs::shared_array<const uint32_t>>();
+        if (batch_charges.size() != batch_ids.size()  ||  batch_offsets.size() != batch_ids.size())
+        {
+            pulse.message = "Pulse " + to_string(pulse_id) + ": Per-pulse arrays differ in size";
+            return;
+        }
+        pulse.batch_ids.assign(batch_ids.begin(), batch_ids.end());
+        pulse.batch_charges.assign(batch_charges.begin(), batch_charges.end());
+        pulse.batch_offsets.assign(batch_offsets.begin(), batch_offsets.end());
     }
-    last_pulse_id = pulse_id;
+    pulse.has_id = true;
 
-    // Compare lengths of tof and pixel arrays
+    // Packed layout: Decode events into tof and pixel
     pvxs::shared_array<const uint32_t> tof;
-    try {
-        tof = update["time_of_flight.value"].as<pvxs::shared_array<const uint32_t>>();
-    } catch (...) {
-        cout << "No 'time_of_flight' array" << endl;
-        return;
+    pvxs::shared_array<const uint32_t> pixel;
+    pvxs::Value encoded = update["encoded_events.value"];
+    pvxs::Value events = update["events.value"];
+    if (encoded.valid())
+    {   // Decode compressed events
+        auto encoded_data = encoded.as<pvxs::shared_array<const uint32_t>>();
+        uint64_t start = NanoTimer::getCurrentNanosecs();
+        try
+        {
+            EventDecoder decoder;
+            size_t count = EventDecoder::getEventCount(encoded_data.data(), encoded_data.size());
+            pvxs::shared_array<uint32_t> tof_decoded(count), pixel_decoded(count);
+            decoder.decode(encoded_data.data(), encoded_data.size(), tof_decoded.data(), pixel_decoded.data());
+            tof = tof_decoded.freeze();
+            pixel = pixel_decoded.freeze();
+        }
+        catch (std::exception &ex)
+        {
+            pulse.message = "Pulse " + to_string(pulse_id) + ": " + ex.what();
+            return;
+        }
+        pulse.decode_ns = NanoTimer::getCurrentNanosecs() - start;
+        pulse.encoded_bytes = encoded_data.size() * sizeof(uint32_t);
     }
+    else if (events.valid())
+    {
+        auto event_data = events.as<pvxs::shared_array<const uint64_t>>();
+        pvxs::shared_array<uint32_t> tof_decoded(event_data.size()), pixel_decoded(event_data.size());
+        unpackEvents(event_data.data(), event_data.size(), tof_decoded.data(), pixel_decoded.data());
+        tof = tof_decoded.freeze();
+        pixel = pixel_decoded.freeze();
+    }
+    else
+    {
+        // Compare lengths of tof and pixel arrays
+        try {
+            tof = update["time_of_flight.value"].as<pvxs::shared_array<const uint32_t>>();
+        } catch (...) {
+            pulse.message = "No 'time_of_flight' array";
+            return;
+        }
 
-    pvxs::shared_array<const uint32_t> pixel;
-    try {
-        pixel = update["pixel.value"].as<pvxs::shared_array<const uint32_t>>();
-    } catch (...) {
-        cout << "No 'pixel' array" << endl;
-        return;
+        try {
+            pixel = update["pixel.value"].as<pvxs::shared_array<const uint32_t>>();
+        } catch (...) {
+            pulse.message = "No 'pixel' array";
+            return;
+        }
+
+        if (tof.size() != pixel.size())
+        {
+            pulse.size_difference = true;
+            if (! quiet)
+            {
+                // shared_array like std::vector can't be printed directly.
+                // Need to iterate and print individual elements.
+
+                ostringstream out;
+                out << "time_of_flight: " << tof.size() << " elements" << endl;
+                for (auto& v: tof) {
+                    out << v << " ";
+                }
+                out << endl;
+
+                out << "pixel: " << pixel.size() << " elements" << endl;
+                for (auto& v: pixel) {
+                    out << v << " ";
+                }
+                pulse.message = out.str();
+            }
+            return;
+        }
     }
 
-    if (tof.size() != pixel.size())
+    // Writer keeps a reference to the received arrays, no copy
+    pulse.count = tof.size();
+    pulse.tof_data = tof.dataPtr();
+    pulse.pixel_data = pixel.dataPtr();
+    if (recording)
     {
-        ++array_size_differences;
-        if (! quiet)
+        update["timeStamp.secondsPastEpoch"].as(pulse.header.seconds);
+        update["timeStamp.nanoseconds"].as(pulse.header.nanoseconds);
+        update["proton_charge.value"].as(pulse.header.proton_charge);
+    }
+    pulse.has_events = true;
+}
+
+class PVXSMonitor;
+
+/** PVXS update handed to analysis threads */
+struct PVXSUpdate
+{
+    pvxs::Value value;
+    DecodedPulse pulse;
+};
+
+/** Pipeline for a PVXS subscription
+ *
+ *  Sized to the subscription's queueSize,
+ *  so updates then back up in the PVXS queue.
+ */
+class PVXSPipeline : public AnalysisPipeline<PVXSUpdate>
+{
+    PVXSMonitor &monitor;
+public:
+    PVXSPipeline(PVXSMonitor &monitor, size_t threads, size_t queue_size)
+    : AnalysisPipeline<PVXSUpdate>(threads, queue_size), monitor(monitor)
+    {}
+
+protected:
+    void analyze(PVXSUpdate &update);
+    void complete(PVXSUpdate &update);
+};
+
+/** Handles PVXS updates, inline or via analysis threads */
+class PVXSMonitor
+{
+public:
+    /** @param queue_size queueSize of the subscription */
+    PVXSMonitor(bool quiet, EventFileWriter *writer, size_t threads, size_t queue_size)
+    : quiet(quiet), writer(writer), checker(writer), next_run(epicsTime::getCurrent())
+    {
+        if (threads > 0)
         {
-            // shared_array like std::vector can't be printed directly.
-            // Need to iterate and print individual elements.
+            pipeline.reset(new PVXSPipeline(*this, threads, queue_size));
+            pipeline->start();
+        }
+    }
 
-            cout << "time_of_flight: " << tof.size() << " elements" << endl;
-            for (auto& v: tof) {
-                cout << v << " ";
-            }
-            cout << endl;
+    /** Called by the subscription callback for each update */
+    void receive(const pvxs::Value &update)
+    {
+        if (pipeline)
+        {
+            PVXSUpdate item;
+            item.value = update;
+            pipeline->push(item);
+            return;
+        }
+        DecodedPulse pulse;
+        decode(update, pulse);
+        handle(pulse);
+    }
 
-            cout << "pixel: " << pixel.size() << " elements" << endl;
-            for (auto& v: pixel) {
-                cout << v << " ";
-            }
+    void decode(const pvxs::Value &update, DecodedPulse &pulse)
+    {
+        decodeUpdate(update, quiet, writer != 0, pulse);
+    }
+
+    /** Check an update, called in the order received */
+    void handle(const DecodedPulse &pulse)
+    {
+        checker.check(pulse);
+        epicsTime now(epicsTime::getCurrent());
+        if (quiet  &&  (writer  ||  checker.isDecoding()  ||  pipeline)  &&  now >= next_run)
+        {
+            checker.show(cout);
+            if (pipeline)
+                showHighWater(cout, *pipeline);
             cout << endl;
+            next_run = now + 10.0;
         }
     }
+
+    /** Handle remaining updates, stop analysis threads */
+    void shutdown()
+    {
+        if (pipeline)
+            pipeline->shutdown();
+    }
+
+private:
+    bool quiet;
+    EventFileWriter *writer;
+    PulseChecker checker;
+    epicsTime next_run;
+    shared_ptr<PVXSPipeline> pipeline;
+};
+
+void PVXSPipeline::analyze(PVXSUpdate &update)
+{
+    monitor.decode(update.value, update.pulse);
 }
-void doMonitorPvxs(string const &name, string const &request, double timeout, short priority, int limit, bool quiet)
+
+void PVXSPipeline::complete(PVXSUpdate &update)
+{
+    monitor.handle(update.pulse);
+}
+
+void doMonitorPvxs(string const &name, string const &request, double timeout, short priority, int limit, bool quiet,
+                   EventFileWriter *writer, size_t threads)
 {
     auto ctxt = pvxs::client::Config::from_env().build();
+    PVXSMonitor handler(quiet, writer, threads, getQueueSize(request, PVXS_QUEUE_SIZE));
     epicsEvent done;
     auto op = ctxt.monitor(name)
                   .pvRequest(request)
-                  .event([&done, &limit, quiet](pvxs::client::Subscription& mon)
+                  .event([&done, &limit, &handler](pvxs::client::Subscription& mon)
     {
 
         try {
             while(auto update = mon.pop()) {
-                checkUpdate(update, quiet);
+                handler.receive(update);
                 if (limit > 0 && --limit == 0) {
                     done.signal();
                     break;
@@ -530,7 +1145,8 @@ void doMonitorPvxs(string const &name, string const &request, double timeout, sh
     });
 
     done.wait();
-
+    op.reset();
+    handler.shutdown();
 }
 void getValuePvxs(string const &name, string const &request, double timeout)
 {
@@ -553,6 +1169,8 @@ static void help(const char *name)
     cout << "  -w seconds : Wait timeout" << endl;
     cout << "  -p priority: Priority, 0..99, default 0" << endl;
     cout << "  -l monitors: Limit runtime to given number of monitors, then quit" << endl;
+    cout << "  -o file    : Record monitored events to file" << endl;
+    cout << "  -t threads : Decode monitored updates in analysis threads, default 0 for none" << endl;
 }
 
 int main(int argc,char *argv[])
@@ -564,9 +1182,11 @@ int main(int argc,char *argv[])
     bool quiet = false;
     short priority = ChannelProvider::PRIORITY_DEFAULT;
     int limit = 0;
+    string filename;
+    size_t threads = 0;
 
     int opt;
-    while ((opt = getopt(argc, argv, "r:w:p:l:mqh")) != -1)
+    while ((opt = getopt(argc, argv, "r:w:p:l:o:t:mqh")) != -1)
     {
         switch (opt)
         {
@@ -582,6 +1202,13 @@ int main(int argc,char *argv[])
         case 'l':
         	limit = atoi(optarg);
             break;
+        case 'o':
+            filename = optarg;
+            monitor = true;
+            break;
+        case 't':
+            threads = (size_t)atol(optarg);
+            break;
         case 'm':
             monitor = true;
             break;
@@ -604,18 +1231,25 @@ int main(int argc,char *argv[])
     cout << "Wait:     " << timeout << " sec" << endl;
     cout << "Priority: " << priority << endl;
     cout << "Limit: " << limit << endl;
+    if (! filename.empty())
+        cout << "Record:   " << filename << endl;
+    if (threads > 0)
+        cout << "Analysis: " << threads << " threads" << endl;
 
     try
     {
+        shared_ptr<EventFileWriter> writer;
+        if (! filename.empty())
+            writer.reset(new EventFileWriter(filename));
 #ifdef USE_PVXS
         if (monitor)
-            doMonitorPvxs(channel, request, timeout, priority, limit, quiet);
+            doMonitorPvxs(channel, request, timeout, priority, limit, quiet, writer.get(), threads);
         else
             getValuePvxs(channel, request, timeout);
 #else
         ClientFactory::start();
         if (monitor)
-            doMonitor(channel, request, timeout, priority, limit, quiet);
+            doMonitor(channel, request, timeout, priority, limit, quiet, writer.get(), threads);
         else
             getValue(channel, request, timeout);
         ClientFactory::stop();
@@ -0,0 +1,172 @@
+/* neutronPVRecord.cpp
+ *
+ * Copyright (c) 2014 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Based on MRK pvDataBaseCPP exampleServer
+ *
+ * @author Kay Kasemir
+ */
+#include <pv/standardPVField.h>
+#include <neutronPVRecord.h>
+
+using namespace epics::pvData;
+using namespace epics::pvDatabase;
+using namespace std;
+
+namespace epics { namespace neutronServer {
+
+NeutronPVRecord::shared_pointer NeutronPVRecord::create(string const & recordName, bool packed, bool batched)
+{
+    FieldCreatePtr fieldCreate = getFieldCreate();
+    StandardFieldPtr standardField = getStandardField();
+    PVDataCreatePtr pvDataCreate = getPVDataCreate();
+
+    // Create the data structure that the PVRecord should use
+    FieldBuilderPtr builder = fieldCreate->createFieldBuilder()
+        ->add("timeStamp", standardField->timeStamp())
+        // Demo for manual setup of structure, could use
+        // add("proton_charge", standardField->scalar(pvDouble, ""))
+        ->addNestedStructure("proton_charge")
+            ->setId("epics:nt/NTScalar:1.0")
+            ->add("value", pvDouble)
+        ->endNested();
+    if (packed)
+        builder->add("events", standardField->scalarArray(pvULong, ""));
+    else
+        builder->add("time_of_flight", standardField->scalarArray(pvUInt, ""))
+               ->add("pixel", standardField->scalarArray(pvUInt, ""));
+    if (batched)
+        builder->add("pulse_id", standardField->scalarArray(pvULong, ""))
+               ->add("pulse_charge", standardField->scalarArray(pvDouble, ""))
+               ->add("pulse_offset", standardField->scalarArray(pvUInt, ""));
+    PVStructurePtr pvStructure = pvDataCreate->createPVStructure(builder->createStructure());
+
+    NeutronPVRecord::shared_pointer pvRecord(new NeutronPVRecord(recordName, pvStructure));
+    if (!pvRecord->init())
+        pvRecord.reset();
+    return pvRecord;
+}
+
+NeutronPVRecord::NeutronPVRecord(string const & recordName, PVStructurePtr const & pvStructure)
+: PVRecord(recordName,pvStructure), pulse_id(0)
+{
+}
+
+bool NeutronPVRecord::init()
+{
+    initPVRecord();
+
+    // Fetch pointers into the records pvData which will be used to update the values
+    if (!pvTimeStamp.attach(getPVStructure()->getSubField("timeStamp")))
+        return false;
+
+    pvProtonCharge = getPVStructure()->getSubField<PVDouble>("proton_charge.value");
+    if (pvProtonCharge.get() == NULL)
+        return false;
+
+    // Batched? Optional
+    pvPulseID = getPVStructure()->getSubField<PVULongArray>("pulse_id.value");
+    pvPulseCharge = getPVStructure()->getSubField<PVDoubleArray>("pulse_charge.value");
+    pvPulseOffset = getPVStructure()->getSubField<PVUIntArray>("pulse_offset.value");
+
+    // Packed layout?
+    pvEvents = getPVStructure()->getSubField<PVULongArray>("events.value");
+    if (pvEvents)
+        return true;
+
+    pvTimeOfFlight = getPVStructure()->getSubField<PVUIntArray>("time_of_flight.value");
+    if (pvTimeOfFlight.get() == NULL)
+        return false;
+
+    pvPixel = getPVStructure()->getSubField<PVUIntArray>("pixel.value");
+    if (pvPixel.get() == NULL)
+        return false;
+
+    return true;
+}
+
+void NeutronPVRecord::process()
+{
+    // Update timestamp
+    timeStamp.getCurrent();
+    // pulse_id is unsigned, put into userTag as signed?
+    timeStamp.setUserTag(static_cast<int>(pulse_id));
+    pvTimeStamp.set(timeStamp);
+}
+
+void NeutronPVRecord::updateBatch(const BatchInfo *batch)
+{
+    if (! batch  ||  ! pvPulseID  ||  ! pvPulseCharge  ||  ! pvPulseOffset)
+        return;
+    pvPulseID->replace(batch->ids);
+    pvPulseCharge->replace(batch->charges);
+    pvPulseOffset->replace(batch->offsets);
+}
+
+void NeutronPVRecord::updateTimeStamp(const TimeStamp *stamp)
+{
+    if (! stamp)
+        return;
+    // Replace the current time set by process()
+    timeStamp.put(stamp->getSecondsPastEpoch(), stamp->getNanoseconds());
+    pvTimeStamp.set(timeStamp);
+}
+
+void NeutronPVRecord::update(uint64 id, double charge,
+                             shared_vector<const uint32> tof,
+                             shared_vector<const uint32> pixel,
+                             const BatchInfo *batch, const TimeStamp *stamp)
+{
+    lock();
+    try
+    {
+        beginGroupPut();
+        pulse_id = id;
+        pvProtonCharge->put(charge);
+        pvTimeOfFlight->replace(tof);
+        pvPixel->replace(pixel);
+        updateBatch(batch);
+
+        // TODO Create server-side overrun by updating same field
+        // multiple times within one 'group put'
+        // pvPulseID->put(id);
+
+        process();
+        updateTimeStamp(stamp);
+        endGroupPut();
+    }
+    catch(...)
+    {
+        unlock();
+        throw;
+    }
+    unlock();
+}
+
+void NeutronPVRecord::update(uint64 id, double charge,
+                             shared_vector<const uint64> events,
+                             const BatchInfo *batch, const TimeStamp *stamp)
+{
+    lock();
+    try
+    {
+        beginGroupPut();
+        pulse_id = id;
+        pvProtonCharge->put(charge);
+        pvEvents->replace(events);
+        updateBatch(batch);
+        process();
+        updateTimeStamp(stamp);
+        endGroupPut();
+    }
+    catch(...)
+    {
+        unlock();
+        throw;
+    }
+    unlock();
+}
+
+}} // namespace neutronServer, epics
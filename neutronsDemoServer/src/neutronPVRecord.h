@@ -0,0 +1,111 @@
+/* neutronPVRecord.h
+ *
+ * Copyright (c) 2014 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Based on MRK pvDataBaseCPP exampleServer
+ *
+ * @author Kay Kasemir
+ */
+#ifndef __NEUTRON_PV_RECORD_H__
+#define __NEUTRON_PV_RECORD_H__
+
+#include <string>
+#include <pv/pvDatabase.h>
+#include <pv/timeStamp.h>
+#include <pv/pvTimeStamp.h>
+
+namespace epics { namespace neutronServer {
+
+/** Record that serves this type of pvData:
+ *
+ *  structure
+ *      // Time stamp for everything in this structure,
+ *      // userTag is sequential number to check for missed
+ *      // updates
+ *      time_t  timeStamp
+ *      NTScalar proton_charge
+ *          double  value
+ *      NTScalarArray time_of_flight
+ *          uint[]  value
+ *      NTScalarArray pixel
+ *          uint[]  value
+ *
+ *  In the 'packed' layout, time_of_flight and pixel are replaced by
+ *
+ *      NTScalarArray events
+ *          ulong[] value  // pixel << 32 | time_of_flight, see packedEvents.h
+ *
+ *  When several pulses are batched into one update, the event arrays hold
+ *  the events of all pulses, userTag is the ID of the first pulse,
+ *  proton_charge is the sum of all pulses, and these arrays have one element per pulse:
+ *
+ *      NTScalarArray pulse_id
+ *          ulong[] value
+ *      NTScalarArray pulse_charge
+ *          double[] value
+ *      NTScalarArray pulse_offset
+ *          uint[]  value  // Index of the pulse's first event in the event arrays
+ */
+class NeutronPVRecord : public epics::pvDatabase::PVRecord
+{
+public:
+    POINTER_DEFINITIONS(NeutronPVRecord);
+
+    /** Per-pulse arrays of an update that batches several pulses */
+    struct BatchInfo
+    {
+        epics::pvData::shared_vector<const epics::pvData::uint64> ids;
+        epics::pvData::shared_vector<const double> charges;
+        epics::pvData::shared_vector<const epics::pvData::uint32> offsets;
+    };
+
+    // PVRecord methods
+    /** @param recordName Name of the record
+     *  @param packed Use packed 'events' instead of 'time_of_flight' and 'pixel'?
+     *  @param batched Add per-pulse arrays for batched updates?
+     */
+    static NeutronPVRecord::shared_pointer create(std::string const & recordName, bool packed = false,
+                                                  bool batched = false);
+    virtual bool init();
+    virtual void process();
+
+    /** Update the values of the record
+     *  @param batch Per-pulse arrays of a batched record, or NULL
+     *  @param stamp Time stamp of the pulse, NULL for the current time
+     */
+    void update(epics::pvData::uint64 id, double charge,
+                epics::pvData::shared_vector<const epics::pvData::uint32> tof,
+                epics::pvData::shared_vector<const epics::pvData::uint32> pixel,
+                const BatchInfo *batch = 0, const epics::pvData::TimeStamp *stamp = 0);
+
+    /** Update the values of a record with packed layout */
+    void update(epics::pvData::uint64 id, double charge,
+                epics::pvData::shared_vector<const epics::pvData::uint64> events,
+                const BatchInfo *batch = 0, const epics::pvData::TimeStamp *stamp = 0);
+
+private:
+    NeutronPVRecord(std::string const & recordName,
+                    epics::pvData::PVStructurePtr const & pvStructure);
+
+    // Time of last process() call
+    epics::pvData::TimeStamp      timeStamp;
+    epics::pvData::uint32         pulse_id;
+
+    // Pointers in to the records' data structure
+    epics::pvData::PVTimeStamp    pvTimeStamp;
+    epics::pvData::PVDoublePtr    pvProtonCharge;
+    epics::pvData::PVUIntArrayPtr pvTimeOfFlight;
+    epics::pvData::PVUIntArrayPtr pvPixel;
+    epics::pvData::PVULongArrayPtr pvEvents;
+    epics::pvData::PVULongArrayPtr pvPulseID;
+    epics::pvData::PVDoubleArrayPtr pvPulseCharge;
+    epics::pvData::PVUIntArrayPtr pvPulseOffset;
+
+    void updateBatch(const BatchInfo *batch);
+    void updateTimeStamp(const epics::pvData::TimeStamp *stamp);
+};
+
+}} // namespace neutronServer, epics
+#endif // __NEUTRON_PV_RECORD_H__
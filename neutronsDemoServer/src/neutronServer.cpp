@@ -10,10 +10,27 @@
  */
 #include <algorithm>
 #include <iostream>
+#include <deque>
+#include <sstream>
+#include <vector>
+#include <epicsGuard.h>
+#include <epicsMutex.h>
 #include <epicsTime.h>
 #include <workerRunnable.h>
+#include <arrayPool.h>
+#include <pulseScheduler.h>
+#include <latencyHistogram.h>
+#include <eventFile.h>
+#include <pixelSampler.h>
+#include <eventHistogram.h>
+#include <packedEvents.h>
+#include <eventCodec.h>
+#include <eventSort.h>
+#include <eventGenerator.h>
+#include <monitorDecimation.h>
 #include "neutronServer.h"
 #include "nanoTimer.h"
+#include "randomEngine.h"
 
 #ifdef USE_PVXS
 #    include <pvxs/sharedpv.h>
@@ -30,104 +47,396 @@
 
 namespace epics { namespace neutronServer {
 
+// --------------------------------------------------------------------------------------------
+// HistogramRecord
+// --------------------------------------------------------------------------------------------
 
 #ifdef USE_PVXS
-    // Nothing to do here
+HistogramRecord::HistogramRecord(const std::string& name)
+  : name(name), record(pvxs::server::SharedPV::buildReadonly())
+{
+    prototype = nt::NTScalar{TypeCode::UInt32A}.create();
+    record.open(prototype.clone());
+}
+
+void HistogramRecord::update(pvxs::shared_array<const uint32_t> counts)
+{
+    Value update = prototype.cloneEmpty();
+    epicsTimeStamp now = epicsTime::getCurrent();
+    update["timeStamp.secondsPastEpoch"] = now.secPastEpoch;
+    update["timeStamp.nanoseconds"] = now.nsec;
+    update["value"] = counts;
+    record.post(std::move(update));
+}
 #else
-// And the actual implementation of NeutronPVRecord
+HistogramRecord::HistogramRecord(const std::string& name)
+  : name(name)
+{
+    PVStructurePtr pvStructure = getStandardPVField()->scalarArray(pvUInt, "timeStamp");
+    record = PVRecord::create(name, pvStructure);
+    pvValue = pvStructure->getSubField<PVUIntArray>("value");
+}
 
-NeutronPVRecord::shared_pointer NeutronPVRecord::create(string const & recordName)
+void HistogramRecord::update(shared_vector<const uint32> counts)
 {
-    FieldCreatePtr fieldCreate = getFieldCreate();
-    StandardFieldPtr standardField = getStandardField();
-    PVDataCreatePtr pvDataCreate = getPVDataCreate();
+    record->lock();
+    try
+    {
+        record->beginGroupPut();
+        pvValue->replace(counts);
+        // Base PVRecord updates the timeStamp
+        record->process();
+        record->endGroupPut();
+    }
+    catch(...)
+    {
+        record->unlock();
+        throw;
+    }
+    record->unlock();
+}
+#endif // USE_PVXS
 
-    // Create the data structure that the PVRecord should use
-    PVStructurePtr pvStructure = pvDataCreate->createPVStructure(
-        fieldCreate->createFieldBuilder()
-        ->add("timeStamp", standardField->timeStamp())
-        // Demo for manual setup of structure, could use
-        // add("proton_charge", standardField->scalar(pvDouble, ""))
-        ->addNestedStructure("proton_charge")
-            ->setId("epics:nt/NTScalar:1.0")
-            ->add("value", pvDouble)
-        ->endNested()
-        ->add("time_of_flight", standardField->scalarArray(pvUInt, ""))
-        ->add("pixel", standardField->scalarArray(pvUInt, ""))
-        ->createStructure()
-        );
+// --------------------------------------------------------------------------------------------
+// EncodedEventRecord
+// --------------------------------------------------------------------------------------------
 
-    NeutronPVRecord::shared_pointer pvRecord(new NeutronPVRecord(recordName, pvStructure));
-    if (!pvRecord->init())
-        pvRecord.reset();
-    return pvRecord;
+#ifdef USE_PVXS
+EncodedEventRecord::EncodedEventRecord(const std::string& name)
+  : name(name), record(pvxs::server::SharedPV::buildReadonly())
+{
+    using namespace pvxs::members;
+    prototype = TypeDef(TypeCode::Struct, {
+        Struct("timeStamp", "time_t", {
+            Int64("secondsPastEpoch"),
+            Int32("nanoseconds"),
+            Int32("userTag"),
+        }),
+        Struct("proton_charge", "epics:nt/NTScalar:1.0", {
+            Float64("value")
+        }),
+        Struct("encoded_events", "epics:nt/NTScalarArray:1.0", {
+            UInt32A("value")
+        }),
+    }).create();
+    record.open(prototype.clone());
 }
 
-NeutronPVRecord::NeutronPVRecord(string const & recordName, PVStructurePtr const & pvStructure)
-: PVRecord(recordName,pvStructure), pulse_id(0)
+void EncodedEventRecord::update(uint64_t id, double charge, pvxs::shared_array<const uint32_t> encoded)
 {
+    Value update = prototype.cloneEmpty();
+    epicsTimeStamp now = epicsTime::getCurrent();
+    update["timeStamp.secondsPastEpoch"] = now.secPastEpoch;
+    update["timeStamp.nanoseconds"] = now.nsec;
+    update["timeStamp.userTag"] = id;
+    update["proton_charge.value"] = charge;
+    update["encoded_events.value"] = encoded;
+    record.post(std::move(update));
+}
+#else
+EncodedEventRecord::EncodedEventRecord(const std::string& name)
+  : name(name)
+{
+    StandardFieldPtr standardField = getStandardField();
+    PVStructurePtr pvStructure = getPVDataCreate()->createPVStructure(
+        getFieldCreate()->createFieldBuilder()
+            ->add("timeStamp", standardField->timeStamp())
+            ->add("proton_charge", standardField->scalar(pvDouble, ""))
+            ->add("encoded_events", standardField->scalarArray(pvUInt, ""))
+            ->createStructure());
+    record = PVRecord::create(name, pvStructure);
+    pvUserTag = pvStructure->getSubField<PVInt>("timeStamp.userTag");
+    pvProtonCharge = pvStructure->getSubField<PVDouble>("proton_charge.value");
+    pvValue = pvStructure->getSubField<PVUIntArray>("encoded_events.value");
 }
 
-bool NeutronPVRecord::init()
+void EncodedEventRecord::update(uint64_t id, double charge, shared_vector<const uint32> encoded)
 {
-    initPVRecord();
+    record->lock();
+    try
+    {
+        record->beginGroupPut();
+        pvProtonCharge->put(charge);
+        pvValue->replace(encoded);
+        // Base PVRecord updates the timeStamp, including userTag, so set pulse ID afterwards
+        record->process();
+        pvUserTag->put(static_cast<int>(id));
+        record->endGroupPut();
+    }
+    catch(...)
+    {
+        record->unlock();
+        throw;
+    }
+    record->unlock();
+}
+#endif // USE_PVXS
 
-    // Fetch pointers into the records pvData which will be used to update the values
-    if (!pvTimeStamp.attach(getPVStructure()->getSubField("timeStamp")))
-        return false;
+// --------------------------------------------------------------------------------------------
+// NeutronEventRunnable, base for the fake and replay event runnables
+// --------------------------------------------------------------------------------------------
+
+/** Pulses of one bank collected for a batched update */
+struct PulseBatch
+{
+    std::vector<uint64_t> ids;
+    std::vector<double> charges;
+    std::vector<EventArray> tof, pixel;
+    std::vector<PackedEventArray> events;
+    size_t count;
+    /** Time stamp of the first pulse, if it was posted with one */
+    bool stamped;
+    PulseTimeStamp stamp;
 
-    pvProtonCharge = getPVStructure()->getSubField<PVDouble>("proton_charge.value");
-    if (pvProtonCharge.get() == NULL)
-        return false;
+    PulseBatch() : count(0), stamped(false) {}
 
-    pvTimeOfFlight = getPVStructure()->getSubField<PVUIntArray>("time_of_flight.value");
-    if (pvTimeOfFlight.get() == NULL)
-        return false;
+    /** Remember time stamp of the first pulse */
+    void addStamp(const PulseTimeStamp *stamp)
+    {
+        if (ids.empty()  &&  stamp)
+        {
+            stamped = true;
+            this->stamp = *stamp;
+        }
+    }
 
-    pvPixel = getPVStructure()->getSubField<PVUIntArray>("pixel.value");
-    if (pvPixel.get() == NULL)
-        return false;
+    void clear()
+    {
+        stamped = false;
+        ids.clear();
+        charges.clear();
+        tof.clear();
+        pixel.clear();
+        events.clear();
+        count = 0;
+    }
+};
 
-    return true;
+NeutronEventRunnable::NeutronEventRunnable(const std::string& record_name, size_t banks, bool packed)
+  : packed(packed), sort(false), numa_node(-1), is_running(true), batch_size(1)
+{
+  if (banks <= 1)
+      names.push_back(record_name);
+  else
+      for (size_t b=0; b<banks; ++b)
+      {
+          std::ostringstream name;
+          name << record_name << ":bank" << (b+1);
+          names.push_back(name.str());
+      }
+  createRecords();
 }
 
-void NeutronPVRecord::process()
+void NeutronEventRunnable::createRecords()
 {
-    // Update timestamp
-    timeStamp.getCurrent();
-    // pulse_id is unsigned, put into userTag as signed?
-    timeStamp.setUserTag(static_cast<int>(pulse_id));
-    pvTimeStamp.set(timeStamp);
+  bool batched = batch_size > 1;
+#ifdef USE_PVXS
+  TypeDef recordDef = Neutrons(packed, batched).build();
+  // Source instead of a SharedPV per bank, so each subscriber can be decimated
+  source.reset(new DecimatingSource(names, recordDef.create()));
+  updates.clear();
+  for (size_t b=0; b<names.size(); ++b)
+      updates.push_back(NeutronsValue(recordDef.create()));
+#else
+  records.clear();
+  for (size_t b=0; b<names.size(); ++b)
+      records.push_back(NeutronPVRecord::create(names[b], packed, batched));
+#endif
 }
 
-void NeutronPVRecord::update(uint64 id, double charge,
-                             shared_vector<const uint32> tof,
-                             shared_vector<const uint32> pixel)
+void NeutronEventRunnable::enableBatching(size_t pulses)
 {
-    lock();
-    try
+    batch_size = pulses > 1 ? pulses : 1;
+    batches.clear();
+    for (size_t b=0; b<names.size(); ++b)
+        batches.push_back(std::shared_ptr<PulseBatch>(new PulseBatch()));
+    if (! batch_pool)
     {
-        beginGroupPut();
-        pulse_id = id;
-        pvProtonCharge->put(charge);
-        pvTimeOfFlight->replace(tof);
-        pvPixel->replace(pixel);
+        // Keep the arrays of the batches being posted and those still held by the records
+        batch_pool = ArrayPool::create(std::max(size_t(16), 4*names.size()));
+        batch_pool->setNumaNode(numa_node);
+    }
+    createRecords();
+}
 
-        // TODO Create server-side overrun by updating same field
-        // multiple times within one 'group put'
-        // pvPulseID->put(id);
+void NeutronEventRunnable::setNumaNode(int node)
+{
+    numa_node = node;
+    if (batch_pool)
+        batch_pool->setNumaNode(node);
+}
 
-        process();
-        endGroupPut();
+void NeutronEventRunnable::post(uint64_t id, double charge, EventArray tof, EventArray pixel, size_t bank,
+                                const PulseTimeStamp *stamp)
+{
+    if (batch_size <= 1)
+    {
+        publish(id, charge, tof, pixel, bank, 0, stamp);
+        return;
     }
-    catch(...)
+    PulseBatch &batch = *batches[bank];
+    batch.addStamp(stamp);
+    batch.ids.push_back(id);
+    batch.charges.push_back(charge);
+    batch.tof.push_back(tof);
+    batch.pixel.push_back(pixel);
+    batch.count += tof.size();
+    if (batch.ids.size() >= batch_size)
+        publishBatch(bank);
+}
+
+void NeutronEventRunnable::post(uint64_t id, double charge, PackedEventArray events, size_t bank,
+                                const PulseTimeStamp *stamp)
+{
+    if (batch_size <= 1)
     {
-        unlock();
-        throw;
+        publish(id, charge, events, bank, 0, stamp);
+        return;
     }
-    unlock();
+    PulseBatch &batch = *batches[bank];
+    batch.addStamp(stamp);
+    batch.ids.push_back(id);
+    batch.charges.push_back(charge);
+    batch.events.push_back(events);
+    batch.count += events.size();
+    if (batch.ids.size() >= batch_size)
+        publishBatch(bank);
+}
+
+void NeutronEventRunnable::publishBatch(size_t bank)
+{
+    PulseBatch &batch = *batches[bank];
+    size_t pulses = batch.ids.size();
+    if (pulses <= 0)
+        return;
+
+    // Per-pulse arrays, and sum of the charge
+#ifdef USE_PVXS
+    pvxs::shared_array<uint64_t> ids(pulses);
+    pvxs::shared_array<double> charges(pulses);
+    pvxs::shared_array<uint32_t> offsets(pulses);
+#else
+    shared_vector<uint64> ids(pulses);
+    shared_vector<double> charges(pulses);
+    shared_vector<uint32> offsets(pulses);
+#endif
+    double charge = 0.0;
+    size_t offset = 0;
+    for (size_t i=0; i<pulses; ++i)
+    {
+        ids[i] = batch.ids[i];
+        charges[i] = batch.charges[i];
+        charge += batch.charges[i];
+        offsets[i] = offset;
+        offset += packed ? batch.events[i].size() : batch.tof[i].size();
+    }
+    PulseBatchInfo info;
+    const PulseTimeStamp *stamp = batch.stamped ? &batch.stamp : 0;
+#ifdef USE_PVXS
+    info.ids = ids.freeze();
+    info.charges = charges.freeze();
+    info.offsets = offsets.freeze();
+#else
+    info.ids = freeze(ids);
+    info.charges = freeze(charges);
+    info.offsets = freeze(offsets);
+#endif
+
+    // Concatenate the events of all pulses
+    if (packed)
+    {
+#ifdef USE_PVXS
+        pvxs::shared_array<uint64_t> events(batch_pool->allocatePacked(batch.count));
+#else
+        shared_vector<uint64> events(batch_pool->allocatePacked(batch.count));
+#endif
+        for (size_t i=0; i<pulses; ++i)
+            std::copy(batch.events[i].begin(), batch.events[i].end(), events.data() + info.offsets[i]);
+#ifdef USE_PVXS
+        publish(batch.ids[0], charge, events.freeze(), bank, &info, stamp);
+#else
+        publish(batch.ids[0], charge, freeze(events), bank, &info, stamp);
+#endif
+    }
+    else
+    {
+#ifdef USE_PVXS
+        pvxs::shared_array<uint32_t> tof(batch_pool->allocate(batch.count)), pixel(batch_pool->allocate(batch.count));
+#else
+        shared_vector<uint32> tof(batch_pool->allocate(batch.count)), pixel(batch_pool->allocate(batch.count));
+#endif
+        for (size_t i=0; i<pulses; ++i)
+        {
+            std::copy(batch.tof[i].begin(), batch.tof[i].end(), tof.data() + info.offsets[i]);
+            std::copy(batch.pixel[i].begin(), batch.pixel[i].end(), pixel.data() + info.offsets[i]);
+        }
+#ifdef USE_PVXS
+        publish(batch.ids[0], charge, tof.freeze(), pixel.freeze(), bank, &info, stamp);
+#else
+        publish(batch.ids[0], charge, freeze(tof), freeze(pixel), bank, &info, stamp);
+#endif
+    }
+    // Release the pulses' arrays
+    batch.clear();
+}
+
+void NeutronEventRunnable::flushBatches()
+{
+    for (size_t b=0; b<batches.size(); ++b)
+        publishBatch(b);
+}
+
+void NeutronEventRunnable::publish(uint64_t id, double charge, EventArray tof, EventArray pixel, size_t bank,
+                                   const PulseBatchInfo *batch, const PulseTimeStamp *stamp)
+{
+#ifdef USE_PVXS
+    // This replaces 90 lines of code for the NeutronPVRecord implementation in neutronPVRecord.cpp
+    NeutronsValue &update = updates[bank];
+    if (stamp)
+        update.setPulse(id, charge, stamp->seconds, stamp->nanoseconds);
+    else
+        update.setPulse(id, charge);
+    update.time_of_flight = tof;
+    update.pixel = pixel;
+    if (batch)
+    {
+        update.pulse_id = batch->ids;
+        update.pulse_charge = batch->charges;
+        update.pulse_offset = batch->offsets;
+    }
+    source->post(bank, update.clone());
+#else
+    records[bank]->update(id, charge, tof, pixel, batch, stamp);
+#endif
+}
+
+void NeutronEventRunnable::publish(uint64_t id, double charge, PackedEventArray events, size_t bank,
+                                   const PulseBatchInfo *batch, const PulseTimeStamp *stamp)
+{
+#ifdef USE_PVXS
+    NeutronsValue &update = updates[bank];
+    if (stamp)
+        update.setPulse(id, charge, stamp->seconds, stamp->nanoseconds);
+    else
+        update.setPulse(id, charge);
+    update.events = events;
+    if (batch)
+    {
+        update.pulse_id = batch->ids;
+        update.pulse_charge = batch->charges;
+        update.pulse_offset = batch->offsets;
+    }
+    source->post(bank, update.clone());
+#else
+    records[bank]->update(id, charge, events, batch, stamp);
+#endif
+}
+
+void NeutronEventRunnable::shutdown()
+{   // Request exit from thread
+    is_running = false;
+    processing_done.wait(5.0);
 }
-#endif // USE_PVXS
 
 // --------------------------------------------------------------------------------------------
 // What follows is the FakeNeutronEventRunnable that creates dummy data.
@@ -136,287 +445,906 @@ void NeutronPVRecord::update(uint64 id, double charge,
 // As the number of events is increased, the server hit a CPU limit in the thread
 // that created and filled the two arrays.
 //
-// This implementation now uses two threads, one each for the tof_runnable and pixel_runnable,
-// then posting updated data as both provide a result.
+// Originally, this used two threads, one for the time-of-flight and one for the pixel array,
+// which still limited generation to two CPU cores.
+// This implementation now uses a configurable number of EventRunnable threads.
+// Each pulse's tof and pixel arrays are split into contiguous slices,
+// each thread fills its slice of both arrays,
+// then posting updated data as all threads completed their slice.
+// The arrays come from an ArrayPool, so steady state runs without allocating new memory.
+// Optionally, a PulsePublisher thread posts the data while the next pulse is already generated.
+// Pulses are started on the absolute deadlines of a PulseScheduler.
+// With several detector banks, each bank has its own record and arrays.
+// The work is still split evenly across all threads, so a thread's slice
+// may cover the end of one bank's arrays and the start of the next.
+// For histograms, each thread bins its slices right after filling them,
+// while they're still in its cache, into its own EventHistogram.
+// The histograms of all threads are then collected at a lower rate.
+// Similarly, each thread encodes its slices for the compressed records.
+// Encoded blocks are independent, so the main thread simply concatenates
+// the encoded slices of each bank.
+// When sorting by time-of-flight, each radix sort pass is split the same way:
+// All threads count the digits of their slices, the main thread
+// turns the counts into offsets, then all threads move their slices' events.
+// Encoding then happens after sorting, which compresses much better.
 // --------------------------------------------------------------------------------------------
 
-/** Runnable that creates an array.
+/** Slice of one bank's event arrays */
+struct EventSlice
+{
+    /** Time-of-flight and pixel arrays of the bank */
+    uint32_t *tof, *pixel;
+    /** .. or packed events, with tof and pixel NULL */
+    uint64_t *events;
+    /** Arrays of the bank for the result of a sort pass */
+    uint32_t *tof_out, *pixel_out;
+    uint64_t *events_out;
+    /** Index of first element in slice, number of elements */
+    size_t start, count;
+    /** Index of the bank */
+    size_t bank;
+};
+
+/** Runnable that creates a slice of the events.
  *  When creating a large demo data arrays,
- *  the two arrays can be filled in separate threads / CPU cores
+ *  the slices can be filled in separate threads / CPU cores
  */
-class ArrayRunnable : public WorkerRunnable
+class EventRunnable : public WorkerRunnable, public EventGenerator
 {
 public:
-    ArrayRunnable()
-    : count(0), id(0), realistic(0)
+    EventRunnable(uint64_t seed)
+    : EventGenerator(seed), encode_ns(0), sorting(false), max_tof(0), placement(0), slot(0),
+      task(CREATE), pass(0)
     {}
 
-    /** Start collecting events (fill array with simulated data) */
-    void createEvents(size_t count, uint64_t id, bool realistic)
+    /** Set affinity and priority of the worker thread.
+     *  Must be called before the thread is started.
+     */
+    void setPlacement(const ThreadPlacement *placement, size_t slot, const std::string &name)
+    {
+        this->placement = placement;
+        this->slot = slot;
+        this->name = name;
+    }
+
+    /** Start collecting events (fill slices of arrays with simulated data)
+     *  @param slices Slices of the banks' arrays
+     *  @param id Pulse ID
+     *  @param realistic Generate semi-real looking data?
+     *  @param banks Total number of banks
+     *  @param sampler Pixel weights for realistic data, may be NULL for uniform pixels
+     */
+    void createEvents(const std::vector<EventSlice> &slices,
+                      uint64_t id, bool realistic, size_t banks, const PixelSampler *sampler)
     {
-        this->count = count;
-        this->id = id;
-        this->realistic = realistic;
+        // Assignment re-uses the capacity of this->slices
+        this->slices = slices;
+        setPulse(id, realistic, banks, sampler);
+        task = CREATE;
         startWork();
     }
 
-    /** Wait for data to be filled and return it */
-#ifdef USE_PVXS
-    shared_array<const uint32_t> getEvents()
-#else
-    shared_vector<const uint32> getEvents()
-#endif
+    /** Start counting the time-of-flight digits of the slices for a sort pass,
+     *  see eventSort.h. Result is in 'digits' and 'max_tof'
+     */
+    void countDigits(const std::vector<EventSlice> &slices, unsigned pass)
+    {
+        this->slices = slices;
+        this->pass = pass;
+        task = COUNT;
+        startWork();
+    }
+
+    /** Start moving the events of the slices to their output arrays for a sort pass,
+     *  using the offsets in 'digits'
+     */
+    void scatterDigits(const std::vector<EventSlice> &slices, unsigned pass)
+    {
+        this->slices = slices;
+        this->pass = pass;
+        task = SCATTER;
+        startWork();
+    }
+
+    /** Start encoding the slices.
+     *  Only needed when the events are sorted after creating them,
+     *  otherwise createEvents() already encodes
+     */
+    void encodeEvents(const std::vector<EventSlice> &slices)
+    {
+        this->slices = slices;
+        task = ENCODE;
+        startWork();
+    }
+
+    /** Wait for slice to be filled, or other work to complete */
+    void waitForEvents()
     {
         waitForCompletion();
-        return data;
     }
 
-protected:
-    /** Parameters for new data request: How many events */
-    size_t count;
-    /** Parameters for new data request: Used to create dummy events */
-    uint32_t id;
-    /** Flag to generate semi-real looking data.**/
-    bool realistic;
-    /** Result of a request for data */
-#ifdef USE_PVXS
-    pvxs::shared_array<const uint32_t> data;
-#else
-    shared_vector<const uint32> data;
-#endif
-};
+    /** Time spent filling the slice of each array, and for histograms.
+     *  For packed events, tof_timer measures the complete fill.
+     */
+    NanoTimer tof_timer, pixel_timer, histogram_timer;
 
+    /** Histograms of created events, if enabled.
+     *  Only to be accessed while the worker is idle
+     */
+    std::shared_ptr<EventHistogram> tof_histogram, pixel_histogram;
 
+    /** Encoder for compressed events, if enabled */
+    std::shared_ptr<EventEncoder> encoder;
+
+    /** Encoded data of each slice, at encoded_start[i] .. encoded_start[i+1]-1.
+     *  Only to be accessed while the worker is idle
+     */
+    std::vector<uint32_t> encoded;
+    std::vector<size_t> encoded_start;
+
+    /** Time spent encoding the last pulse */
+    uint64_t encode_ns;
+
+    /** Sort events after creating them? Then encode via encodeEvents() */
+    bool sorting;
+
+    /** Digit counts or offsets for a sort pass, SORT_RADIX per slice.
+     *  Only to be accessed while the worker is idle
+     */
+    std::vector<uint32_t> digits;
+
+    /** Largest time-of-flight found by countDigits() */
+    uint32_t max_tof;
 
-class TimeOfFlightRunnable : public ArrayRunnable
-{
 protected:
+    void onStart();
     void doWork();
+
+private:
+    const ThreadPlacement *placement;
+    size_t slot;
+    std::string name;
+
+    enum Task { CREATE, COUNT, SCATTER, ENCODE };
+    Task task;
+    /** Sort pass for COUNT, SCATTER */
+    unsigned pass;
+    /** Parameters for new data request: Which elements */
+    std::vector<EventSlice> slices;
+
+    void fillPacked(const EventSlice &slice);
+    void prepareEncoding();
+    void fillSlices();
+    void countSliceDigits();
+    void scatterSlices();
+    void encodeSlices();
 };
 
-void TimeOfFlightRunnable::doWork()
+void EventRunnable::onStart()
 {
-    // Compare PVXS vs PVAccess as two blocks since code is short
-#ifdef USE_PVXS
-    pvxs::shared_array<uint32_t> tof(count);
-    if (this->realistic == false)
-        std::fill(tof.begin(), tof.end(), id);
-    else
+    if (placement  &&  placement->isEnabled())
+        placement->apply(slot, name);
+}
+
+void EventRunnable::doWork()
+{
+    switch (task)
+    {
+    case CREATE:  fillSlices();       break;
+    case COUNT:   countSliceDigits(); break;
+    case SCATTER: scatterSlices();    break;
+    case ENCODE:  encodeSlices();     break;
+    }
+}
+
+void EventRunnable::fillSlices()
+{
+    // Unless sorting, encode right away
+    bool encode = encoder  &&  ! sorting;
+    if (encode)
+        prepareEncoding();
+
+    if (! slices.empty()  &&  slices[0].events)
+    {
+        tof_timer.start();
+        for (size_t i=0; i<slices.size(); ++i)
+            fillPacked(slices[i]);
+        tof_timer.stop();
+        return;
+    }
+
+    tof_timer.start();
+    for (size_t i=0; i<slices.size(); ++i)
+        fillTimeOfFlight(slices[i].tof + slices[i].start, slices[i].count);
+    tof_timer.stop();
+
+    pixel_timer.start();
+    for (size_t i=0; i<slices.size(); ++i)
+        fillPixel(slices[i].pixel + slices[i].start, slices[i].start, slices[i].count, slices[i].bank);
+    pixel_timer.stop();
+
+    if (tof_histogram)
     {
-        for (size_t i = 0; i < count; i++)
+        histogram_timer.start();
+        for (size_t i=0; i<slices.size(); ++i)
         {
-            uint32_t normal_tof = 0;
-            for (uint32_t j = 0; j < NS_TOF_NORM; ++j)
-                normal_tof += rand() % (NS_TOF_MAX);
-            tof[i] = int(normal_tof/NS_TOF_NORM);
+            tof_histogram->add(slices[i].tof + slices[i].start, slices[i].count);
+            pixel_histogram->add(slices[i].pixel + slices[i].start, slices[i].count);
         }
+        histogram_timer.stop();
     }
-    data = tof.freeze();
-#else
-    shared_vector<uint32> tof(count);
-    if (this->realistic == false)
-        fill(tof.begin(), tof.end(), id);
-    else
+
+    if (encode)
+        encodeSlices();
+}
+
+void EventRunnable::countSliceDigits()
+{
+    digits.assign(slices.size() * SORT_RADIX, 0);
+    max_tof = 0;
+    for (size_t i=0; i<slices.size(); ++i)
+    {
+        const EventSlice &slice = slices[i];
+        uint32_t slice_max;
+        if (slice.events)
+            slice_max = neutronServer::countDigits(slice.events + slice.start, slice.count, pass, &digits[i*SORT_RADIX]);
+        else
+            slice_max = neutronServer::countDigits(slice.tof + slice.start, slice.count, pass, &digits[i*SORT_RADIX]);
+        max_tof = std::max(max_tof, slice_max);
+    }
+}
+
+void EventRunnable::scatterSlices()
+{
+    for (size_t i=0; i<slices.size(); ++i)
+    {
+        const EventSlice &slice = slices[i];
+        if (slice.events)
+            neutronServer::scatterDigits(slice.events + slice.start, slice.count, pass,
+                                         &digits[i*SORT_RADIX], slice.events_out);
+        else
+            neutronServer::scatterDigits(slice.tof + slice.start, slice.pixel + slice.start, slice.count, pass,
+                                         &digits[i*SORT_RADIX], slice.tof_out, slice.pixel_out);
+    }
+}
+
+void EventRunnable::encodeSlices()
+{
+    if (task == ENCODE)
+        prepareEncoding();
+    uint64_t start = NanoTimer::getCurrentNanosecs();
+    for (size_t i=0; i<slices.size(); ++i)
     {
-        uint32 *p = tof.dataPtr().get();
-        for (uint32 i = 0; i != tof.size(); ++i)
+        const EventSlice &slice = slices[i];
+        if (slice.events)
+        {   // Unpack blocks of packed events, then encode
+            enum { BLOCK = 1024 };
+            uint32_t tof[BLOCK], pixel[BLOCK];
+            size_t words = 0;
+            for (size_t done = 0;  done < slice.count;  done += BLOCK)
+            {
+                size_t n = std::min(slice.count - done, size_t(BLOCK));
+                unpackEvents(slice.events + slice.start + done, n, tof, pixel);
+                words += encoder->encode(tof, pixel, n, &encoded[encoded_start[i] + words]);
+            }
+            encoded_start[i+1] = encoded_start[i] + words;
+        }
+        else
+            encoded_start[i+1] = encoded_start[i] +
+                encoder->encode(slice.tof + slice.start, slice.pixel + slice.start,
+                                slice.count, &encoded[encoded_start[i]]);
+    }
+    encode_ns = NanoTimer::getCurrentNanosecs() - start;
+}
+
+/** Make room for the encoded slices */
+void EventRunnable::prepareEncoding()
+{
+    size_t max_words = 0;
+    for (size_t i=0; i<slices.size(); ++i)
+        max_words += EventEncoder::getMaxWords(slices[i].count);
+    // Only grows, so steady state runs without allocating
+    if (encoded.size() < max_words + 1)
+        encoded.resize(max_words + 1);
+    encoded_start.assign(slices.size() + 1, 0);
+    encode_ns = 0;
+}
+
+/** Fill packed events in one pass over the output:
+ *  Generate tof and pixel for a block of events
+ *  in small arrays that stay in the cache, bin them,
+ *  then write the packed events.
+ */
+void EventRunnable::fillPacked(const EventSlice &slice)
+{
+    enum { BLOCK = 1024 };
+    uint32_t tof[BLOCK], pixel[BLOCK];
+    uint64_t *events = slice.events + slice.start;
+    // Index of this slice for encoded data
+    size_t index = &slice - &slices[0];
+    size_t words = 0;
+    for (size_t done = 0;  done < slice.count;  done += BLOCK)
+    {
+        size_t n = std::min(slice.count - done, size_t(BLOCK));
+        fillTimeOfFlight(tof, n);
+        fillPixel(pixel, slice.start + done, n, slice.bank);
+        if (tof_histogram)
         {
-            uint32 normal_tof = 0;
-            for (uint j = 0; j < NS_TOF_NORM; ++j)
-                normal_tof += rand() % (NS_TOF_MAX);
-            *(p++) = int(normal_tof/NS_TOF_NORM);
+            tof_histogram->add(tof, n);
+            pixel_histogram->add(pixel, n);
         }
+        if (encoder  &&  ! sorting)
+        {
+            uint64_t start = NanoTimer::getCurrentNanosecs();
+            words += encoder->encode(tof, pixel, n, &encoded[encoded_start[index] + words]);
+            encode_ns += NanoTimer::getCurrentNanosecs() - start;
+        }
+        packEvents(tof, pixel, n, events + done);
     }
-    data = freeze(tof);
-#endif
+    if (encoder  &&  ! sorting)
+        encoded_start[index+1] = encoded_start[index] + words;
 }
 
-class PixelRunnable : public ArrayRunnable
+/** Runnable that posts generated pulses.
+ *  With a pipeline, the next pulse can be generated
+ *  while the previous one is still being posted.
+ */
+class PulsePublisher : public epicsThreadRunable
 {
 public:
-    NanoTimer timer;
-protected:
-    void doWork();
+    PulsePublisher(NeutronEventRunnable &source, size_t depth)
+    : source(source), depth(depth), do_run(true)
+    {}
+
+    /** Queue pulse to be posted.
+     *  Blocks while the pipeline is full
+     */
+    void submit(uint64_t id, double charge, EventArray tof, EventArray pixel, size_t bank);
+
+    /** Queue pulse with packed events to be posted. */
+    void submit(uint64_t id, double charge, PackedEventArray events, size_t bank);
+
+    /** Queue compressed events to be posted. */
+    void submit(std::shared_ptr<EncodedEventRecord> record, uint64_t id, double charge, EventArray encoded);
+
+    void run();
+
+    /** Post remaining pulses, then exit the runnable and thus thread */
+    void shutdown();
+
+private:
+    struct Pulse
+    {
+        uint64_t id;
+        double charge;
+        EventArray tof, pixel;
+        PackedEventArray events;
+        size_t bank;
+        /** Set for compressed events, posted to this record */
+        std::shared_ptr<EncodedEventRecord> encoded_record;
+        EventArray encoded;
+    };
+
+    void submit(const Pulse &pulse);
+
+    NeutronEventRunnable &source;
+    /** Maximum number of queued pulses */
+    size_t depth;
+
+    epicsMutex mutex;
+    std::deque<Pulse> queue;
+    bool do_run;
+    /** Signaled when a pulse is added to the queue, or on shutdown */
+    epicsEvent added;
+    /** Signaled when a pulse has been posted and removed from the queue */
+    epicsEvent removed;
+    epicsEvent thread_exited;
 };
 
-void PixelRunnable::doWork()
+void PulsePublisher::submit(uint64_t id, double charge, EventArray tof, EventArray pixel, size_t bank)
 {
-    // Compare PVXS vs PVAccess in individual blocks this time
+    Pulse pulse = { id, charge, tof, pixel, PackedEventArray(), bank,
+                    std::shared_ptr<EncodedEventRecord>(), EventArray() };
+    submit(pulse);
+}
 
-	// In reality, each event would have a different value,
-    // which is simulated a little bit by actually looping over
-    // each element.
-    uint32_t value = id * 10;
+void PulsePublisher::submit(uint64_t id, double charge, PackedEventArray events, size_t bank)
+{
+    Pulse pulse = { id, charge, EventArray(), EventArray(), events, bank,
+                    std::shared_ptr<EncodedEventRecord>(), EventArray() };
+    submit(pulse);
+}
 
-    // Pixels created in this thread
-#ifdef USE_PVXS
-    pvxs::shared_array<uint32_t> pixel(count);
-#else
-    shared_vector<uint32> pixel(count);
-#endif
+void PulsePublisher::submit(std::shared_ptr<EncodedEventRecord> record, uint64_t id, double charge, EventArray encoded)
+{
+    Pulse pulse = { id, charge, EventArray(), EventArray(), PackedEventArray(), 0, record, encoded };
+    submit(pulse);
+}
 
-    if (this->realistic == false)
-    {
-        // Set elements via [] operator of shared_vector
-        // This takes about 1.5 ms for 200000 elements
-        // timer.start();
-        // for (size_t i=0; i<count; ++i)
-        //   pixel[i] = value;
-        // timer.stop();
-
-        // This is much faster, about 0.6 ms, but less realistic
-        // because our code no longer accesses each array element
-        // to deposit a presumably different value
-        // timer.start();
-        // fill(pixel.begin(), pixel.end(), value);
-        // timer.stop();
-
-        // Set elements via direct access to array memory.
-        // Speed almost as good as std::fill(), about 0.65 ms,
-        // and we could conceivably put different values into
-        // each array element.
-        timer.start();
-#ifdef USE_PVXS
-        for (size_t i=0; i<count; ++i)
-            pixel[i] = value;
-#else
-        uint32 *p = pixel.dataPtr().get();
-        for (size_t i=0; i<count; ++i)
-            *(p++) = value;
-#endif
-        timer.stop();
-    
+void PulsePublisher::submit(const Pulse &pulse)
+{
+    while (true)
+    {
+        {
+            epicsGuard<epicsMutex> guard(mutex);
+            if (queue.size() < depth)
+            {
+                queue.push_back(pulse);
+                break;
+            }
+        }
+        removed.wait();
     }
-    else
+    added.signal();
+}
+
+void PulsePublisher::run()
+{
+    if (source.getThreadPlacement().isEnabled())
+        source.getThreadPlacement().apply(ThreadPlacement::PUBLISHER, "publisher");
+    while (true)
     {
-        //Pixel IDs in two detector banks.
-        //Generate random number between NS_ID_MIN1 and NS_ID_MAX1, or between NS_ID_MIN2 and NS_ID_MAX2
-        timer.start();
-#ifdef USE_PVXS
-        for (size_t i=0; i<count; ++i)
+        Pulse pulse;
+        bool have_pulse = false;
         {
-            if (i%2 == 0)
-                pixel[i] = (rand() % (NS_ID_MAX1-NS_ID_MIN1)) + NS_ID_MIN1;
-            else
-                pixel[i] = (rand() % (NS_ID_MAX2-NS_ID_MIN2)) + NS_ID_MIN2;
+            epicsGuard<epicsMutex> guard(mutex);
+            if (! queue.empty())
+            {   // Leave in queue while posting, so at most 'depth' pulses are pending
+                pulse = queue.front();
+                have_pulse = true;
+            }
+            else if (! do_run)
+                break;
         }
-#else
-        uint32 *p = pixel.dataPtr().get();
-        for (uint32 i = 0; i != pixel.size(); ++i)
+        if (! have_pulse)
         {
-            if (i%2 == 0)
-                *(p++) = (rand() % (NS_ID_MAX1-NS_ID_MIN1)) + NS_ID_MIN1;
-            else
-                *(p++) = (rand() % (NS_ID_MAX2-NS_ID_MIN2)) + NS_ID_MIN2;
+            added.wait();
+            continue;
         }
-#endif
-        timer.stop();
+        if (pulse.encoded_record)
+            pulse.encoded_record->update(pulse.id, pulse.charge, pulse.encoded);
+        else if (source.isPacked())
+            source.post(pulse.id, pulse.charge, pulse.events, pulse.bank);
+        else
+            source.post(pulse.id, pulse.charge, pulse.tof, pulse.pixel, pulse.bank);
+        {
+            epicsGuard<epicsMutex> guard(mutex);
+            queue.pop_front();
+        }
+        removed.signal();
     }
+    thread_exited.signal();
+}
 
-#ifdef USE_PVXS
-    data = pixel.freeze();
-#else
-    data = freeze(pixel);
-#endif
+void PulsePublisher::shutdown()
+{
+    {
+        epicsGuard<epicsMutex> guard(mutex);
+        do_run = false;
+    }
+    added.signal();
+    thread_exited.wait(5.0);
+}
+
+static EventSettings makeSettings(double delay, size_t event_count, bool random_count,
+                                  bool realistic, size_t skip_packets)
+{
+    EventSettings settings = { delay, event_count, random_count, realistic, skip_packets };
+    return settings;
 }
 
 FakeNeutronEventRunnable::FakeNeutronEventRunnable(const std::string& record_name,
                                                    double delay, size_t event_count, bool random_count,
-                                                   bool realistic, size_t skip_packets)
-  : is_running(true), delay(delay), event_count(event_count), random_count(random_count),
-    realistic(realistic), skip_packets(skip_packets)
-#ifdef USE_PVXS
-  , record(pvxs::server::SharedPV::buildReadonly())
-#endif
+                                                   bool realistic, size_t skip_packets, size_t threads,
+                                                   size_t pipeline, double spin, size_t banks, bool packed)
+  : NeutronEventRunnable(record_name, banks, packed),
+    config(makeSettings(delay, event_count, random_count, realistic, skip_packets)),
+    threads(threads > 0 ? threads : 1),
+    pool(ArrayPool::create()), pipeline(pipeline), spin(spin),
+    tof_bin_width(NS_TOF_BIN_WIDTH), histogram_period(1.0), record_name(record_name)
 {
-#ifdef USE_PVXS
-  recordDef = Neutrons{}.build();
-  Value initial = recordDef.create();
-  record.open(initial);
-#else
-  record = NeutronPVRecord::create(record_name);
-#endif
 }
 
 void FakeNeutronEventRunnable::run()
 {
-    std::shared_ptr<ArrayRunnable> tof_runnable(new TimeOfFlightRunnable());
-    std::shared_ptr<epicsThread> tof_thread(new epicsThread(*tof_runnable, "tof_processor", epicsThreadGetStackSize(epicsThreadStackMedium)));
-    tof_thread->start();
+    if (placement.isEnabled())
+        placement.apply(ThreadPlacement::PROCESSOR, "processor");
 
-    std::shared_ptr<PixelRunnable> pixel_runnable(new PixelRunnable());
-    std::shared_ptr<epicsThread> pixel_thread(new epicsThread(*pixel_runnable, "pixel_processor", epicsThreadGetStackSize(epicsThreadStackMedium)));
-    pixel_thread->start();
+    // Settings of the current pulse, and how many changes were applied
+    EventSettings settings;
+    uint64_t config_version = (uint64_t)-1;
+    // There are no previous settings to keep while a change is in progress
+    while (! config.read(settings, config_version))
+        epicsThreadSleep(0.001);
+    uint64_t config_changes = 0;
+
+    // Each worker thread has its own random number engine, seeded differently
+    std::vector<std::shared_ptr<EventRunnable> > workers;
+    std::vector<std::shared_ptr<epicsThread> > worker_threads;
+    for (size_t i=0; i<threads; ++i)
+    {
+        std::shared_ptr<EventRunnable> worker(new EventRunnable(i+1));
+        std::ostringstream name;
+        name << "event_processor" << i;
+        worker->setPlacement(&placement, ThreadPlacement::WORKER + i, name.str());
+        std::shared_ptr<epicsThread> thread(new epicsThread(*worker, name.str().c_str(), epicsThreadGetStackSize(epicsThreadStackMedium)));
+        thread->start();
+        workers.push_back(worker);
+        worker_threads.push_back(thread);
+    }
+
+    // With a pipeline, generated pulses are posted by a separate thread
+    size_t banks = getRecordCount();
+    std::shared_ptr<PulsePublisher> publisher;
+    std::shared_ptr<epicsThread> publisher_thread;
+    if (pipeline > 0)
+    {
+        // Compressed events are posted as separate pulses
+        publisher.reset(new PulsePublisher(*this, pipeline * banks * (encoded.empty() ? 1 : 2)));
+        publisher_thread.reset(new epicsThread(*publisher, "publisher", epicsThreadGetStackSize(epicsThreadStackMedium)));
+        publisher_thread->start();
+    }
+
+    // Pre-fault buffers for tof and pixel of the current and next pulse,
+    // plus those waiting in the pipeline and the output of sort passes
+    // (packed events use one buffer of twice the size),
+    // placed on the requested NUMA node
+    pool->setNumaNode(numa_node);
+    pool->reserve((settings.count + banks - 1) / banks, 2*banks*(2 + pipeline + (sort ? 1 : 0)));
+
+    // Arrays of each bank, and slices of them for each worker
+#ifdef USE_PVXS
+    std::vector<pvxs::shared_array<uint32_t> > tof(banks), pixel(banks);
+    std::vector<pvxs::shared_array<uint64_t> > events(banks);
+    std::vector<pvxs::shared_array<uint32_t> > encoded_events(banks);
+    std::vector<pvxs::shared_array<uint32_t> > tof_out(banks), pixel_out(banks);
+    std::vector<pvxs::shared_array<uint64_t> > events_out(banks);
+#else
+    std::vector<shared_vector<uint32> > tof(banks), pixel(banks);
+    std::vector<shared_vector<uint64> > events(banks);
+    std::vector<shared_vector<uint32> > encoded_events(banks);
+    std::vector<shared_vector<uint32> > tof_out(banks), pixel_out(banks);
+    std::vector<shared_vector<uint64> > events_out(banks);
+#endif
+    std::vector<size_t> bank_start(banks + 1);
+    std::vector<std::vector<EventSlice> > slices(threads);
+
+    // Histograms cover 0 .. NS_TOF_MAX and all possible pixel IDs
+    size_t tof_bins = (NS_TOF_MAX + tof_bin_width - 1) / tof_bin_width;
+    size_t pixel_bins;
+    if (sampler)
+        pixel_bins = sampler->getPixelCount() * banks;
+    else if (banks > 1)
+        pixel_bins = banks * NS_BANK_STRIDE;
+    else
+        pixel_bins = NS_ID_MAX2 + 1;
+    if (! histograms.empty())
+        for (size_t i=0; i<threads; ++i)
+        {
+            workers[i]->tof_histogram.reset(new EventHistogram(tof_bins, tof_bin_width));
+            workers[i]->pixel_histogram.reset(new EventHistogram(pixel_bins));
+        }
+    uint64_t outside = 0;
+
+    // Compressed events, and statistics for the log
+    if (! encoded.empty())
+        for (size_t i=0; i<threads; ++i)
+            workers[i]->encoder.reset(new EventEncoder());
+    std::vector<size_t> encoded_words(banks);
+    uint64_t raw_bytes = 0, encoded_bytes = 0, encode_ns = 0;
+
+    // Sorting: Digit counts of all slices of one bank
+    if (sort)
+        for (size_t i=0; i<threads; ++i)
+            workers[i]->sorting = true;
+    std::vector<uint32_t *> bank_digits;
+    NanoTimer sort_timer;
+
+    // Time to fill the arrays, to post or submit them,
+    // and from the pulse deadline until all is posted
+    LatencyHistogram fill_latency, post_latency, pulse_latency;
 
     uint64_t id = 0;
     size_t packets = 0, slow = 0;
 
-    epicsTime last_run(epicsTime::getCurrent());
-    epicsTime next_log(last_run);
-    epicsTime next_run;
+    PulseScheduler scheduler(settings.delay, spin);
+    epicsTime next_log(epicsTime::getCurrent());
+    epicsTime next_histogram(next_log + histogram_period);
 
     while (is_running)
     { 
-        // Compute time for next run
-        next_run = last_run + delay;
-
-        // Wait until then
-        double sleep = next_run - epicsTime::getCurrent();
-        if (sleep >= 0)
-            epicsThreadSleep(sleep);
-        else
+        // Wait for the next deadline, using latest delay
+        if (config.read(settings, config_version))
+            ++config_changes;
+        scheduler.setPeriod(settings.delay);
+        if (! scheduler.waitForNext())
             ++slow;
+        pulse_latency.start(scheduler.getDeadline());
+
+        // All settings for this pulse, including changes during the wait
+        if (config.read(settings, config_version))
+            ++config_changes;
 
         // Increment the 'ID' of the pulse
         ++id;
 
         // Optionally skip every Nth packet
         bool skip = false;
-        if (skip_packets > 0) {
-          skip = ((id % skip_packets) == 0);
+        if (settings.skip_packets > 0) {
+          skip = ((id % settings.skip_packets) == 0);
         }
 
         if (!skip) {
 
-          // Create fake { time-of-flight, pixel } events,
-          // using the ID to get changing values, in parallel threads
-          size_t count = random_count ? (rand() % event_count) : event_count;
-          tof_runnable->createEvents(count, id, realistic);
-          pixel_runnable->createEvents(count, id, realistic);
-          
-          // >>>> While array threads are running >>>>
           // Mark this run
-          last_run = epicsTime::getCurrent();
+          epicsTime now = epicsTime::getCurrent();
           ++packets;
 
-          // Every 10 second, show how many updates we generated so far
-          if (last_run > next_log)
+          // Every 10 second, show how many updates we generated so far.
+          // Before filling the arrays, so the output doesn't add to the fill latency
+          if (now > next_log)
             {
-              next_log = last_run + 10.0;
+              next_log = now + 10.0;
               std::cout << packets << " packets, " << slow << " times slow";
-              std::cout << ", array values set in " << pixel_runnable->timer;
+              if (banks > 1)
+                  std::cout << ", " << banks << " banks";
+              if (getBatchSize() > 1)
+                  std::cout << ", " << getBatchSize() << " pulses per update";
+              if (config_changes > 0)
+                  std::cout << ", config version " << config_version << " (" << config_changes << " changes applied)";
+              if (packed)
+                  std::cout << ", slice of " << threads << " threads set in " << workers[0]->tof_timer
+                            << " (packed)";
+              else
+                  std::cout << ", slice of " << threads << " threads set in " << workers[0]->tof_timer
+                            << " (tof), " << workers[0]->pixel_timer << " (pixel)";
+              if (sort)
+                  std::cout << ", sorted in " << sort_timer;
+              std::cout << ", worker wakeup " << workers[0]->wakeup_latency;
+              std::cout << ", fill " << fill_latency << ", post " << post_latency
+                        << ", pulse " << pulse_latency;
+              fill_latency.reset();
+              post_latency.reset();
+              pulse_latency.reset();
+              if (! histograms.empty())
+                  std::cout << ", histograms " << workers[0]->histogram_timer
+                            << ", " << outside << " events outside";
+              if (encode_ns > 0)
+                  std::cout << ", encoded " << (encoded_bytes > 0 ? double(raw_bytes) / encoded_bytes : 0.0)
+                            << ":1 at " << double(raw_bytes) / encode_ns << " GB/s per thread";
+              std::cout << ", array pool " << pool->getHits() << " hits, "
+                        << pool->getMisses() << " misses";
+              if (MonitorDecimation::getSkipped() > 0)
+                  std::cout << ", decimated monitors " << MonitorDecimation::getSent() << " sent, "
+                            << MonitorDecimation::getSkipped() << " skipped";
+              std::cout << ", ";
+              scheduler.report(std::cout);
               std::cout << std::endl;
               slow = 0;
+              outside = 0;
+              raw_bytes = encoded_bytes = encode_ns = 0;
             }
 
+          // Create fake { time-of-flight, pixel } events,
+          // using the ID to get changing values, in parallel threads
+          // that each fill one slice of the arrays
+          fill_latency.start();
+          size_t count = (settings.random_count  &&  settings.count > 0) ? (rand() % settings.count) : settings.count;
+          // Bank b holds events bank_start[b] .. bank_start[b+1]-1 of the pulse
+          for (size_t b=0; b<banks; ++b)
+          {
+              bank_start[b] = count * b / banks;
+              size_t bank_count = count * (b+1) / banks - bank_start[b];
+              if (packed)
+              {
+                  events[b] = pool->allocatePacked(bank_count);
+                  if (sort)
+                      events_out[b] = pool->allocatePacked(bank_count);
+              }
+              else
+              {
+                  tof[b] = pool->allocate(bank_count);
+                  pixel[b] = pool->allocate(bank_count);
+                  if (sort)
+                  {
+                      tof_out[b] = pool->allocate(bank_count);
+                      pixel_out[b] = pool->allocate(bank_count);
+                  }
+              }
+          }
+          bank_start[banks] = count;
+
+          // Split events of all banks evenly between threads
+          size_t start = 0, b = 0;
+          for (size_t i=0; i<threads; ++i)
+          {
+              size_t end = count * (i+1) / threads;
+              slices[i].clear();
+              while (start < end)
+              {
+                  while (bank_start[b+1] <= start)
+                      ++b;
+                  size_t slice_end = std::min(end, bank_start[b+1]);
+                  EventSlice slice = { tof[b].data(), pixel[b].data(), events[b].data(),
+                                       tof_out[b].data(), pixel_out[b].data(), events_out[b].data(),
+                                       start - bank_start[b], slice_end - start, b };
+                  slices[i].push_back(slice);
+                  start = slice_end;
+              }
+              workers[i]->createEvents(slices[i], id, settings.realistic, banks, sampler.get());
+          }
+          
+          // >>>> While worker threads are running >>>>
           // Vary a fake 'charge' based on the ID
           double charge = (1 + id % 10)*1e8;
 
-          // <<<< Wait for array threads, fetch their data <<<<
+          // <<<< Wait for worker threads <<<<
+          for (size_t i=0; i<threads; ++i)
+              workers[i]->waitForEvents();
+          fill_latency.stop();
+
+          // Sort each bank by time-of-flight, see eventSort.h
+          if (sort)
+          {
+              sort_timer.start();
+              unsigned passes = 1;
+              for (unsigned pass=0; pass<passes; ++pass)
+              {
+                  for (size_t i=0; i<threads; ++i)
+                      workers[i]->countDigits(slices[i], pass);
+                  uint32_t max_tof = 0;
+                  for (size_t i=0; i<threads; ++i)
+                  {
+                      workers[i]->waitForEvents();
+                      max_tof = std::max(max_tof, workers[i]->max_tof);
+                  }
+                  if (pass == 0)
+                      passes = getSortPasses(max_tof);
+
+                  // Offsets for the slices of each bank, in order
+                  bool needed = false;
+                  for (size_t b=0; b<banks; ++b)
+                  {
+                      bank_digits.clear();
+                      for (size_t i=0; i<threads; ++i)
+                          for (size_t j=0; j<slices[i].size(); ++j)
+                              if (slices[i][j].bank == b)
+                                  bank_digits.push_back(&workers[i]->digits[j*SORT_RADIX]);
+                      if (getDigitOffsets(bank_digits.data(), bank_digits.size()))
+                          needed = true;
+                  }
+                  if (! needed)
+                      continue;
+
+                  for (size_t i=0; i<threads; ++i)
+                      workers[i]->scatterDigits(slices[i], pass);
+                  for (size_t i=0; i<threads; ++i)
+                      workers[i]->waitForEvents();
+
+                  // Output of this pass is the input for the next
+                  for (size_t i=0; i<threads; ++i)
+                      for (size_t j=0; j<slices[i].size(); ++j)
+                      {
+                          EventSlice &slice = slices[i][j];
+                          std::swap(slice.tof, slice.tof_out);
+                          std::swap(slice.pixel, slice.pixel_out);
+                          std::swap(slice.events, slice.events_out);
+                      }
+                  for (size_t b=0; b<banks; ++b)
+                  {
+                      std::swap(tof[b], tof_out[b]);
+                      std::swap(pixel[b], pixel_out[b]);
+                      std::swap(events[b], events_out[b]);
+                  }
+              }
+              sort_timer.stop();
+
+              if (! encoded.empty())
+              {
+                  for (size_t i=0; i<threads; ++i)
+                      workers[i]->encodeEvents(slices[i]);
+                  for (size_t i=0; i<threads; ++i)
+                      workers[i]->waitForEvents();
+              }
+          }
+
+          // Collect histograms of all workers
+          if (! histograms.empty()  &&  now >= next_histogram)
+          {
+              next_histogram = now + histogram_period;
+#ifdef USE_PVXS
+              pvxs::shared_array<uint32_t> tof_counts(tof_bins, 0), pixel_counts(pixel_bins, 0);
+#else
+              shared_vector<uint32> tof_counts(tof_bins, 0), pixel_counts(pixel_bins, 0);
+#endif
+              for (size_t i=0; i<threads; ++i)
+              {
+                  outside += workers[i]->tof_histogram->collect(tof_counts.data());
+                  outside += workers[i]->pixel_histogram->collect(pixel_counts.data());
+              }
+#ifdef USE_PVXS
+              histograms[0]->update(tof_counts.freeze());
+              histograms[1]->update(pixel_counts.freeze());
+#else
+              histograms[0]->update(freeze(tof_counts));
+              histograms[1]->update(freeze(pixel_counts));
+#endif
+          }
+
+          // Concatenate the encoded slices of each bank
+          if (! encoded.empty())
+          {
+              std::fill(encoded_words.begin(), encoded_words.end(), 0);
+              for (size_t i=0; i<threads; ++i)
+                  for (size_t j=0; j<slices[i].size(); ++j)
+                      encoded_words[slices[i][j].bank] += workers[i]->encoded_start[j+1] - workers[i]->encoded_start[j];
+              for (size_t b=0; b<banks; ++b)
+              {
+                  encoded_events[b] = pool->allocate(encoded_words[b]);
+                  encoded_bytes += encoded_words[b] * sizeof(uint32_t);
+                  encoded_words[b] = 0;
+              }
+              for (size_t i=0; i<threads; ++i)
+              {
+                  const EventRunnable &worker = *workers[i];
+                  for (size_t j=0; j<slices[i].size(); ++j)
+                  {
+                      size_t b = slices[i][j].bank;
+                      size_t words = worker.encoded_start[j+1] - worker.encoded_start[j];
+                      std::copy(&worker.encoded[worker.encoded_start[j]], &worker.encoded[worker.encoded_start[j]] + words,
+                                encoded_events[b].data() + encoded_words[b]);
+                      encoded_words[b] += words;
+                  }
+                  encode_ns += worker.encode_ns;
+              }
+              raw_bytes += count * 2 * sizeof(uint32_t);
+          }
+
+          // All banks get the same pulse ID
+          post_latency.start();
+          for (size_t b=0; b<banks; ++b)
+          {
+              if (packed)
+              {
+#ifdef USE_PVXS
+                  PackedEventArray packed_events(events[b].freeze());
+#else
+                  PackedEventArray packed_events(freeze(events[b]));
+#endif
+                  if (publisher)
+                      publisher->submit(id, charge, packed_events, b);
+                  else
+                      post(id, charge, packed_events, b);
+              }
+              else
+              {
+#ifdef USE_PVXS
+                  EventArray tof_events(tof[b].freeze()), pixel_events(pixel[b].freeze());
+#else
+                  EventArray tof_events(freeze(tof[b])), pixel_events(freeze(pixel[b]));
+#endif
+                  if (publisher)
+                      publisher->submit(id, charge, tof_events, pixel_events, b);
+                  else
+                      post(id, charge, tof_events, pixel_events, b);
+              }
+
+              if (! encoded.empty())
+              {
 #ifdef USE_PVXS
-          // This replaces 90 lines of code for NeutronPVRecord implementation at the top of the file
-          Value update = recordDef.create();
-          epicsTimeStamp now = epicsTime::getCurrent();
-          update["timeStamp.secondsPastEpoch"] = now.secPastEpoch;
-          update["timeStamp.nanoseconds"] = now.nsec;
-          update["timeStamp.userTag"] = id;
-          update["proton_charge.value"] = charge;
-          update["time_of_flight.value"] = tof_runnable->getEvents();
-          update["pixel.value"] = pixel_runnable->getEvents();
-          record.post(std::move(update));
+                  EventArray encoded_data(encoded_events[b].freeze());
 #else
-          record->update(id, charge, tof_runnable->getEvents(), pixel_runnable->getEvents());
+                  EventArray encoded_data(freeze(encoded_events[b]));
 #endif
+                  if (publisher)
+                      publisher->submit(encoded[b], id, charge, encoded_data);
+                  else
+                      encoded[b]->update(id, charge, encoded_data);
+              }
+          }
+
+          post_latency.stop();
+          pulse_latency.stop();
 
           // TODO Overflow the server queue by posting several updates.
           // For client request "record[queueSize=2]field()", this causes overrun.
@@ -427,31 +1355,196 @@ void FakeNeutronEventRunnable::run()
 
     }
 
-    pixel_runnable->shutdown();
-    tof_runnable->shutdown();
+    if (publisher)
+        publisher->shutdown();
+    flushBatches();
+    for (size_t i=0; i<threads; ++i)
+        workers[i]->shutdown();
     std::cout << "Processing thread exits\n";
     processing_done.signal();
 }
 
 void FakeNeutronEventRunnable::setDelay(double seconds)
-{   // No locking..
-    delay = seconds;
+{
+    config.setDelay(seconds);
 }
 
 void FakeNeutronEventRunnable::setCount(size_t count)
-{   // No locking..
-    event_count = count;
+{
+    config.setCount(count);
 }
 
 void FakeNeutronEventRunnable::setRandomCount(bool random_count)
-{   // No locking..
-	this->random_count = random_count;
+{
+    config.setRandomCount(random_count);
 }
 
-void FakeNeutronEventRunnable::shutdown()
-{   // Request exit from thread
-    is_running = false;
-    processing_done.wait(5.0);
+void FakeNeutronEventRunnable::setRealistic(bool realistic)
+{
+    config.setRealistic(realistic);
+}
+
+void FakeNeutronEventRunnable::setSkipPackets(size_t skip_packets)
+{
+    config.setSkipPackets(skip_packets);
+}
+
+void FakeNeutronEventRunnable::setPixelSampler(std::shared_ptr<PixelSampler> sampler)
+{
+    this->sampler = sampler;
+}
+
+void FakeNeutronEventRunnable::enableHistograms(uint32_t tof_bin_width, double period)
+{
+    this->tof_bin_width = tof_bin_width > 0 ? tof_bin_width : NS_TOF_BIN_WIDTH;
+    histogram_period = period;
+    if (histograms.empty())
+    {
+        histograms.push_back(std::shared_ptr<HistogramRecord>(new HistogramRecord(record_name + ":tof_hist")));
+        histograms.push_back(std::shared_ptr<HistogramRecord>(new HistogramRecord(record_name + ":pixel_hist")));
+    }
+}
+
+void FakeNeutronEventRunnable::enableEncoding()
+{
+    if (encoded.empty())
+        for (size_t b=0; b<getRecordCount(); ++b)
+            encoded.push_back(std::shared_ptr<EncodedEventRecord>(new EncodedEventRecord(getRecordName(b) + ":encoded")));
+}
+
+// --------------------------------------------------------------------------------------------
+// ReplayNeutronEventRunnable: Instead of generating events, post those from an EventFile.
+// The file is memory-mapped, and the posted arrays point right into the mapping.
+// Each array's deleter holds a reference to the EventFile,
+// so the mapping remains valid until all clients have been served.
+// --------------------------------------------------------------------------------------------
+
+/** Deleter that keeps EventFile mapped while its data is in use */
+struct PinEventFile
+{
+    std::shared_ptr<EventFile> file;
+    void operator()(const uint32_t *) {}
+};
+
+ReplayNeutronEventRunnable::ReplayNeutronEventRunnable(const std::string& record_name,
+                                                       const std::string& filename, double rate_scale, bool loop)
+  : NeutronEventRunnable(record_name),
+    file(EventFile::open(filename)), rate_scale(rate_scale), loop(loop),
+    pool(ArrayPool::create())
+{
+    std::cout << "Replaying " << file->getPulseCount() << " pulses from " << filename << std::endl;
+}
+
+/** @return Recorded time stamp of a pulse in nanoseconds */
+static uint64_t getPulseNanosecs(const EventFilePulse &pulse)
+{
+    return pulse.seconds * 1000000000u + pulse.nanoseconds;
+}
+
+void ReplayNeutronEventRunnable::run()
+{
+    if (placement.isEnabled())
+        placement.apply(ThreadPlacement::PROCESSOR, "processor");
+    pool->setNumaNode(numa_node);
+
+    size_t pulses = file->getPulseCount();
+    PinEventFile pin = { file };
+
+    // Pulse IDs and time stamps of each loop continue after those of the previous loop
+    uint64_t id_offset = 0, id_span = 0;
+    uint64_t time_offset = 0, time_span = 0, recorded_gap = 0;
+    if (pulses > 0)
+    {
+        id_span = file->getPulse(pulses-1).pulse_id - file->getPulse(0).pulse_id + 1;
+        time_span = getPulseNanosecs(file->getPulse(pulses-1)) - getPulseNanosecs(file->getPulse(0));
+    }
+
+    size_t packets = 0, slow = 0;
+    PulseScheduler scheduler(0.0);
+    epicsTime next_log(epicsTime::getCurrent());
+    NanoTimer sort_timer;
+
+    size_t i = 0;
+    double period = 0.0;
+    while (is_running  &&  pulses > 0)
+    {
+        const EventFilePulse &pulse = file->getPulse(i);
+
+        // Wait for the recorded time between pulses, scaled.
+        // When starting over, the time between the last and first pulse of the file
+        // is meaningless, so keep the period of the last pulse.
+        if (i > 0)
+        {
+            int64_t gap = getPulseNanosecs(pulse) - getPulseNanosecs(file->getPulse(i-1));
+            // Recorded time stamps that go backwards are posted right away
+            recorded_gap = gap > 0 ? gap : 0;
+            period = rate_scale > 0 ? recorded_gap * 1e-9 / rate_scale : 0.0;
+        }
+        scheduler.setPeriod(period);
+        if (! scheduler.waitForNext()  &&  period > 0)
+            ++slow;
+
+        // Publish the recorded time stamp
+        uint64_t nanosecs = getPulseNanosecs(pulse) + time_offset;
+        PulseTimeStamp stamp(nanosecs / 1000000000u, nanosecs % 1000000000u);
+
+        if (sort)
+        {   // Sort copies of the recorded arrays
+            sort_timer.start();
+#ifdef USE_PVXS
+            pvxs::shared_array<uint32_t> tof(pool->allocate(pulse.count)), pixel(pool->allocate(pulse.count));
+            pvxs::shared_array<uint32_t> tof_tmp(pool->allocate(pulse.count)), pixel_tmp(pool->allocate(pulse.count));
+#else
+            shared_vector<uint32> tof(pool->allocate(pulse.count)), pixel(pool->allocate(pulse.count));
+            shared_vector<uint32> tof_tmp(pool->allocate(pulse.count)), pixel_tmp(pool->allocate(pulse.count));
+#endif
+            std::copy(file->getTimeOfFlight(i), file->getTimeOfFlight(i) + pulse.count, tof.data());
+            std::copy(file->getPixel(i), file->getPixel(i) + pulse.count, pixel.data());
+            sortEvents(tof.data(), pixel.data(), pulse.count, tof_tmp.data(), pixel_tmp.data());
+            sort_timer.stop();
+#ifdef USE_PVXS
+            post(pulse.pulse_id + id_offset, pulse.proton_charge, tof.freeze(), pixel.freeze(), 0, &stamp);
+#else
+            post(pulse.pulse_id + id_offset, pulse.proton_charge, freeze(tof), freeze(pixel), 0, &stamp);
+#endif
+        }
+        else
+        {
+#ifdef USE_PVXS
+            EventArray tof(file->getTimeOfFlight(i), pin, pulse.count);
+            EventArray pixel(file->getPixel(i), pin, pulse.count);
+#else
+            EventArray tof(file->getTimeOfFlight(i), pin, 0, pulse.count);
+            EventArray pixel(file->getPixel(i), pin, 0, pulse.count);
+#endif
+            post(pulse.pulse_id + id_offset, pulse.proton_charge, tof, pixel, 0, &stamp);
+        }
+        ++packets;
+
+        epicsTime now = epicsTime::getCurrent();
+        if (now > next_log)
+        {
+            next_log = now + 10.0;
+            std::cout << packets << " packets replayed, " << slow << " times slow, ";
+            if (sort)
+                std::cout << "sorted in " << sort_timer << ", ";
+            scheduler.report(std::cout);
+            std::cout << std::endl;
+            slow = 0;
+        }
+
+        if (++i >= pulses)
+        {
+            if (! loop)
+                break;
+            i = 0;
+            id_offset += id_span;
+            time_offset += time_span + recorded_gap;
+        }
+    }
+    flushBatches();
+    std::cout << "Replay thread exits\n";
+    processing_done.signal();
 }
 
 }} // namespace neutronServer, epics
@@ -11,153 +11,387 @@
 #ifndef NEUTRONSERVER_H
 #define NEUTRONSERVER_H
 
+#include <memory>
+#include <string>
+#include <vector>
 #include <shareLib.h>
 #include <epicsEvent.h>
 #include <epicsThread.h>
+#include <threadPlacement.h>
+#include <eventConfig.h>
 
 #ifdef USE_PVXS
 #    include <pvxs/data.h>
 #    include <pvxs/server.h>
 #    include <pvxs/sharedpv.h>
+#    include <pvxsNeutrons.h>
 #else
-#    include <pv/pvDatabase.h>
-#    include <pv/timeStamp.h>
-#    include <pv/pvTimeStamp.h>
+#    include <neutronPVRecord.h>
 #endif
 
 namespace epics { namespace neutronServer {
 
 #define NS_TOF_MAX 160000 /** Maximum TOF value for the -r option (realistic data)*/
 #define NS_TOF_NORM 10 /** Number of random samples for each TOF to generate a normal distribution*/
+#define NS_TOF_BIN_WIDTH 100 /** Default width of TOF histogram bins */
 
 #define NS_ID_MIN1 0    /** Min pixel ID for detector 1 */
 #define NS_ID_MAX1 1023 /** Max pixel ID for detector 1 */
 #define NS_ID_MIN2 2048 /** Min pixel ID for detector 2 */
 #define NS_ID_MAX2 3072 /** Max pixel ID for detector 2 */
+#define NS_BANK_STRIDE (NS_ID_MIN2-NS_ID_MIN1) /** Pixel ID offset between banks when serving one record per bank */
 
-/** Record that serves this type of pvData:
- *
- *  structure
- *      // Time stamp for everything in this structure,
- *      // userTag is sequential number to check for missed
- *      // updates
- *      time_t  timeStamp
- *      NTScalar proton_charge
- *          double  value
- *      NTScalarArray time_of_flight
- *          uint[]  value
- *      NTScalarArray pixel
- *          uint[]  value
- */
+/** Per-pulse arrays of an update that batches several pulses */
 #ifdef USE_PVXS
-struct Neutrons {
-    // We don't have to define Neutrons structure here,
-    // but we do it for completness and comparison with NeutronPVRecord
-
-    //! A TypeDef which can be appended
-    PVXS_API
-    pvxs::TypeDef build() const
-    {
-        using namespace pvxs;
-        using namespace pvxs::members;
-
-        TypeDef def(
-            TypeCode::Struct,
-            {
-                Struct("timeStamp", "time_t", {
-                    Int64("secondsPastEpoch"),
-                    Int32("nanoseconds"),
-                    Int32("userTag"),
-                }),
-                Struct("time_of_flight", "epics:nt/NTScalarArray:1.0", {
-                    UInt32A("value")
-                }),
-                Struct("pixel", "epics:nt/NTScalarArray:1.0", {
-                    UInt32A("value")
-                }),
-                Struct("proton_charge", "epics:nt/NTScalar:1.0", {
-                    Float64("value")
-                }),
-            }
-        );
-
-        return def;
-    }
-    //! Instanciate
-    inline pvxs::Value create() const {
-        return build().create();
-    }
+struct PulseBatchInfo
+{
+    pvxs::shared_array<const uint64_t> ids;
+    pvxs::shared_array<const double> charges;
+    pvxs::shared_array<const uint32_t> offsets;
 };
+#else
+typedef NeutronPVRecord::BatchInfo PulseBatchInfo;
+#endif
+
+/** Time stamp of a pulse, for example as recorded in an EventFile */
+#ifdef USE_PVXS
+struct PulseTimeStamp
+{
+    PulseTimeStamp(uint64_t seconds = 0, uint32_t nanoseconds = 0)
+    : seconds(seconds), nanoseconds(nanoseconds)
+    {}
+    uint64_t seconds;
+    uint32_t nanoseconds;
+};
+#else
+typedef epics::pvData::TimeStamp PulseTimeStamp;
+#endif
 
-#else // !defined(USE_PVXS)
 
-class NeutronPVRecord : public epics::pvDatabase::PVRecord
+/** Record for a histogram, served as NTScalarArray of uint counts */
+class HistogramRecord
 {
 public:
-    POINTER_DEFINITIONS(NeutronPVRecord);
+    HistogramRecord(const std::string& name);
 
-    // PVRecord methods
-    static NeutronPVRecord::shared_pointer create(std::string const & recordName);
-    virtual bool init();
-    virtual void process();
+    const std::string& getName() const
+    {
+        return name;
+    }
 
-    /** Update the values of the record */
-    void update(epics::pvData::uint64 id, double charge,
-                epics::pvData::shared_vector<const epics::pvData::uint32> tof,
-                epics::pvData::shared_vector<const epics::pvData::uint32> pixel);
+#ifdef USE_PVXS
+    pvxs::server::SharedPV& getRecord()
+    {
+        return record;
+    }
+
+    void update(pvxs::shared_array<const uint32_t> counts);
+#else
+    epics::pvDatabase::PVRecordPtr getRecord()
+    {
+        return record;
+    }
+
+    void update(epics::pvData::shared_vector<const epics::pvData::uint32> counts);
+#endif
 
 private:
-    NeutronPVRecord(std::string const & recordName,
-                    epics::pvData::PVStructurePtr const & pvStructure);
-
-    // Time of last process() call
-    epics::pvData::TimeStamp      timeStamp;
-    epics::pvData::uint32         pulse_id;
-
-    // Pointers in to the records' data structure
-    epics::pvData::PVTimeStamp    pvTimeStamp;
-    epics::pvData::PVDoublePtr    pvProtonCharge;
-    epics::pvData::PVUIntArrayPtr pvTimeOfFlight;
-    epics::pvData::PVUIntArrayPtr pvPixel;
+    std::string name;
+#ifdef USE_PVXS
+    pvxs::server::SharedPV record;
+    pvxs::Value prototype;
+#else
+    epics::pvDatabase::PVRecordPtr record;
+    epics::pvData::PVUIntArrayPtr pvValue;
+#endif
 };
-#endif // USE_PVXS
 
-/** Runnable for demo events */
-class FakeNeutronEventRunnable : public epicsThreadRunable
+/** Record for the compressed events of one bank:
+ *
+ *  structure
+ *      time_t  timeStamp   // userTag is the pulse ID
+ *      NTScalar proton_charge
+ *          double  value
+ *      NTScalarArray encoded_events
+ *          uint[]  value   // see eventCodec.h
+ */
+class EncodedEventRecord
 {
 public:
-    FakeNeutronEventRunnable(const std::string& record_name,
-                             double delay, size_t event_count,  bool random_count, bool realistic, size_t skip_packets);
-    void run();
-    void setDelay(double seconds);
-    void setCount(size_t count);
-    void setRandomCount(bool random_count);
-    void shutdown();
+    EncodedEventRecord(const std::string& name);
+
+    const std::string& getName() const
+    {
+        return name;
+    }
+
 #ifdef USE_PVXS
     pvxs::server::SharedPV& getRecord()
     {
         return record;
     }
+
+    void update(uint64_t id, double charge, pvxs::shared_array<const uint32_t> encoded);
 #else
-    NeutronPVRecord::shared_pointer getRecord()
+    epics::pvDatabase::PVRecordPtr getRecord()
     {
         return record;
     }
+
+    void update(uint64_t id, double charge, epics::pvData::shared_vector<const epics::pvData::uint32> encoded);
 #endif
+
 private:
+    std::string name;
 #ifdef USE_PVXS
     pvxs::server::SharedPV record;
-    pvxs::TypeDef recordDef;
+    pvxs::Value prototype;
+#else
+    epics::pvDatabase::PVRecordPtr record;
+    epics::pvData::PVIntPtr pvUserTag;
+    epics::pvData::PVDoublePtr pvProtonCharge;
+    epics::pvData::PVUIntArrayPtr pvValue;
+#endif
+};
+
+/** Array of time-of-flight or pixel values for one pulse */
+#ifdef USE_PVXS
+typedef pvxs::shared_array<const uint32_t> EventArray;
+#else
+typedef epics::pvData::shared_vector<const epics::pvData::uint32> EventArray;
+#endif
+
+/** Array of packed events for one pulse, see packedEvents.h */
+#ifdef USE_PVXS
+typedef pvxs::shared_array<const uint64_t> PackedEventArray;
 #else
-    NeutronPVRecord::shared_pointer record;
+typedef epics::pvData::shared_vector<const epics::pvData::uint64> PackedEventArray;
+#endif
+
+class ArrayPool;
+class DecimatingSource;
+class EventFile;
+class PixelSampler;
+struct PulseBatch;
+
+/** Base for runnables that publish neutron events to records
+ *
+ *  With one bank, the record uses the plain record_name.
+ *  For several banks, there is one record per bank
+ *  called "record_name:bank1", "record_name:bank2", ...
+ */
+class NeutronEventRunnable : public epicsThreadRunable
+{
+public:
+    /** @param record_name Name of the record, or base name for several banks
+     *  @param banks Number of banks
+     *  @param packed Use packed 'events' record layout?
+     */
+    NeutronEventRunnable(const std::string& record_name, size_t banks = 1, bool packed = false);
+    virtual ~NeutronEventRunnable() {}
+    /** Post one pulse to the record of a bank
+     *  @param stamp Time stamp of the pulse, NULL to use the current time
+     */
+    void post(uint64_t id, double charge, EventArray tof, EventArray pixel, size_t bank = 0,
+              const PulseTimeStamp *stamp = 0);
+    /** Post one pulse to the record of a bank, packed layout */
+    void post(uint64_t id, double charge, PackedEventArray events, size_t bank = 0,
+              const PulseTimeStamp *stamp = 0);
+    bool isPacked() const
+    {
+        return packed;
+    }
+    /** Sort the events of each pulse by time-of-flight before posting them.
+     *  Must be called before the runnable's thread is started.
+     */
+    void enableSorting()
+    {
+        sort = true;
+    }
+    /** Combine consecutive pulses into one update of each record,
+     *  to reduce the per-update overhead when posting many small pulses.
+     *  Re-creates the records with the per-pulse arrays,
+     *  so must be called before they are added to a server.
+     *  Compressed records are not batched.
+     *  @param pulses Number of pulses per update, 1 to post each pulse
+     */
+    void enableBatching(size_t pulses);
+    size_t getBatchSize() const
+    {
+        return batch_size;
+    }
+    /** Pin the threads to CPUs and/or use SCHED_FIFO.
+     *  Must be called before the runnable's thread is started.
+     */
+    void setThreadPlacement(const ThreadPlacement &placement)
+    {
+        this->placement = placement;
+    }
+    const ThreadPlacement& getThreadPlacement() const
+    {
+        return placement;
+    }
+    /** Allocate event buffers on a NUMA node, see numaPlacement.h.
+     *  Must be called before the runnable's thread is started.
+     *  @param node NUMA node, -1 for default placement
+     */
+    void setNumaNode(int node);
+    void shutdown();
+    size_t getRecordCount() const
+    {
+        return names.size();
+    }
+    const std::string& getRecordName(size_t bank = 0) const
+    {
+        return names[bank];
+    }
+#ifdef USE_PVXS
+    /** @return Source that serves the records of all banks */
+    std::shared_ptr<DecimatingSource> getSource()
+    {
+        return source;
+    }
+#else
+    NeutronPVRecord::shared_pointer getRecord(size_t bank = 0)
+    {
+        return records[bank];
+    }
+#endif
+protected:
+    /** Post pulses that are still waiting in a partial batch */
+    void flushBatches();
+
+    std::vector<std::string> names;
+    bool packed;
+    bool sort;
+    ThreadPlacement placement;
+    int numa_node;
+#ifdef USE_PVXS
+    std::shared_ptr<DecimatingSource> source;
+    /** Update for each bank, only used by the thread that posts */
+    std::vector<NeutronsValue> updates;
+#else
+    std::vector<NeutronPVRecord::shared_pointer> records;
 #endif
     bool is_running;
     epicsEvent processing_done;
-    double delay;
-    size_t event_count;
-    bool random_count;
-    bool realistic;
-    size_t skip_packets;
+
+private:
+    void createRecords();
+    void publish(uint64_t id, double charge, EventArray tof, EventArray pixel, size_t bank,
+                 const PulseBatchInfo *batch = 0, const PulseTimeStamp *stamp = 0);
+    void publish(uint64_t id, double charge, PackedEventArray events, size_t bank,
+                 const PulseBatchInfo *batch = 0, const PulseTimeStamp *stamp = 0);
+    void publishBatch(size_t bank);
+
+    /** Pulses per update */
+    size_t batch_size;
+    /** Pulses waiting to be posted, per bank */
+    std::vector<std::shared_ptr<PulseBatch> > batches;
+    /** Buffers for the concatenated events of a batch */
+    std::shared_ptr<ArrayPool> batch_pool;
+};
+
+/** Runnable for demo events
+ *
+ *  With several banks, the event_count of each pulse is split
+ *  between the banks, each using its own range of pixel IDs,
+ *  and all banks are posted with the same pulse ID.
+ *
+ *  When sorting, the worker threads that created the events
+ *  also sort them, each bank with a parallel radix sort.
+ */
+class FakeNeutronEventRunnable : public NeutronEventRunnable
+{
+public:
+    FakeNeutronEventRunnable(const std::string& record_name,
+                             double delay, size_t event_count,  bool random_count, bool realistic, size_t skip_packets,
+                             size_t threads = 2, size_t pipeline = 0, double spin = 0.0, size_t banks = 1,
+                             bool packed = false);
+    void run();
+    /** Settings may be changed from any thread while running.
+     *  They are applied at the start of the next pulse.
+     */
+    void setDelay(double seconds);
+    void setCount(size_t count);
+    void setRandomCount(bool random_count);
+    void setRealistic(bool realistic);
+    void setSkipPackets(size_t skip_packets);
+    /** Use pixel weights for realistic data.
+     *  Must be called before the runnable's thread is started
+     */
+    void setPixelSampler(std::shared_ptr<PixelSampler> sampler);
+    /** Add records "record_name:tof_hist" and "record_name:pixel_hist"
+     *  with histograms of the events of all banks.
+     *  Must be called before the runnable's thread is started.
+     *  @param tof_bin_width Width of TOF bins, covering 0 .. NS_TOF_MAX
+     *  @param period Seconds between histogram updates.
+     *                Each update has the counts since the previous update.
+     */
+    void enableHistograms(uint32_t tof_bin_width, double period);
+    /** @return Histogram records, empty unless enabled */
+    const std::vector<std::shared_ptr<HistogramRecord> >& getHistograms() const
+    {
+        return histograms;
+    }
+    /** Add records "<bank record name>:encoded" with the compressed events of each bank.
+     *  Must be called before the runnable's thread is started.
+     */
+    void enableEncoding();
+    /** @return Records for compressed events, empty unless enabled */
+    const std::vector<std::shared_ptr<EncodedEventRecord> >& getEncodedRecords() const
+    {
+        return encoded;
+    }
+private:
+    /** Delay, event count, .. */
+    EventConfig config;
+    /** Number of worker threads that fill the event arrays */
+    size_t threads;
+    /** Recycled buffers for the event arrays */
+    std::shared_ptr<ArrayPool> pool;
+    /** Number of generated pulses that may wait to be posted,
+     *  0 to post each pulse from the run() thread before generating the next one
+     */
+    size_t pipeline;
+    /** Seconds before each pulse deadline to busy-spin instead of sleep */
+    double spin;
+    /** Pixel weights for realistic data, or empty for uniform pixels */
+    std::shared_ptr<PixelSampler> sampler;
+    /** TOF and pixel histogram records, if enabled */
+    std::vector<std::shared_ptr<HistogramRecord> > histograms;
+    uint32_t tof_bin_width;
+    double histogram_period;
+    /** Records for compressed events, if enabled */
+    std::vector<std::shared_ptr<EncodedEventRecord> > encoded;
+    std::string record_name;
+};
+
+/** Runnable that replays events from an EventFile
+ *
+ *  Posts the recorded arrays without copying them,
+ *  unless sorting is enabled, with the recorded time stamps.
+ *  When looping, time stamps and pulse IDs of each pass
+ *  continue after those of the previous pass.
+ */
+class ReplayNeutronEventRunnable : public NeutronEventRunnable
+{
+public:
+    /** @param filename EventFile to replay
+     *  @param rate_scale 1 for original rate of the recorded pulses, 2 for twice as fast, ..,
+     *                    0 to replay as fast as possible
+     *  @param loop Start over at end of file?
+     *  @throws std::runtime_error when file cannot be opened
+     */
+    ReplayNeutronEventRunnable(const std::string& record_name,
+                               const std::string& filename, double rate_scale, bool loop);
+    void run();
+private:
+    std::shared_ptr<EventFile> file;
+    double rate_scale;
+    bool loop;
+    /** Buffers for sorted copies of the recorded arrays */
+    std::shared_ptr<ArrayPool> pool;
 };
 
 }}
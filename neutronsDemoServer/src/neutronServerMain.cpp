@@ -20,6 +20,9 @@
 #include <epicsThread.h>
 
 #include "neutronServer.h"
+#include "pixelSampler.h"
+#include "monitorDecimation.h"
+#include "numaPlacement.h"
 
 using namespace epics::neutronServer;
 using namespace std;
@@ -43,6 +46,26 @@ static void help(const char *name)
     cout << "  -m : Random event count, using 'count' as maximum" << endl;
     cout << "  -r : Generate normally distributed data which looks semi realistic." << endl;
     cout << "  -s Nth : Don't send every N'th packet to simulate losing data packets (default 0 which means disabled)." << endl;
+    cout << "  -t threads: Number of threads that generate the events (default 2)" << endl;
+    cout << "  -p depth  : Pipeline depth, number of generated packets that may wait to be posted" << endl;
+    cout << "              while generating the next one (default 0, strictly serial)" << endl;
+    cout << "  -b usec   : Busy-spin for the last microseconds before each packet (default 0)" << endl;
+    cout << "  -w file   : Load pixel weights for realistic data, one per pixel ID (implies -r)" << endl;
+    cout << "  -g width  : Serve TOF and pixel histograms, TOF bins of given width (" << NS_TOF_BIN_WIDTH << " is a good start)" << endl;
+    cout << "  -i seconds: .. updated with the counts of this period (default 1)" << endl;
+    cout << "  -k        : Packed layout, one 'events' array of pixel << 32 | tof instead of 'time_of_flight' and 'pixel'" << endl;
+    cout << "  -z        : Also serve compressed events on neutrons:encoded (or neutrons:bank1:encoded, ..)" << endl;
+    cout << "  -o        : Sort the events of each packet by time-of-flight" << endl;
+    cout << "  -c pulses : Combine 'pulses' packets into each update, with per-pulse ID, charge and offset arrays (default 1)" << endl;
+    cout << "  -a cpus   : Pin threads to CPUs like '2-5,8': processor, publisher, then event workers (default: any)" << endl;
+    cout << "  -y prio   : Run threads with SCHED_FIFO priority 1..99 (default 0: normal scheduling)" << endl;
+    cout << "  -u node   : Allocate event buffers on NUMA node, run all threads on its CPUs unless -a is given" << endl;
+    cout << "  -U MB     : Benchmark serializing buffers of local vs. remote NUMA nodes, then exit" << endl;
+    cout << "  -j        : Lock memory to avoid page faults (mlockall)" << endl;
+    cout << "  -n banks  : Serve events split into 'banks' records neutrons:bank1, .. (default 1, one 'neutrons' record)" << endl;
+    cout << "  -f file   : Replay events from file instead of generating them" << endl;
+    cout << "  -x scale  : .. at 'scale' times the recorded rate, 0 for as fast as possible (default 1)" << endl;
+    cout << "  -l        : .. and loop, starting over at end of file" << endl;
 }
 
 int main(int argc,char *argv[])
@@ -52,61 +75,258 @@ int main(int argc,char *argv[])
     bool random_count = false;
     bool realistic = false;
     size_t skip_packets = 0;
+    size_t threads = 2;
+    size_t pipeline = 0;
+    double spin = 0.0;
+    size_t banks = 1;
+    bool packed = false;
+    bool encode = false;
+    bool sort = false;
+    size_t batch = 1;
+    string cpus;
+    int fifo_priority = 0;
+    bool lock_memory = false;
+    int numa_node = -1;
+    double numa_benchmark = 0;
+    string weights_file;
+    uint32_t tof_bin_width = 0;
+    double histogram_period = 1.0;
+    string replay_file;
+    double rate_scale = 1.0;
+    bool loop = false;
 
     int opt;
-    while ((opt = getopt(argc, argv, "d:e:h:mrs:")) != -1)
+    while ((opt = getopt(argc, argv, "a:b:c:d:e:f:g:h:i:jklmn:op:rs:t:u:U:w:x:y:z")) != -1)
     {
         switch (opt)
         {
+        case 'a':
+            cpus = optarg;
+            break;
+        case 'b':
+            spin = atof(optarg) * 1e-6;
+            break;
+        case 'c':
+            batch = (size_t)atol(optarg);
+            break;
         case 'd':
             delay = atof(optarg);
             break;
         case 'e':
             event_count = (size_t)atol(optarg);
             break;
+        case 'f':
+            replay_file = optarg;
+            break;
+        case 'g':
+            tof_bin_width = (uint32_t)atol(optarg);
+            break;
         case 'h':
             help(argv[0]);
             return 0;
+        case 'i':
+            histogram_period = atof(optarg);
+            break;
+        case 'j':
+            lock_memory = true;
+            break;
+        case 'k':
+            packed = true;
+            break;
+        case 'l':
+            loop = true;
+            break;
         case 'm':
         	random_count = true;
             break;
+        case 'n':
+            banks = (size_t)atol(optarg);
+            break;
+        case 'o':
+            sort = true;
+            break;
         case 'r':
         	realistic = true;
                 break;
         case 's':
                 skip_packets = (size_t)atol(optarg);
                 break;
+        case 't':
+            threads = (size_t)atol(optarg);
+            break;
+        case 'p':
+            pipeline = (size_t)atol(optarg);
+            break;
+        case 'u':
+            numa_node = atoi(optarg);
+            break;
+        case 'U':
+            numa_benchmark = atof(optarg);
+            break;
+        case 'w':
+            weights_file = optarg;
+            realistic = true;
+            break;
+        case 'x':
+            rate_scale = atof(optarg);
+            break;
+        case 'y':
+            fifo_priority = atoi(optarg);
+            break;
+        case 'z':
+            encode = true;
+            break;
         default:
             help(argv[0]);
             return -1;
         }
     }
 
-    cout << "Delay : " << delay << " seconds" << endl;
-    cout << "Events: " << event_count << endl;
-    cout << "Realistic: " << realistic << endl;
-    if (skip_packets > 0) {
-      cout << "Skipping every " << skip_packets << " packets." << endl;
+    if (numa_benchmark > 0)
+    {
+        benchmarkNuma(size_t(numa_benchmark * 1e6), cout);
+        return 0;
     }
 
-    std::shared_ptr<FakeNeutronEventRunnable> runnable(new FakeNeutronEventRunnable("neutrons", delay, event_count, random_count, realistic, skip_packets));
-    auto neutrons(runnable->getRecord());
+    // Threads run on the CPUs of the NUMA node, unless CPUs are given.
+    // This thread, and thus the PVA server threads that it starts,
+    // are also confined to the node, so they serialize from local memory.
+    if (numa_node >= 0  &&  cpus.empty())
+    {
+        cpus = getNumaCPUs(numa_node);
+        if (cpus.empty())
+        {
+            cerr << "Unknown NUMA node " << numa_node << endl;
+            return -1;
+        }
+    }
+    ThreadPlacement placement;
+    try
+    {
+        placement = ThreadPlacement(cpus, fifo_priority);
+    }
+    catch (std::exception &ex)
+    {
+        cerr << ex.what() << endl;
+        return -1;
+    }
+    if (placement.isEnabled())
+        cout << "Placement: " << placement.toString() << endl;
+    if (numa_node >= 0)
+    {
+        cout << "NUMA node: " << numa_node << endl;
+        placement.confine("main");
+    }
+    if (lock_memory)
+    {
+        if (lockMemory())
+            cout << "Memory: locked" << endl;
+        else
+            return -1;
+    }
 
+    std::shared_ptr<NeutronEventRunnable> runnable;
+    FakeNeutronEventRunnable *fake = 0;
+    if (replay_file.empty())
+    {
+        cout << "Delay : " << delay << " seconds" << endl;
+        cout << "Events: " << event_count << endl;
+        cout << "Realistic: " << realistic << endl;
+        cout << "Threads: " << threads << endl;
+        cout << "Pipeline: " << pipeline << endl;
+        cout << "Banks: " << banks << endl;
+        cout << "Packed: " << packed << endl;
+        cout << "Compressed: " << encode << endl;
+        cout << "Sort: " << sort << endl;
+        cout << "Batch: " << batch << " pulses" << endl;
+        if (spin > 0) {
+          cout << "Busy-spin: " << spin*1e6 << " microseconds" << endl;
+        }
+        if (skip_packets > 0) {
+          cout << "Skipping every " << skip_packets << " packets." << endl;
+        }
+        fake = new FakeNeutronEventRunnable("neutrons", delay, event_count, random_count, realistic, skip_packets, threads, pipeline, spin, banks, packed);
+        runnable.reset(fake);
+        if (encode)
+            fake->enableEncoding();
+        if (tof_bin_width > 0)
+        {
+            cout << "Histograms: TOF bin width " << tof_bin_width << ", every " << histogram_period << " seconds" << endl;
+            fake->enableHistograms(tof_bin_width, histogram_period);
+        }
+        if (! weights_file.empty())
+        {
+            try
+            {
+                std::shared_ptr<PixelSampler> sampler = PixelSampler::load(weights_file);
+                cout << "Pixel weights: " << sampler->getPixelCount() << " pixels from " << weights_file << endl;
+                fake->setPixelSampler(sampler);
+            }
+            catch (std::exception &ex)
+            {
+                cerr << ex.what() << endl;
+                return -1;
+            }
+        }
+    }
+    else
+    {
+        cout << "Replay: " << replay_file << endl;
+        cout << "Rate scale: " << rate_scale << endl;
+        cout << "Loop: " << loop << endl;
+        cout << "Sort: " << sort << endl;
+        cout << "Batch: " << batch << " pulses" << endl;
+        try
+        {
+            runnable.reset(new ReplayNeutronEventRunnable("neutrons", replay_file, rate_scale, loop));
+        }
+        catch (std::exception &ex)
+        {
+            cerr << ex.what() << endl;
+            return -1;
+        }
+    }
+    if (sort)
+        runnable->enableSorting();
+    if (batch > 1)
+        runnable->enableBatching(batch);
+    runnable->setThreadPlacement(placement);
+    runnable->setNumaNode(numa_node);
 #ifdef USE_PVXS
     // Nothing required for PVXS
 #else
     PVDatabasePtr master = PVDatabase::getMaster();
     ChannelProviderLocalPtr channelProvider = getChannelProviderLocal();
+    registerDecimationPlugins();
 
-    if (! master->addRecord(neutrons))
-        throw std::runtime_error("Cannot add record " + neutrons->getRecordName());
+    for (size_t b=0; b<runnable->getRecordCount(); ++b)
+    {
+        auto neutrons(runnable->getRecord(b));
+        if (! master->addRecord(neutrons))
+            throw std::runtime_error("Cannot add record " + neutrons->getRecordName());
+    }
+    if (fake)
+        for (size_t i=0; i<fake->getHistograms().size(); ++i)
+            if (! master->addRecord(fake->getHistograms()[i]->getRecord()))
+                throw std::runtime_error("Cannot add record " + fake->getHistograms()[i]->getName());
+    if (fake)
+        for (size_t i=0; i<fake->getEncodedRecords().size(); ++i)
+            if (! master->addRecord(fake->getEncodedRecords()[i]->getRecord()))
+                throw std::runtime_error("Cannot add record " + fake->getEncodedRecords()[i]->getName());
 #endif
 
     shared_ptr<epicsThread> thread(new epicsThread(*runnable, "processor", epicsThreadGetStackSize(epicsThreadStackMedium)));
     thread->start();
 
 #ifdef USE_PVXS
-    pvxs::server::Server serv = pvxs::server::Config::from_env().build().addPV("neutrons", neutrons);
+    pvxs::server::Server serv = pvxs::server::Config::from_env().build();
+    serv.addSource("neutrons", runnable->getSource());
+    if (fake)
+        for (size_t i=0; i<fake->getHistograms().size(); ++i)
+            serv.addPV(fake->getHistograms()[i]->getName(), fake->getHistograms()[i]->getRecord());
+    if (fake)
+        for (size_t i=0; i<fake->getEncodedRecords().size(); ++i)
+            serv.addPV(fake->getEncodedRecords()[i]->getName(), fake->getEncodedRecords()[i]->getRecord());
     serv.start();
 #else
     ServerContext::shared_pointer pvaServer = startPVAServer(PVACCESS_ALL_PROVIDERS,0,true,true);
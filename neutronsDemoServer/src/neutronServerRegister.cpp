@@ -8,23 +8,52 @@
  *
  * @author Kay Kasemir
  */
+#include <stdlib.h>
 #include <iostream>
 
 #include <iocsh.h>
 #include <epicsExport.h>
 
 #include <neutronServer.h>
+#include <pixelSampler.h>
+#include <monitorDecimation.h>
+#include <numaPlacement.h>
 
 using namespace epics::neutronServer;
 
+/** @return Requested CPUs, or those of the NUMA node when none given */
+static std::string getCPUs(const char *cpus, int numa_node)
+{
+    if (cpus  &&  *cpus)
+        return cpus;
+    if (numa_node >= 0)
+        return getNumaCPUs(numa_node);
+    return "";
+}
+
 static const iocshArg createArg0 = { "recordName", iocshArgString };
 static const iocshArg createArg1 = { "updateDelaySecs", iocshArgDouble };
 static const iocshArg createArg2 = { "eventCount", iocshArgInt };
 static const iocshArg createArg3 = { "randomCount", iocshArgInt };
 static const iocshArg createArg4 = { "realistic", iocshArgInt };
 static const iocshArg createArg5 = { "skipPackets", iocshArgInt };
-static const iocshArg *createArgs[] = { &createArg0, &createArg1, &createArg2, &createArg3, &createArg4, &createArg5 };
-static const iocshFuncDef createFuncDef = { "neutronServerCreateRecord", 6, createArgs};
+static const iocshArg createArg6 = { "threads", iocshArgInt };
+static const iocshArg createArg7 = { "pipelineDepth", iocshArgInt };
+static const iocshArg createArg8 = { "spinMicrosecs", iocshArgInt };
+static const iocshArg createArg9 = { "banks", iocshArgInt };
+static const iocshArg createArg10 = { "pixelWeightsFile", iocshArgString };
+static const iocshArg createArg11 = { "histogramTofBinWidth", iocshArgInt };
+static const iocshArg createArg12 = { "histogramPeriodSecs", iocshArgDouble };
+static const iocshArg createArg13 = { "packed", iocshArgInt };
+static const iocshArg createArg14 = { "encoded", iocshArgInt };
+static const iocshArg createArg15 = { "sortByTof", iocshArgInt };
+static const iocshArg createArg16 = { "batchPulses", iocshArgInt };
+static const iocshArg createArg17 = { "cpus", iocshArgString };
+static const iocshArg createArg18 = { "fifoPriority", iocshArgInt };
+static const iocshArg createArg19 = { "lockMemory", iocshArgInt };
+static const iocshArg createArg20 = { "numaNode", iocshArgString };
+static const iocshArg *createArgs[] = { &createArg0, &createArg1, &createArg2, &createArg3, &createArg4, &createArg5, &createArg6, &createArg7, &createArg8, &createArg9, &createArg10, &createArg11, &createArg12, &createArg13, &createArg14, &createArg15, &createArg16, &createArg17, &createArg18, &createArg19, &createArg20 };
+static const iocshFuncDef createFuncDef = { "neutronServerCreateRecord", 21, createArgs};
 static void createFunc(const iocshArgBuf *args)
 {
     char *record_name = args[0].sval;
@@ -33,27 +62,158 @@ static void createFunc(const iocshArgBuf *args)
     bool random_count = args[3].ival;
     bool realistic = args[4].ival;
     size_t skip_packets = args[5].ival;
+    // Default to 2 threads when not specified
+    size_t threads = args[6].ival > 0 ? args[6].ival : 2;
+    size_t pipeline = args[7].ival > 0 ? args[7].ival : 0;
+    double spin = args[8].ival > 0 ? args[8].ival * 1e-6 : 0.0;
+    // One record unless several banks requested
+    size_t banks = args[9].ival > 1 ? args[9].ival : 1;
+    char *weights_file = args[10].sval;
+    // Histograms only when bin width is given, default to 1 second period
+    uint32_t tof_bin_width = args[11].ival > 0 ? args[11].ival : 0;
+    double histogram_period = args[12].dval > 0 ? args[12].dval : 1.0;
+    bool packed = args[13].ival;
+    bool encode = args[14].ival;
+    bool sort = args[15].ival;
+    // Post each pulse unless batching requested
+    size_t batch = args[16].ival > 1 ? args[16].ival : 1;
+    // Default affinity and scheduling unless requested
+    char *cpus = args[17].sval;
+    int fifo_priority = args[18].ival;
+    bool lock_memory = args[19].ival;
+    // Default memory placement unless node given
+    int numa_node = (args[20].sval  &&  *args[20].sval) ? atoi(args[20].sval) : -1;
 
     if (delay > 0)
     {
-        FakeNeutronEventRunnable *runnable = new FakeNeutronEventRunnable(record_name, delay, event_count, random_count, realistic, skip_packets);
-        auto record = runnable->getRecord();
+        ThreadPlacement placement;
+        try
+        {
+            placement = ThreadPlacement(getCPUs(cpus, numa_node), fifo_priority);
+        }
+        catch (std::exception &ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return;
+        }
+        if (lock_memory  &&  ! lockMemory())
+            return;
+        std::shared_ptr<PixelSampler> sampler;
+        if (weights_file  &&  *weights_file)
+        {
+            try
+            {
+                sampler = PixelSampler::load(weights_file);
+            }
+            catch (std::exception &ex)
+            {
+                std::cout << ex.what() << std::endl;
+                return;
+            }
+        }
+        FakeNeutronEventRunnable *runnable = new FakeNeutronEventRunnable(record_name, delay, event_count, random_count, realistic, skip_packets, threads, pipeline, spin, banks, packed);
+        if (sampler)
+            runnable->setPixelSampler(sampler);
+        if (tof_bin_width > 0)
+            runnable->enableHistograms(tof_bin_width, histogram_period);
+        if (encode)
+            runnable->enableEncoding();
+        if (sort)
+            runnable->enableSorting();
+        if (batch > 1)
+            runnable->enableBatching(batch);
+        runnable->setThreadPlacement(placement);
+        runnable->setNumaNode(numa_node);
 #ifdef USE_PVXS
-//        pvxs::server::Server serv = server::Config::from_env().build().addPV(record_name, record);
+//        pvxs::server::Server serv = server::Config::from_env().build().addSource(record_name, runnable->getSource());
 #else
-        if (! epics::pvDatabase::PVDatabase::getMaster()->addRecord(record))
-            std::cout << "Cannot create neutron record '" << record_name << "'" << std::endl;
+        for (size_t b=0; b<runnable->getRecordCount(); ++b)
+            if (! epics::pvDatabase::PVDatabase::getMaster()->addRecord(runnable->getRecord(b)))
+                std::cout << "Cannot create neutron record '" << runnable->getRecordName(b) << "'" << std::endl;
+#endif
+#ifndef USE_PVXS
+        for (size_t i=0; i<runnable->getHistograms().size(); ++i)
+            if (! epics::pvDatabase::PVDatabase::getMaster()->addRecord(runnable->getHistograms()[i]->getRecord()))
+                std::cout << "Cannot create histogram record '" << runnable->getHistograms()[i]->getName() << "'" << std::endl;
+        for (size_t i=0; i<runnable->getEncodedRecords().size(); ++i)
+            if (! epics::pvDatabase::PVDatabase::getMaster()->addRecord(runnable->getEncodedRecords()[i]->getRecord()))
+                std::cout << "Cannot create encoded record '" << runnable->getEncodedRecords()[i]->getName() << "'" << std::endl;
 #endif
         epicsThread *thread = new epicsThread(*runnable, "FakeNeutrons", epicsThreadGetStackSize(epicsThreadStackMedium));
         thread->start();
     }
 }
 
+static const iocshArg replayArg0 = { "recordName", iocshArgString };
+static const iocshArg replayArg1 = { "filename", iocshArgString };
+static const iocshArg replayArg2 = { "rateScale", iocshArgDouble };
+static const iocshArg replayArg3 = { "loop", iocshArgInt };
+static const iocshArg replayArg4 = { "sortByTof", iocshArgInt };
+static const iocshArg replayArg5 = { "batchPulses", iocshArgInt };
+static const iocshArg replayArg6 = { "cpus", iocshArgString };
+static const iocshArg replayArg7 = { "fifoPriority", iocshArgInt };
+static const iocshArg replayArg8 = { "lockMemory", iocshArgInt };
+static const iocshArg replayArg9 = { "numaNode", iocshArgString };
+static const iocshArg *replayArgs[] = { &replayArg0, &replayArg1, &replayArg2, &replayArg3, &replayArg4, &replayArg5, &replayArg6, &replayArg7, &replayArg8, &replayArg9 };
+static const iocshFuncDef replayFuncDef = { "neutronServerReplayRecord", 10, replayArgs};
+static void replayFunc(const iocshArgBuf *args)
+{
+    char *record_name = args[0].sval;
+    char *filename = args[1].sval;
+    double rate_scale = args[2].dval;
+    bool loop = args[3].ival;
+    bool sort = args[4].ival;
+    size_t batch = args[5].ival > 1 ? args[5].ival : 1;
+    char *cpus = args[6].sval;
+    int fifo_priority = args[7].ival;
+    bool lock_memory = args[8].ival;
+    int numa_node = (args[9].sval  &&  *args[9].sval) ? atoi(args[9].sval) : -1;
+
+    if (! record_name  ||  ! filename)
+    {
+        std::cout << "Usage: neutronServerReplayRecord recordName filename rateScale loop sortByTof batchPulses cpus fifoPriority lockMemory numaNode" << std::endl;
+        return;
+    }
+
+    ReplayNeutronEventRunnable *runnable;
+    ThreadPlacement placement;
+    try
+    {
+        placement = ThreadPlacement(getCPUs(cpus, numa_node), fifo_priority);
+        runnable = new ReplayNeutronEventRunnable(record_name, filename, rate_scale, loop);
+    }
+    catch (std::exception &ex)
+    {
+        std::cout << ex.what() << std::endl;
+        return;
+    }
+    if (lock_memory  &&  ! lockMemory())
+        return;
+    if (sort)
+        runnable->enableSorting();
+    if (batch > 1)
+        runnable->enableBatching(batch);
+    runnable->setThreadPlacement(placement);
+    runnable->setNumaNode(numa_node);
+#ifndef USE_PVXS
+    if (! epics::pvDatabase::PVDatabase::getMaster()->addRecord(runnable->getRecord()))
+        std::cout << "Cannot create neutron record '" << record_name << "'" << std::endl;
+#endif
+    epicsThread *thread = new epicsThread(*runnable, "ReplayNeutrons", epicsThreadGetStackSize(epicsThreadStackMedium));
+    thread->start();
+}
+
 static void neutronServerRegister(void)
 {
     static int times = 0;
     if (++times == 1)
+    {
         iocshRegister(&createFuncDef, createFunc);
+        iocshRegister(&replayFuncDef, replayFunc);
+#ifndef USE_PVXS
+        registerDecimationPlugins();
+#endif
+    }
     else
         std::cout << "neutronServerRegister called " << times << " times" << std::endl;
 }
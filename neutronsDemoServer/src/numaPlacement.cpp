@@ -0,0 +1,178 @@
+/* numaPlacement.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#   include <sys/syscall.h>
+#endif
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <nanoTimer.h>
+#include <threadPlacement.h>
+#include <numaPlacement.h>
+
+namespace epics { namespace neutronServer {
+
+// From linux/mempolicy.h, which may not be installed
+static const int NS_MPOL_PREFERRED = 1;
+static const int NS_MPOL_BIND = 2;
+static const unsigned NS_MPOL_MF_MOVE = 1 << 1;
+
+/** @return First line of a file, empty if it can't be read */
+static std::string readLine(const std::string &filename)
+{
+    std::ifstream file(filename.c_str());
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+std::vector<int> getNumaNodes()
+{
+    std::vector<int> nodes;
+    try
+    {
+        nodes = parseCPUList(readLine("/sys/devices/system/node/online"));
+    }
+    catch (std::exception &ex)
+    {
+        nodes.clear();
+    }
+    if (nodes.empty())
+        nodes.push_back(0);
+    return nodes;
+}
+
+std::string getNumaCPUs(int node)
+{
+    std::ostringstream filename;
+    filename << "/sys/devices/system/node/node" << node << "/cpulist";
+    return readLine(filename.str());
+}
+
+bool bindToNumaNode(void *addr, size_t bytes, int node, bool strict)
+{
+#ifdef __linux__
+    // Whole pages within the range
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (reinterpret_cast<uintptr_t>(addr) + page - 1) & ~(page - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + bytes) & ~(page - 1);
+    if (end <= start)
+        return true;
+
+    const size_t BITS = 8 * sizeof(unsigned long);
+    const int MAX_NODES = 1024;
+    if (node < 0  ||  node >= MAX_NODES)
+    {
+        std::cerr << "Invalid NUMA node " << node << std::endl;
+        return false;
+    }
+    unsigned long mask[MAX_NODES / BITS];
+    memset(mask, 0, sizeof(mask));
+    mask[node / BITS] |= 1UL << (node % BITS);
+    // Kernel reads maxnode-1 bits
+    if (syscall(SYS_mbind, start, end - start, strict ? NS_MPOL_BIND : NS_MPOL_PREFERRED,
+                mask, MAX_NODES + 1, NS_MPOL_MF_MOVE) != 0)
+    {
+        std::cerr << "Cannot bind memory to NUMA node " << node << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+#else
+    std::cerr << "NUMA placement is only supported on Linux" << std::endl;
+    return false;
+#endif
+}
+
+/** Read buffer like the PVA server when serializing it,
+ *  copying blocks into a small send buffer
+ *  @return Checksum so that the compiler can't skip the reads
+ */
+static uint64_t serialize(const uint32_t *data, size_t count)
+{
+    enum { BLOCK = 16384 };
+    static uint32_t send_buffer[BLOCK];
+    uint64_t sum = 0;
+    for (size_t done = 0;  done < count;  done += BLOCK)
+    {
+        size_t n = std::min(count - done, size_t(BLOCK));
+        memcpy(send_buffer, data + done, n * sizeof(uint32_t));
+        sum += send_buffer[0] + send_buffer[n-1];
+    }
+    return sum;
+}
+
+void benchmarkNuma(size_t bytes, std::ostream &out)
+{
+    std::vector<int> nodes = getNumaNodes();
+    size_t count = bytes / sizeof(uint32_t);
+    bytes = count * sizeof(uint32_t);
+    const int RUNS = 10;
+
+    out << "NUMA nodes: " << nodes.size() << std::endl;
+    for (size_t i=0; i<nodes.size(); ++i)
+        out << "Node " << nodes[i] << ": CPUs " << getNumaCPUs(nodes[i]) << std::endl;
+    out << "Serializing " << bytes / 1e6 << " MB, GB/s for buffer on node (row) read by thread on node (column)" << std::endl;
+
+    double local = 0, remote = 0;
+    size_t local_count = 0, remote_count = 0;
+    uint64_t checksum = 0;
+    for (size_t b=0; b<nodes.size(); ++b)
+    {
+        void *mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            out << "Cannot allocate " << bytes << " bytes" << std::endl;
+            return;
+        }
+        uint32_t *data = static_cast<uint32_t *>(mem);
+        // Bind before the first touch, and fill from that node
+        bindToNumaNode(data, bytes, nodes[b], true);
+        ThreadPlacement(getNumaCPUs(nodes[b])).confine("benchmark");
+        for (size_t i=0; i<count; ++i)
+            data[i] = uint32_t(i);
+
+        out << "Node " << nodes[b] << ":";
+        for (size_t r=0; r<nodes.size(); ++r)
+        {
+            ThreadPlacement(getNumaCPUs(nodes[r])).confine("benchmark");
+            // Warm up, then measure
+            checksum += serialize(data, count);
+            NanoTimer timer;
+            for (int run=0; run<RUNS; ++run)
+            {
+                timer.start();
+                checksum += serialize(data, count);
+                timer.stop();
+            }
+            double rate = double(bytes) / timer.getAverageNanosecs();
+            out << " " << rate;
+            if (b == r)
+            {
+                local += rate;
+                ++local_count;
+            }
+            else
+            {
+                remote += rate;
+                ++remote_count;
+            }
+        }
+        out << std::endl;
+        munmap(mem, bytes);
+    }
+    out << "Local: " << local / local_count << " GB/s";
+    if (remote_count > 0)
+        out << ", remote: " << remote / remote_count << " GB/s";
+    else
+        out << ", no remote nodes";
+    out << " (checksum " << checksum << ")" << std::endl;
+}
+
+}} // namespace neutronServer, epics
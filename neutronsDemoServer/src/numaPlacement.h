@@ -0,0 +1,53 @@
+/* numaPlacement.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __NUMA_PLACEMENT_H__
+#define __NUMA_PLACEMENT_H__
+
+#include <stddef.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace epics { namespace neutronServer {
+
+/** NUMA placement of event buffers
+ *
+ *  On multi-socket hosts, reading memory that's attached to
+ *  the other socket is slower.
+ *  The event arrays are filled by the worker threads, but serialized
+ *  by the PVA server threads, so both should run on the node
+ *  that holds the buffers.
+ *
+ *  Uses /sys/devices/system/node and the mbind system call,
+ *  no libnuma.
+ */
+
+/** @return Online NUMA nodes, just node 0 when not NUMA */
+std::vector<int> getNumaNodes();
+
+/** @return CPU list like "0-7,16-23" of a node, empty if unknown */
+std::string getNumaCPUs(int node);
+
+/** Place pages of memory range on NUMA node
+ *
+ *  Pages that have already been touched are moved.
+ *  Only whole pages inside the range are bound.
+ *
+ *  @param addr Start of memory
+ *  @param bytes Size of memory
+ *  @param node NUMA node
+ *  @param strict Fail allocation when node is full, or prefer node but use others when full?
+ *  @return false on error, details on std::cerr
+ */
+bool bindToNumaNode(void *addr, size_t bytes, int node, bool strict = false);
+
+/** Compare throughput for reading buffers of each node from threads on each node
+ *  @param bytes Buffer size
+ *  @param out Stream for the results
+ */
+void benchmarkNuma(size_t bytes, std::ostream &out);
+
+}} // namespace neutronServer, epics
+#endif // __NUMA_PLACEMENT_H__
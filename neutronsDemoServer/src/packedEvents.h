@@ -0,0 +1,54 @@
+/* packedEvents.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __PACKED_EVENTS_H__
+#define __PACKED_EVENTS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace epics { namespace neutronServer {
+
+/** Events in the packed layout:
+ *  One uint64 per event with the pixel ID in the upper
+ *  and the time-of-flight in the lower 32 bits.
+ *
+ *  Compared to separate time_of_flight and pixel arrays,
+ *  both values of an event are next to each other,
+ *  and there is no way for the two arrays to differ in length.
+ */
+inline uint64_t packEvent(uint32_t tof, uint32_t pixel)
+{
+    return (uint64_t(pixel) << 32) | tof;
+}
+
+inline uint32_t getPackedTimeOfFlight(uint64_t event)
+{
+    return uint32_t(event);
+}
+
+inline uint32_t getPackedPixel(uint64_t event)
+{
+    return uint32_t(event >> 32);
+}
+
+/** Pack separate tof and pixel arrays */
+inline void packEvents(const uint32_t *tof, const uint32_t *pixel, size_t n, uint64_t *events)
+{
+    for (size_t i=0; i<n; ++i)
+        events[i] = packEvent(tof[i], pixel[i]);
+}
+
+/** Unpack into separate tof and pixel arrays */
+inline void unpackEvents(const uint64_t *events, size_t n, uint32_t *tof, uint32_t *pixel)
+{
+    for (size_t i=0; i<n; ++i)
+    {
+        tof[i] = getPackedTimeOfFlight(events[i]);
+        pixel[i] = getPackedPixel(events[i]);
+    }
+}
+
+}} // namespace neutronServer, epics
+#endif // __PACKED_EVENTS_H__
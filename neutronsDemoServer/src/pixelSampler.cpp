@@ -0,0 +1,109 @@
+/* pixelSampler.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <fstream>
+#include <stdexcept>
+#include <pixelSampler.h>
+
+namespace epics { namespace neutronServer {
+
+PixelSampler::PixelSampler(const std::vector<double> &weights)
+{
+    size_t pixels = weights.size();
+    if (pixels <= 0  ||  uint64_t(pixels) > 0xFFFFFFFFULL)
+        throw std::invalid_argument("PixelSampler: Need 1 to 2^32-1 weights");
+    double total = 0;
+    for (size_t i=0; i<pixels; ++i)
+    {
+        if (! (weights[i] >= 0))
+            throw std::invalid_argument("PixelSampler: Weights must be >= 0");
+        total += weights[i];
+    }
+    if (total <= 0)
+        throw std::invalid_argument("PixelSampler: All weights are zero");
+
+    // Vose's alias method:
+    // Scale weights so that their average is 1, then
+    // repeatedly fill up one 'small' column (< 1)
+    // with the excess of one 'large' column (>= 1).
+    std::vector<double> scaled(pixels);
+    std::vector<uint32_t> small, large;
+    for (size_t i=0; i<pixels; ++i)
+    {
+        scaled[i] = weights[i] * pixels / total;
+        if (scaled[i] < 1.0)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+
+    table.resize(pixels);
+    while (! small.empty()  &&  ! large.empty())
+    {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        // Rounding errors may leave a 'large' column slightly below zero
+        table[s].threshold = scaled[s] > 0 ? uint32_t(scaled[s] * 4294967296.0) : 0;
+        table[s].alias = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Remaining columns are full, up to rounding errors.
+    // Alias to themselves so that the threshold doesn't matter.
+    large.insert(large.end(), small.begin(), small.end());
+    for (size_t i=0; i<large.size(); ++i)
+    {
+        table[large[i]].threshold = 0;
+        table[large[i]].alias = large[i];
+    }
+}
+
+std::shared_ptr<PixelSampler> PixelSampler::load(const std::string &filename)
+{
+    std::ifstream file(filename.c_str());
+    if (! file)
+        throw std::runtime_error("Cannot open pixel weights " + filename);
+
+    std::vector<double> weights;
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(file, line))
+    {
+        ++line_no;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        const char *p = line.c_str();
+        while (true)
+        {
+            char *end;
+            double weight = strtod(p, &end);
+            if (end == p)
+                break;
+            weights.push_back(weight);
+            p = end;
+        }
+        // Anything left must be white space
+        while (*p == ' '  ||  *p == '\t'  ||  *p == '\r')
+            ++p;
+        if (*p)
+            throw std::runtime_error("Invalid pixel weight in " + filename + ", line " + std::to_string(line_no));
+    }
+
+    try
+    {
+        return std::shared_ptr<PixelSampler>(new PixelSampler(weights));
+    }
+    catch (std::invalid_argument &ex)
+    {
+        throw std::runtime_error(filename + ": " + ex.what());
+    }
+}
+
+}} // namespace neutronServer, epics
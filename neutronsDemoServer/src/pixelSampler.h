@@ -0,0 +1,88 @@
+/* pixelSampler.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __PIXEL_SAMPLER_H__
+#define __PIXEL_SAMPLER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace epics { namespace neutronServer {
+
+/** Draws pixel IDs according to a table of per-pixel weights
+ *
+ *  Uses Vose's alias method: The table is built once in O(pixels),
+ *  after which each sample takes one random number and one table lookup,
+ *  independent of the number of pixels.
+ *
+ *  The high bits of the random number select a pixel,
+ *  the remaining fraction decides between that pixel and its alias.
+ *  With N pixels, the fraction has about 2^32/N distinct values,
+ *  which is plenty for millions of pixels in a load test.
+ *
+ *  Read-only once created, so it can be shared by all worker threads.
+ */
+class PixelSampler
+{
+public:
+    /** @param weights Relative weight of each pixel ID, at least one must be > 0
+     *  @throws std::invalid_argument on empty or all-zero weights
+     */
+    PixelSampler(const std::vector<double> &weights);
+
+    /** Load weights from text file, one weight per pixel ID
+     *
+     *  Weights are separated by white space or new lines.
+     *  Text after '#' up to the end of the line is ignored.
+     *
+     *  @param filename File to read
+     *  @throws std::runtime_error on error
+     */
+    static std::shared_ptr<PixelSampler> load(const std::string &filename);
+
+    /** @return Number of pixels in table */
+    size_t getPixelCount() const
+    {
+        return table.size();
+    }
+
+    /** Turn random numbers into pixel IDs
+     *  @param values Random numbers 0 .. 2^32-1 on input, pixel IDs on output
+     *  @param n Number of values
+     *  @param offset Added to each pixel ID
+     */
+    void sample(uint32_t *values, size_t n, uint32_t offset = 0) const
+    {
+        const Entry *entries = &table[0];
+        uint64_t pixels = table.size();
+        for (size_t i=0; i<n; ++i)
+        {
+            uint64_t x = values[i] * pixels;
+            uint32_t pixel = uint32_t(x >> 32);
+            const Entry &entry = entries[pixel];
+            // Select without a branch, which would be mispredicted all the time
+            uint32_t keep = -uint32_t(uint32_t(x) < entry.threshold);
+            values[i] = ((pixel & keep) | (entry.alias & ~keep)) + offset;
+        }
+    }
+
+private:
+    /** One column of the alias table.
+     *  Kept together so that each sample touches just one cache line
+     */
+    struct Entry
+    {
+        /** Probability of keeping this column's pixel, scaled to 2^32 */
+        uint32_t threshold;
+        /** Pixel to use otherwise */
+        uint32_t alias;
+    };
+    std::vector<Entry> table;
+};
+
+}} // namespace neutronServer, epics
+#endif // __PIXEL_SAMPLER_H__
@@ -0,0 +1,116 @@
+/* pulseScheduler.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <errno.h>
+#include <time.h>
+#include <nanoTimer.h>
+#include <pulseScheduler.h>
+
+namespace epics { namespace neutronServer {
+
+void JitterHistogram::reset()
+{
+    count = total_ns = max_ns = 0;
+    for (int i=0; i<BUCKETS; ++i)
+        buckets[i] = 0;
+}
+
+void JitterHistogram::add(uint64_t ns)
+{
+    ++count;
+    total_ns += ns;
+    if (ns > max_ns)
+        max_ns = ns;
+    int i = 0;
+    for (uint64_t us = ns / 1000;  us > 0  &&  i < BUCKETS-1;  us >>= 1)
+        ++i;
+    ++buckets[i];
+}
+
+std::ostream& operator<<(std::ostream& out, const JitterHistogram& histogram)
+{
+    if (histogram.count <= 0)
+    {
+        out << "-";
+        return out;
+    }
+    out << "avg " << histogram.total_ns / histogram.count / 1000.0 << " us"
+        << ", max " << histogram.max_ns / 1000.0 << " us [";
+    // Show non-empty buckets as "<limit:count"
+    bool first = true;
+    for (int i=0; i<JitterHistogram::BUCKETS; ++i)
+    {
+        if (histogram.buckets[i] <= 0)
+            continue;
+        if (! first)
+            out << " ";
+        first = false;
+        if (i < JitterHistogram::BUCKETS-1)
+            out << "<" << (uint64_t(1) << i) << "us:";
+        else
+            out << ">=" << (uint64_t(1) << (i-1)) << "us:";
+        out << histogram.buckets[i];
+    }
+    out << "]";
+    return out;
+}
+
+PulseScheduler::PulseScheduler(double period, double spin)
+: spin_ns(uint64_t(spin * 1e9))
+{
+    setPeriod(period);
+    deadline_ns = pulse_deadline_ns = last_wakeup_ns = NanoTimer::getCurrentNanosecs();
+}
+
+void PulseScheduler::setPeriod(double period)
+{
+    period_ns = period > 0 ? uint64_t(period * 1e9) : 0;
+}
+
+bool PulseScheduler::waitForNext()
+{
+    deadline_ns += period_ns;
+    pulse_deadline_ns = deadline_ns;
+
+    uint64_t now = NanoTimer::getCurrentNanosecs();
+    if (now >= deadline_ns)
+    {   // Late. When behind by more than a period,
+        // don't try to catch up with a burst of pulses
+        lateness.add(now - deadline_ns);
+        if (now - deadline_ns > period_ns)
+            deadline_ns = now;
+        last_wakeup_ns = now;
+        return false;
+    }
+
+    // Sleep until 'spin' before the deadline, ..
+    if (deadline_ns - now > spin_ns)
+    {
+        uint64_t wakeup = deadline_ns - spin_ns;
+        struct timespec ts;
+        ts.tv_sec = wakeup / 1000000000;
+        ts.tv_nsec = wakeup % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+            ; // Sleep again after signal
+    }
+    // .. then spin
+    do
+        now = NanoTimer::getCurrentNanosecs();
+    while (now < deadline_ns);
+
+    lateness.add(now - deadline_ns);
+    uint64_t period = now - last_wakeup_ns;
+    jitter.add(period > period_ns ? period - period_ns : period_ns - period);
+    last_wakeup_ns = now;
+    return true;
+}
+
+void PulseScheduler::report(std::ostream &out)
+{
+    out << "lateness " << lateness << ", period jitter " << jitter;
+    lateness.reset();
+    jitter.reset();
+}
+
+}} // namespace neutronServer, epics
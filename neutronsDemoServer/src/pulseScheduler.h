@@ -0,0 +1,84 @@
+/* pulseScheduler.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __PULSE_SCHEDULER_H__
+#define __PULSE_SCHEDULER_H__
+
+#include <stdint.h>
+#include <iostream>
+
+namespace epics { namespace neutronServer {
+
+/** Histogram of time differences with power-of-two buckets
+ *
+ *  Bucket 0 counts values below 1 microsecond,
+ *  bucket i counts values from 2^(i-1) up to 2^i microseconds.
+ */
+class JitterHistogram
+{
+public:
+    enum { BUCKETS = 24 };
+
+    JitterHistogram()
+    {
+        reset();
+    }
+
+    void reset();
+
+    void add(uint64_t ns);
+
+    friend std::ostream& operator<<(std::ostream& out, const JitterHistogram& histogram);
+
+private:
+    uint64_t count, total_ns, max_ns;
+    uint64_t buckets[BUCKETS];
+};
+
+/** Schedules pulses on absolute deadlines
+ *
+ *  Computing the next time from the time when the previous pulse
+ *  was handled drifts, and epicsThreadSleep is coarse at high rates.
+ *  This scheduler advances a deadline by exactly one period per pulse,
+ *  sleeps via clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME)
+ *  and can busy-spin for the last part of the wait for better accuracy.
+ *
+ *  Tracks how late each wakeup happened relative to its deadline,
+ *  and the jitter of the actual period between wakeups.
+ */
+class PulseScheduler
+{
+public:
+    /** @param period Seconds between pulses
+     *  @param spin Seconds before each deadline to stop sleeping and busy-spin instead
+     */
+    PulseScheduler(double period, double spin = 0.0);
+
+    /** @param period Seconds between pulses, used from the next deadline on */
+    void setPeriod(double period);
+
+    /** Wait until the next deadline
+     *  @return true if on time, false if deadline had already passed
+     */
+    bool waitForNext();
+
+    /** @return Deadline that waitForNext() last waited for, as NanoTimer::getCurrentNanosecs().
+     *          When late, that's still the original deadline of the pulse.
+     */
+    uint64_t getDeadline() const
+    {
+        return pulse_deadline_ns;
+    }
+
+    /** Show lateness and jitter, then reset them */
+    void report(std::ostream &out);
+
+private:
+    uint64_t period_ns, spin_ns;
+    uint64_t deadline_ns, pulse_deadline_ns, last_wakeup_ns;
+    JitterHistogram lateness, jitter;
+};
+
+}} // namespace neutronServer, epics
+#endif // __PULSE_SCHEDULER_H__
@@ -0,0 +1,146 @@
+/* pvxsNeutrons.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __PVXS_NEUTRONS_H__
+#define __PVXS_NEUTRONS_H__
+
+#include <stdint.h>
+#include <epicsTime.h>
+#include <pvxs/data.h>
+
+namespace epics { namespace neutronServer {
+
+/** PVXS type definition of the neutron event data
+ *
+ *  Does not depend on USE_PVXS, so a build
+ *  that links both pvDatabase and PVXS can use it
+ *  next to NeutronPVRecord.
+ */
+struct Neutrons {
+    // Same structure as NeutronPVRecord, see neutronPVRecord.h
+
+    Neutrons(bool packed = false, bool batched = false) : packed(packed), batched(batched) {}
+
+    /** Use packed 'events' instead of 'time_of_flight' and 'pixel'? */
+    bool packed;
+
+    /** Add per-pulse arrays for batched updates? */
+    bool batched;
+
+    //! A TypeDef which can be appended
+    PVXS_API
+    pvxs::TypeDef build() const
+    {
+        using namespace pvxs;
+        using namespace pvxs::members;
+
+        TypeDef def(
+            TypeCode::Struct,
+            {
+                Struct("timeStamp", "time_t", {
+                    Int64("secondsPastEpoch"),
+                    Int32("nanoseconds"),
+                    Int32("userTag"),
+                }),
+                Struct("proton_charge", "epics:nt/NTScalar:1.0", {
+                    Float64("value")
+                }),
+            }
+        );
+        if (packed)
+            def += {
+                Struct("events", "epics:nt/NTScalarArray:1.0", {
+                    UInt64A("value")
+                }),
+            };
+        else
+            def += {
+                Struct("time_of_flight", "epics:nt/NTScalarArray:1.0", {
+                    UInt32A("value")
+                }),
+                Struct("pixel", "epics:nt/NTScalarArray:1.0", {
+                    UInt32A("value")
+                }),
+            };
+        if (batched)
+            def += {
+                Struct("pulse_id", "epics:nt/NTScalarArray:1.0", {
+                    UInt64A("value")
+                }),
+                Struct("pulse_charge", "epics:nt/NTScalarArray:1.0", {
+                    Float64A("value")
+                }),
+                Struct("pulse_offset", "epics:nt/NTScalarArray:1.0", {
+                    UInt32A("value")
+                }),
+            };
+
+        return def;
+    }
+    //! Instanciate
+    inline pvxs::Value create() const {
+        return build().create();
+    }
+};
+
+/** Value of the Neutrons type with handles to its fields
+ *
+ *  The fields are looked up by name once,
+ *  not for each pulse.
+ *  Subscribers keep a posted Value, so this one is never posted.
+ *  Post a clone(), which shares the arrays, then reuse this
+ *  Value for the next pulse.
+ */
+struct NeutronsValue
+{
+    explicit NeutronsValue(const pvxs::Value &prototype)
+    : value(prototype),
+      seconds(value["timeStamp.secondsPastEpoch"]),
+      nanoseconds(value["timeStamp.nanoseconds"]),
+      user_tag(value["timeStamp.userTag"]),
+      proton_charge(value["proton_charge.value"]),
+      time_of_flight(value["time_of_flight.value"]),
+      pixel(value["pixel.value"]),
+      events(value["events.value"]),
+      pulse_id(value["pulse_id.value"]),
+      pulse_charge(value["pulse_charge.value"]),
+      pulse_offset(value["pulse_offset.value"])
+    {}
+
+    /** Start update for a pulse
+     *
+     *  Unmarks all fields, then sets time stamp and charge.
+     *  Only fields that are then assigned will be sent.
+     */
+    void setPulse(uint64_t id, double charge)
+    {
+        epicsTimeStamp now = epicsTime::getCurrent();
+        setPulse(id, charge, now.secPastEpoch, now.nsec);
+    }
+
+    /** Start update for a pulse with given time stamp */
+    void setPulse(uint64_t id, double charge, uint64_t secs, uint32_t nsecs)
+    {
+        value.unmark();
+        seconds = secs;
+        nanoseconds = nsecs;
+        user_tag = id;
+        proton_charge = charge;
+    }
+
+    /** @return Copy of the marked fields to post */
+    pvxs::Value clone() const
+    {
+        return value.clone();
+    }
+
+    pvxs::Value value;
+    pvxs::Value seconds, nanoseconds, user_tag, proton_charge;
+    /** Empty unless the layout has them */
+    pvxs::Value time_of_flight, pixel, events;
+    pvxs::Value pulse_id, pulse_charge, pulse_offset;
+};
+
+}} // namespace neutronServer, epics
+#endif // __PVXS_NEUTRONS_H__
@@ -0,0 +1,165 @@
+/* randomEngine.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __RANDOM_ENGINE_H__
+#define __RANDOM_ENGINE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace epics { namespace neutronServer {
+
+/** Seedable pseudo random number generator for the demo events
+ *
+ *  Runs LANES independent xoshiro128++ generators side by side.
+ *  The fill*() calls advance all lanes at once in loops that the
+ *  compiler can vectorize, which is much faster than calling
+ *  the global, lock-protected rand() for each element.
+ *
+ *  Not thread-safe: Each worker thread needs its own engine.
+ */
+class RandomEngine
+{
+public:
+    enum { LANES = 8 };
+
+    RandomEngine(uint64_t seed = 1)
+    {
+        setSeed(seed);
+    }
+
+    /** (Re-)initialize all lanes from one seed value */
+    void setSeed(uint64_t seed)
+    {   // Expand seed via splitmix64, as suggested by xoshiro authors
+        for (int l=0; l<LANES; ++l)
+        {
+            uint64_t a = splitMix(seed), b = splitMix(seed);
+            s0[l] = uint32_t(a);
+            s1[l] = uint32_t(a >> 32);
+            s2[l] = uint32_t(b);
+            s3[l] = uint32_t(b >> 32);
+            if ((s0[l] | s1[l] | s2[l] | s3[l]) == 0)
+                s0[l] = 1; // All-zero state would only produce zeros
+        }
+        used = LANES;
+    }
+
+    /** @return Next random number, 0 .. 2^32-1 */
+    uint32_t next()
+    {
+        if (used >= LANES)
+        {
+            step(buffer);
+            used = 0;
+        }
+        return buffer[used++];
+    }
+
+    /** @return Next random number, 0 .. range-1 */
+    uint32_t next(uint32_t range)
+    {
+        return scale(next(), range);
+    }
+
+    /** Fill array with random numbers 0 .. 2^32-1 */
+    void fill(uint32_t *out, size_t n)
+    {
+        size_t i = 0;
+        for (/**/; i + LANES <= n; i += LANES)
+            step(out + i);
+        for (/**/; i < n; ++i)
+            out[i] = next();
+    }
+
+    /** Fill array with random numbers offset .. offset+range-1 */
+    void fillRange(uint32_t *out, size_t n, uint32_t offset, uint32_t range)
+    {
+        uint32_t r[LANES];
+        size_t i = 0;
+        for (/**/; i + LANES <= n; i += LANES)
+        {
+            step(r);
+            for (int l=0; l<LANES; ++l)
+                out[i+l] = offset + scale(r[l], range);
+        }
+        for (/**/; i < n; ++i)
+            out[i] = offset + next(range);
+    }
+
+    /** Fill array with the average of 'samples' random numbers 0 .. range-1
+     *
+     *  For larger 'samples', this approximates a normal distribution
+     *  centered on range/2.
+     */
+    void fillAverage(uint32_t *out, size_t n, uint32_t range, uint32_t samples)
+    {
+        uint32_t r[LANES], sum[LANES];
+        size_t i = 0;
+        for (/**/; i + LANES <= n; i += LANES)
+        {
+            for (int l=0; l<LANES; ++l)
+                sum[l] = 0;
+            for (uint32_t s=0; s<samples; ++s)
+            {
+                step(r);
+                for (int l=0; l<LANES; ++l)
+                    sum[l] += scale(r[l], range);
+            }
+            for (int l=0; l<LANES; ++l)
+                out[i+l] = sum[l] / samples;
+        }
+        for (/**/; i < n; ++i)
+        {
+            uint32_t total = 0;
+            for (uint32_t s=0; s<samples; ++s)
+                total += next(range);
+            out[i] = total / samples;
+        }
+    }
+
+    /** Map 0 .. 2^32-1 onto 0 .. range-1 by multiply-shift, avoiding '%' */
+    static uint32_t scale(uint32_t x, uint32_t range)
+    {
+        return uint32_t((uint64_t(x) * range) >> 32);
+    }
+
+private:
+    uint32_t s0[LANES], s1[LANES], s2[LANES], s3[LANES];
+
+    /** Values from the last step() not yet returned by next() */
+    uint32_t buffer[LANES];
+    int used;
+
+    static uint32_t rotl(uint32_t x, int k)
+    {
+        return (x << k) | (x >> (32 - k));
+    }
+
+    static uint64_t splitMix(uint64_t &x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /** Advance all lanes, one xoshiro128++ step each */
+    void step(uint32_t result[LANES])
+    {
+        for (int l=0; l<LANES; ++l)
+        {
+            result[l] = rotl(s0[l] + s3[l], 7) + s0[l];
+            uint32_t t = s1[l] << 9;
+            s2[l] ^= s0[l];
+            s3[l] ^= s1[l];
+            s1[l] ^= s2[l];
+            s0[l] ^= s3[l];
+            s2[l] ^= t;
+            s3[l] = rotl(s3[l], 11);
+        }
+    }
+};
+
+}} // namespace neutronServer, epics
+#endif // __RANDOM_ENGINE_H__
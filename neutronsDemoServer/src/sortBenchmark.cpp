@@ -0,0 +1,211 @@
+/* sortBenchmark.cpp
+ *
+ * Time to sort the events of one pulse by time-of-flight,
+ * as added to each pulse's latency by the server's '-o' option.
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <epicsThread.h>
+#include <nanoTimer.h>
+#include <randomEngine.h>
+#include <workerRunnable.h>
+#include <eventSort.h>
+
+using namespace std;
+using namespace epics::neutronServer;
+
+/** Worker that handles one chunk of each sort pass,
+ *  like the server's EventRunnable
+ */
+class SortWorker : public WorkerRunnable
+{
+public:
+    const uint32_t *tof, *pixel;
+    uint32_t *tof_out, *pixel_out;
+    size_t n;
+    unsigned pass;
+    bool scatter;
+    uint32_t digits[SORT_RADIX];
+    uint32_t max_tof;
+
+    void start()
+    {
+        startWork();
+    }
+
+    void wait()
+    {
+        waitForCompletion();
+    }
+
+protected:
+    void doWork()
+    {
+        if (scatter)
+            scatterDigits(tof, pixel, n, pass, digits, tof_out, pixel_out);
+        else
+        {
+            std::fill(digits, digits + SORT_RADIX, 0);
+            max_tof = countDigits(tof, n, pass, digits);
+        }
+    }
+};
+
+/** Parallel sort, same steps as FakeNeutronEventRunnable */
+static void parallelSort(vector<shared_ptr<SortWorker> > &workers,
+                         uint32_t *tof, uint32_t *pixel, uint32_t *tof_tmp, uint32_t *pixel_tmp, size_t n)
+{
+    size_t threads = workers.size();
+    vector<uint32_t *> digits(threads);
+    uint32_t *result = tof;
+    unsigned passes = 1;
+    for (unsigned pass=0; pass<passes; ++pass)
+    {
+        for (size_t i=0; i<threads; ++i)
+        {
+            SortWorker &worker = *workers[i];
+            size_t start = n * i / threads;
+            worker.tof = tof + start;
+            worker.pixel = pixel + start;
+            worker.tof_out = tof_tmp;
+            worker.pixel_out = pixel_tmp;
+            worker.n = n * (i+1) / threads - start;
+            worker.pass = pass;
+            worker.scatter = false;
+            worker.start();
+            digits[i] = worker.digits;
+        }
+        uint32_t max_tof = 0;
+        for (size_t i=0; i<threads; ++i)
+        {
+            workers[i]->wait();
+            max_tof = max(max_tof, workers[i]->max_tof);
+        }
+        if (pass == 0)
+            passes = getSortPasses(max_tof);
+        if (! getDigitOffsets(&digits[0], threads))
+            continue;
+        for (size_t i=0; i<threads; ++i)
+        {
+            workers[i]->scatter = true;
+            workers[i]->start();
+        }
+        for (size_t i=0; i<threads; ++i)
+            workers[i]->wait();
+        swap(tof, tof_tmp);
+        swap(pixel, pixel_tmp);
+    }
+    if (tof != result)
+    {
+        copy(tof, tof + n, tof_tmp);
+        copy(pixel, pixel + n, pixel_tmp);
+    }
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h             : Help" << endl;
+    cout << "  -e count       : Events per pulse, may be repeated (default: 1000 .. 4000000)" << endl;
+    cout << "  -t threads     : Threads for the parallel sort (default: 2)" << endl;
+    cout << "  -r runs        : Runs per event count (default: 20)" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    vector<size_t> counts;
+    size_t threads = 2;
+    size_t runs = 20;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:t:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            counts.push_back(strtoul(optarg, 0, 0));
+            break;
+        case 't':
+            threads = strtoul(optarg, 0, 0);
+            break;
+        case 'r':
+            runs = strtoul(optarg, 0, 0);
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+    if (counts.empty())
+    {
+        counts.push_back(1000);
+        counts.push_back(10000);
+        counts.push_back(100000);
+        counts.push_back(200000);
+        counts.push_back(1000000);
+        counts.push_back(4000000);
+    }
+    if (threads < 1)
+        threads = 1;
+    if (runs < 1)
+        runs = 1;
+
+    vector<shared_ptr<SortWorker> > workers;
+    vector<shared_ptr<epicsThread> > worker_threads;
+    for (size_t i=0; i<threads; ++i)
+    {
+        shared_ptr<SortWorker> worker(new SortWorker());
+        shared_ptr<epicsThread> thread(new epicsThread(*worker, "sorter", epicsThreadGetStackSize(epicsThreadStackMedium)));
+        thread->start();
+        workers.push_back(worker);
+        worker_threads.push_back(thread);
+    }
+
+    cout << "Realistic time-of-flight, " << threads << " threads for parallel sort" << endl;
+    RandomEngine random(42);
+    for (size_t c=0; c<counts.size(); ++c)
+    {
+        size_t n = counts[c];
+        if (n < 1)
+            continue;
+        vector<uint32_t> tof(n), pixel(n), tof_tmp(n), pixel_tmp(n);
+        NanoTimer serial, parallel;
+        bool ok = true;
+        for (size_t run=0; run<runs; ++run)
+        {
+            random.fillAverage(&tof[0], n, 160000, 10);
+            random.fill(&pixel[0], n);
+            serial.start();
+            sortEvents(&tof[0], &pixel[0], n, &tof_tmp[0], &pixel_tmp[0]);
+            serial.stop();
+            ok = ok  &&  is_sorted(tof.begin(), tof.end());
+
+            random.fillAverage(&tof[0], n, 160000, 10);
+            random.fill(&pixel[0], n);
+            parallel.start();
+            parallelSort(workers, &tof[0], &pixel[0], &tof_tmp[0], &pixel_tmp[0], n);
+            parallel.stop();
+            ok = ok  &&  is_sorted(tof.begin(), tof.end());
+        }
+        cout << n << " events: 1 thread " << serial
+             << " (" << double(serial.getAverageNanosecs()) / n << " ns/event), "
+             << threads << " threads " << parallel
+             << " (" << double(parallel.getAverageNanosecs()) / n << " ns/event)"
+             << (ok ? "" : " NOT SORTED") << endl;
+    }
+
+    for (size_t i=0; i<threads; ++i)
+        workers[i]->shutdown();
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/* threadPlacement.cpp
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <threadPlacement.h>
+
+namespace epics { namespace neutronServer {
+
+#ifdef CPU_SETSIZE
+static const long MAX_CPUS = CPU_SETSIZE;
+#else
+static const long MAX_CPUS = 1024;
+#endif
+
+std::vector<int> parseCPUList(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::istringstream items(list);
+    std::string item;
+    while (std::getline(items, item, ','))
+    {
+        // Allow trailing newline as in /sys files
+        while (! item.empty()  &&  isspace(item[item.size()-1]))
+            item.erase(item.size()-1);
+        if (item.empty())
+            continue;
+        char *end;
+        long first = strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end+1, &end, 10);
+        if (*end != '\0'  ||  first < 0  ||  last < first  ||  last >= MAX_CPUS)
+            throw std::runtime_error("Invalid CPU list '" + list + "'");
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(int(cpu));
+    }
+    return cpus;
+}
+
+ThreadPlacement::ThreadPlacement(const std::string &cpu_list, int priority)
+  : cpus(parseCPUList(cpu_list)), priority(priority)
+{
+    if (priority < 0  ||  priority > 99)
+        throw std::runtime_error("SCHED_FIFO priority must be 1..99, or 0 for default scheduling");
+}
+
+bool ThreadPlacement::apply(size_t slot, const std::string &name) const
+{
+    bool ok = true;
+#ifdef __linux__
+    if (! cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[slot % cpus.size()], &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error)
+        {
+            std::cerr << "Cannot pin thread " << name << " to CPU " << cpus[slot % cpus.size()]
+                      << ": " << strerror(error) << std::endl;
+            ok = false;
+        }
+    }
+#else
+    if (! cpus.empty())
+    {
+        std::cerr << "CPU affinity is only supported on Linux" << std::endl;
+        ok = false;
+    }
+#endif
+    if (priority > 0)
+    {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (error)
+        {
+            std::cerr << "Cannot set SCHED_FIFO priority " << priority << " for thread " << name
+                      << ": " << strerror(error) << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool ThreadPlacement::confine(const std::string &name) const
+{
+    if (cpus.empty())
+        return true;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i=0; i<cpus.size(); ++i)
+        CPU_SET(cpus[i], &set);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error)
+    {
+        std::cerr << "Cannot confine thread " << name << " to " << toString()
+                  << ": " << strerror(error) << std::endl;
+        return false;
+    }
+    return true;
+#else
+    std::cerr << "CPU affinity is only supported on Linux" << std::endl;
+    return false;
+#endif
+}
+
+std::string ThreadPlacement::toString() const
+{
+    std::ostringstream buf;
+    if (cpus.empty())
+        buf << "any CPU";
+    else
+    {
+        buf << "CPUs ";
+        for (size_t i=0; i<cpus.size(); ++i)
+            buf << (i > 0 ? "," : "") << cpus[i];
+    }
+    if (priority > 0)
+        buf << ", SCHED_FIFO " << priority;
+    else
+        buf << ", default scheduling";
+    return buf.str();
+}
+
+bool lockMemory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        std::cerr << "Cannot lock memory: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}} // namespace neutronServer, epics
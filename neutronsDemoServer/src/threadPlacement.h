@@ -0,0 +1,84 @@
+/* threadPlacement.h
+ *
+ * See file LICENSE that is included with this distribution.
+ */
+#ifndef __THREAD_PLACEMENT_H__
+#define __THREAD_PLACEMENT_H__
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace epics { namespace neutronServer {
+
+/** Parse list like "2-5,8" into 2, 3, 4, 5, 8
+ *  @throws std::runtime_error for invalid list
+ */
+std::vector<int> parseCPUList(const std::string &list);
+
+/** CPU affinity and real-time priority for the server threads
+ *
+ *  On shared hosts, threads that migrate between cores
+ *  or get preempted show up as pulse timing jitter.
+ *  Each thread calls apply() at the start of its run(),
+ *  using its slot to pick a CPU from the list.
+ */
+class ThreadPlacement
+{
+public:
+    /** Slots of the server threads */
+    enum Slot
+    {
+        /** Thread that schedules the pulses, 'processor' */
+        PROCESSOR = 0,
+        /** PulsePublisher */
+        PUBLISHER = 1,
+        /** First event worker, further workers use the following slots */
+        WORKER = 2
+    };
+
+    /** @param cpus CPU list like "2-5,8", slot i uses the i'th CPU in the list,
+     *              wrapping around. Empty to keep the default affinity.
+     *  @param priority SCHED_FIFO priority 1..99, 0 to keep the default scheduling
+     *  @throws std::runtime_error for invalid CPU list or priority
+     */
+    ThreadPlacement(const std::string &cpus = "", int priority = 0);
+
+    bool isEnabled() const
+    {
+        return !cpus.empty()  ||  priority > 0;
+    }
+
+    /** Apply affinity and priority to the calling thread
+     *  @param slot Slot of the thread
+     *  @param name Thread name for messages
+     *  @return false if affinity or priority could not be set, details on std::cerr
+     */
+    bool apply(size_t slot, const std::string &name) const;
+
+    /** Restrict the calling thread to all CPUs in the list.
+     *  Threads that it starts later inherit this affinity.
+     *  Priority is not changed.
+     *  @return false on error, details on std::cerr
+     */
+    bool confine(const std::string &name) const;
+
+    /** @return Description like "CPUs 2,3,4 SCHED_FIFO 50" */
+    std::string toString() const;
+
+private:
+    std::vector<int> cpus;
+    int priority;
+};
+
+/** Lock current and future memory of the process into RAM
+ *
+ *  Together with the pre-faulted ArrayPool buffers,
+ *  this avoids page faults while handling pulses.
+ *
+ *  @return false on error, for example missing privileges, details on std::cerr
+ */
+bool lockMemory();
+
+}} // namespace neutronServer, epics
+#endif // __THREAD_PLACEMENT_H__
@@ -6,29 +6,86 @@
  *
  * @author Kay Kasemir
  */
+#include <sched.h>
+#ifdef __linux__
+#   include <unistd.h>
+#   include <sys/syscall.h>
+#   include <linux/futex.h>
+#endif
 #include <workerRunnable.h>
 
 namespace epics { namespace neutronServer {
 
+/** Number of checks before blocking in waitWhileEquals */
+static const int SPIN_COUNT = 2000;
+
+void WorkerRunnable::waitWhileEquals(std::atomic<uint32_t> &sequence, uint32_t value,
+                                     const std::atomic<bool> *run)
+{
+    for (int i=0; i<SPIN_COUNT; ++i)
+        if (sequence.load() != value  ||  (run  &&  ! *run))
+            return;
+    while (sequence.load() == value  &&  (! run  ||  *run))
+    {
+#ifdef __linux__
+        // Returns right away if sequence no longer has that value
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int), "futex needs 32 bit word");
+        syscall(SYS_futex, reinterpret_cast<int *>(&sequence), FUTEX_WAIT_PRIVATE, int(value), 0, 0, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+void WorkerRunnable::wake(std::atomic<uint32_t> &sequence, int waiters)
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<int *>(&sequence), FUTEX_WAKE_PRIVATE, waiters, 0, 0, 0);
+#endif
+}
+
+void WorkerRunnable::startWork()
+{
+    submitted_ns = NanoTimer::getCurrentNanosecs();
+    ++requested;
+    wake(requested);
+}
+
+void WorkerRunnable::waitForCompletion()
+{
+    uint32_t target = requested.load();
+    uint32_t done;
+    while ((done = completed.load()) != target)
+        waitWhileEquals(completed, done);
+}
+
 void WorkerRunnable::run()
 {
-    while (do_run)
+    onStart();
+    uint32_t handled = 0;
+    while (true)
     {
-        if (! new_work.wait(0.5))
-            continue; // check is_running, wait again
+        waitWhileEquals(requested, handled);
+        if (! do_run)
+            break;
+        handled = requested.load();
+        wakeup_latency.add(NanoTimer::getCurrentNanosecs() - submitted_ns);
 
         doWork();
 
         // Signal that we're done
-        work_completed.signal();
+        completed = handled;
+        wake(completed);
     }
     thread_exited.signal();
 }
 
 
 void WorkerRunnable::shutdown()
-{   // Request thread to exit
+{   // Request thread to exit, wake it up
     do_run = false;
+    ++requested;
+    wake(requested);
     thread_exited.wait(5.0);
 }
 
@@ -8,17 +8,26 @@
  */
 #ifndef __WORKER_RUNNABLE_H__
 #define __WORKER_RUNNABLE_H__
+#include <atomic>
+#include <stdint.h>
 #include <epicsEvent.h>
 #include <epicsThread.h>
+#include "nanoTimer.h"
 
 namespace epics { namespace neutronServer {
 
-/** Runnable that performs work */
+/** Runnable that performs work
+ *
+ *  Work requests and completions are handed off via atomic
+ *  sequence numbers.
+ *  Waiting spins briefly, then blocks on a futex,
+ *  which wakes up faster than an epicsEvent round trip.
+ */
 class WorkerRunnable : public epicsThreadRunable
 {
 public:
     WorkerRunnable()
-    : do_run(true)
+    : do_run(true), requested(0), completed(0), submitted_ns(0)
     {}
 
     void run();
@@ -26,28 +35,43 @@ public:
     /** Exit the runnable and thus thread */
     void shutdown();
 
+    /** Time from startWork() until the worker thread picked up the work */
+    NanoTimer wakeup_latency;
+
+    /** Wait while sequence has given value
+     *  @param run Optional flag, also returns when it's false. Set it, then wake().
+     */
+    static void waitWhileEquals(std::atomic<uint32_t> &sequence, uint32_t value,
+                                const std::atomic<bool> *run = 0);
+
+    /** Wake threads waiting for sequence to change
+     *  @param waiters Number of threads to wake
+     */
+    static void wake(std::atomic<uint32_t> &sequence, int waiters = 1);
+
 protected:
-    void startWork()
-    {
-        new_work.signal();
-    }
+    void startWork();
+    /** Called in the worker thread before it handles any work,
+     *  for example to set its CPU affinity
+     */
+    virtual void onStart() {}
     virtual void doWork() = 0;
-    void waitForCompletion()
-    {
-        work_completed.wait();
-    }
+    void waitForCompletion();
 
 private:
     /** Should thread run? */
-    bool do_run;
+    std::atomic<bool> do_run;
     /** Did thread exit? */
     epicsEvent thread_exited;
 
-    /** Has new work request been submitted? */
-    epicsEvent new_work;
+    /** Sequence number of last submitted work request */
+    std::atomic<uint32_t> requested;
+
+    /** Sequence number of last completed work request */
+    std::atomic<uint32_t> completed;
 
-    /** Signaled when work has completed */
-    epicsEvent work_completed;
+    /** Time of last startWork() */
+    std::atomic<uint64_t> submitted_ns;
 };
 
 }} // namespace neutronServer, epics
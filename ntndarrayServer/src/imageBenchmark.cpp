@@ -0,0 +1,153 @@
+/* imageBenchmark.cpp */
+/**
+ * Copyright - See the COPYRIGHT that is included with this distribution.
+ * EPICS pvData is distributed subject to a Software License Agreement found
+ * in file LICENSE that is included with this distribution.
+ */
+/**
+ * Time to compute the rotated image for a range of image sizes,
+ * as JSON to track changes between releases.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "epicsv4Grayscale.h"
+
+using namespace std;
+using namespace epics::pvData;
+using namespace epics::ntndarrayServer;
+
+static uint64_t getMonotonicNanosecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/** Scale the demo image to the requested size, nearest neighbour */
+static vector<int16_t> scaleImage(size_t width, size_t height)
+{
+    vector<int16_t> image(width * height);
+    for (size_t y = 0; y < height; ++y)
+    {
+        size_t sy = y * epicsv4_height / height;
+        for (size_t x = 0; x < width; ++x)
+            image[y*width + x] = epicsv4_raw[sy*epicsv4_width + x * epicsv4_width / width];
+    }
+    return image;
+}
+
+static void benchmark(ostream &out, bool first, size_t width, size_t height, size_t runs)
+{
+    vector<int16_t> source = scaleImage(width, height);
+    RotatingImageGeneratorPtr generator = RotatingImageGenerator::create(&source[0], width, height);
+    PVShortArray::svector image;
+
+    // Median rather than average, so that a few preempted runs
+    // don't look like a regression
+    vector<uint64_t> ns(runs);
+    float angle = 0.0f;
+    for (size_t run = 0; run < runs; ++run)
+    {
+        uint64_t start = getMonotonicNanosecs();
+        generator->fillSharedVector(image, angle);
+        ns[run] = getMonotonicNanosecs() - start;
+        angle += 1.0f;
+    }
+    sort(ns.begin(), ns.end());
+    uint64_t p50 = ns[runs / 2];
+    size_t pixels = width * height;
+
+    out << (first ? "" : ",\n")
+        << "    { \"name\": \"rotate_image\", \"width\": " << width << ", \"height\": " << height
+        << ", \"runs\": " << runs
+        << ", \"p50_ns\": " << p50
+        << ", \"p99_ns\": " << ns[(runs * 99) / 100]
+        << ", \"max_ns\": " << ns[runs - 1]
+        << ", \"ns_per_pixel\": " << double(p50) / pixels
+        << " }";
+}
+
+static void help(const char *name)
+{
+    cout << "USAGE: " << name << " [options]" << endl;
+    cout << "  -h        : Help" << endl;
+    cout << "  -s sizes  : Comma-separated image sizes WIDTHxHEIGHT (default 173x184,512x512,1024x1024,2048x2048)" << endl;
+    cout << "  -r runs   : Runs for each size (default 100)" << endl;
+    cout << "  -o file   : Write JSON to file instead of stdout" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    string sizes = "173x184,512x512,1024x1024,2048x2048";
+    size_t runs = 100;
+    string filename;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            sizes = optarg;
+            break;
+        case 'r':
+            runs = (size_t)atol(optarg);
+            break;
+        case 'o':
+            filename = optarg;
+            break;
+        case 'h':
+            help(argv[0]);
+            return 0;
+        default:
+            help(argv[0]);
+            return -1;
+        }
+    }
+    if (runs < 1)
+        runs = 1;
+
+    ofstream file;
+    if (! filename.empty())
+    {
+        file.open(filename.c_str());
+        if (! file)
+        {
+            cerr << "Cannot write " << filename << endl;
+            return -1;
+        }
+    }
+    ostream &out = filename.empty() ? cout : file;
+
+    out << "{\n  \"benchmark\": \"imageBenchmark\",\n  \"results\": [\n";
+    bool first = true;
+    istringstream items(sizes);
+    string item;
+    while (getline(items, item, ','))
+    {
+        size_t width = 0, height = 0;
+        char x;
+        istringstream size(item);
+        if (! (size >> width >> x >> height)  ||  x != 'x'  ||  width < 2  ||  height < 2)
+        {
+            cerr << "Invalid image size '" << item << "'" << endl;
+            return -1;
+        }
+        benchmark(out, first, width, height, runs);
+        first = false;
+    }
+    out << "\n  ]\n}" << endl;
+
+    return 0;
+}
@@ -20,17 +20,19 @@ using namespace epics::pvDatabase;
 using namespace epics::nt;
 using std::tr1::static_pointer_cast;
 using std::tr1::dynamic_pointer_cast;
+using epics::neutronServer::ThreadPlacement;
 using std::string;
 
 NTNDArrayRecordPtr NTNDArrayRecord::create(
-    string const & recordName)
+    string const & recordName,
+    ThreadPlacement const & placement)
 {
 
     PVStructurePtr pvStructure = NTNDArray::createBuilder()->
         addTimeStamp()->createPVStructure();
 
     NTNDArrayRecordPtr pvRecord(
-        new NTNDArrayRecord(recordName,pvStructure));
+        new NTNDArrayRecord(recordName,pvStructure,placement));
 
     if(!pvRecord->init()) pvRecord.reset();
 
@@ -39,8 +41,10 @@ NTNDArrayRecordPtr NTNDArrayRecord::create(
 
 NTNDArrayRecord::NTNDArrayRecord(
     string const & recordName,
-    PVStructurePtr const & pvStructure)
+    PVStructurePtr const & pvStructure,
+    ThreadPlacement const & placement)
 : PVRecord(recordName,pvStructure),
+  placement(placement),
   pvStructure(pvStructure),
   count(0),
   firstTime(true)
@@ -67,7 +71,7 @@ bool NTNDArrayRecord::init()
     initPVRecord();
     NTNDArrayRecordPtr xxx = dynamic_pointer_cast<NTNDArrayRecord>(shared_from_this());
     
-    ntndarrayServerThread = NTNDArrayRecordThreadPtr(new NTNDArrayRecordThread(xxx));
+    ntndarrayServerThread = NTNDArrayRecordThreadPtr(new NTNDArrayRecordThread(xxx, placement));
     ntndarrayServerThread->init();
     ntndarrayServerThread->start();
     return true;
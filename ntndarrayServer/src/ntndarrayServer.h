@@ -19,6 +19,7 @@
 #include <epicsThread.h>
 #include <string>
 
+#include <threadPlacement.h>
 #include "image.h"
 
 namespace epics { namespace ntndarrayServer { 
@@ -36,8 +37,12 @@ class NTNDArrayRecord :
 {
 public:
     POINTER_DEFINITIONS(NTNDArrayRecord);
+    /** @param recordName Name of the record
+     *  @param placement CPU affinity and priority of the thread that updates the image
+     */
     static NTNDArrayRecordPtr create(
-        std::string const & recordName);
+        std::string const & recordName,
+        epics::neutronServer::ThreadPlacement const & placement = epics::neutronServer::ThreadPlacement());
     virtual ~NTNDArrayRecord();
     virtual void destroy();
     virtual bool init();
@@ -45,8 +50,10 @@ public:
 
 private:
     NTNDArrayRecord(std::string const & recordName,
-        epics::pvData::PVStructurePtr const & pvStructure);
+        epics::pvData::PVStructurePtr const & pvStructure,
+        epics::neutronServer::ThreadPlacement const & placement);
     NTNDArrayRecordThreadPtr ntndarrayServerThread;
+    epics::neutronServer::ThreadPlacement placement;
 
     void setValue(epics::pvData::PVShortArray::const_svector const & bytes);
     void setDimension(const int32_t * dims, size_t ndims);
@@ -73,7 +80,8 @@ class NTNDArrayRecordThread :
 {
 public:
     POINTER_DEFINITIONS(NTNDArrayRecord);
-    NTNDArrayRecordThread(NTNDArrayRecordPtr const &  ntndarrayServer);
+    NTNDArrayRecordThread(NTNDArrayRecordPtr const &  ntndarrayServer,
+        epics::neutronServer::ThreadPlacement const & placement);
     virtual ~NTNDArrayRecordThread(){};
     void init();
     void start();
@@ -87,6 +95,7 @@ private:
     epics::pvData::Mutex mutex;
     std::auto_ptr<epicsThread> thread;
     double timeOut;
+    epics::neutronServer::ThreadPlacement placement;
 };
 
 }}
@@ -42,7 +42,21 @@ int main(int argc,char *argv[])
     if (argc > 1)
         recordName = argv[1];
 
-    pvRecord = NTNDArrayRecord::create(recordName);
+    // Optional CPU list and SCHED_FIFO priority for the image thread
+    epics::neutronServer::ThreadPlacement placement;
+    try
+    {
+        placement = epics::neutronServer::ThreadPlacement(argc > 2 ? argv[2] : "",
+                                                          argc > 3 ? atoi(argv[3]) : 0);
+    }
+    catch (std::exception &ex)
+    {
+        cerr << ex.what() << endl;
+        cerr << "USAGE: " << argv[0] << " [recordName [cpus [fifoPriority]]]" << endl;
+        return 1;
+    }
+
+    pvRecord = NTNDArrayRecord::create(recordName, placement);
     result = master->addRecord(pvRecord);
 
     if (result)
@@ -43,15 +43,30 @@ using std::cout;
 using std::endl;
 
 static const iocshArg testArg0 = { "recordName", iocshArgString };
+static const iocshArg testArg1 = { "cpus", iocshArgString };
+static const iocshArg testArg2 = { "fifoPriority", iocshArgInt };
 static const iocshArg *testArgs[] = {
-    &testArg0};
+    &testArg0, &testArg1, &testArg2};
 
 static const iocshFuncDef ntndarrayServerFuncDef = {
-    "ntndarrayServerCreateRecord", 1, testArgs};
+    "ntndarrayServerCreateRecord", 3, testArgs};
 static void ntndarrayServerCallFunc(const iocshArgBuf *args)
 {
     char *recordName = args[0].sval;
-    NTNDArrayRecordPtr record = NTNDArrayRecord::create(recordName);
+    // Default affinity and scheduling unless requested
+    char *cpus = args[1].sval;
+    int fifoPriority = args[2].ival;
+    epics::neutronServer::ThreadPlacement placement;
+    try
+    {
+        placement = epics::neutronServer::ThreadPlacement(cpus ? cpus : "", fifoPriority);
+    }
+    catch (std::exception &ex)
+    {
+        cout << ex.what() << endl;
+        return;
+    }
+    NTNDArrayRecordPtr record = NTNDArrayRecord::create(recordName, placement);
     bool result = PVDatabase::getMaster()->addRecord(record);
     if(!result) cout << "recordname" << " not added" << endl;
 }
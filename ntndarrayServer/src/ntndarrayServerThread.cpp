@@ -19,13 +19,15 @@ using namespace epics::pvDatabase;
 using std::string;
 
 
-NTNDArrayRecordThread::NTNDArrayRecordThread(NTNDArrayRecordPtr const & ntndarrayServer)
+NTNDArrayRecordThread::NTNDArrayRecordThread(NTNDArrayRecordPtr const & ntndarrayServer,
+    epics::neutronServer::ThreadPlacement const & placement)
 : 
   ntndarrayServer(ntndarrayServer),
   isDestroyed(false),
   runReturned(false),
   threadName("ntndarrayServer"),
-  timeOut(0.1)
+  timeOut(0.1),
+  placement(placement)
 {
 }
 
@@ -41,6 +43,8 @@ void NTNDArrayRecordThread::init()
 
 void NTNDArrayRecordThread::run()
 {
+    if (placement.isEnabled())
+        placement.apply(epics::neutronServer::ThreadPlacement::PUBLISHER, threadName);
     while (true)
     {
         epicsThreadSleep(timeOut);